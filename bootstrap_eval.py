@@ -10,8 +10,12 @@ if len(argv) < 3:
   exit()
 
 
-data = np.load(argv[1])
-x,y = data['training_x'], data['training_y']
+if argv[1].endswith(".npz"):
+  data = np.load(argv[1])
+  x,y = data['training_x'], data['training_y']
+else:
+  #output prefix of gen_training_set, the arrays are mapped rather than read in
+  x,y = np.load(argv[1] + "_x.npy", mmap_mode='r'), np.load(argv[1] + "_y.npy", mmap_mode='r')
 
 
 training_dict = make_training_dict(x, y)
@@ -0,0 +1,47 @@
+#Read the packed training positions written by the engine (gen_training_set or gen_training_positions with
+#an output file ending in .npy). The file is mapped, so sets larger than memory can be sliced like arrays.
+import numpy as np
+
+PIECE_CHARS = " PNBRQK  pnbrqk"
+VALUE_NONE = 32002
+#PawnValueEg, gen_training_set evaluations are in pawns
+PAWN_VALUE = 258
+RESULT_UNKNOWN = 2
+
+def load(path):
+  return np.load(path, mmap_mode='r')
+
+#evaluations in pawns from White's point of view, NaN where the position was not evaluated
+def evals(records):
+  e = records['eval'].astype(np.float32)
+  e[records['eval'] == VALUE_NONE] = np.nan
+  return e / PAWN_VALUE
+
+def fen(record):
+  board = [' '] * 64
+  occupied = int(record['occupied'])
+  pieces = record['pieces']
+  n = 0
+  for sq in range(64):
+    if occupied >> sq & 1:
+      board[sq] = PIECE_CHARS[(int(pieces[n // 2]) >> (4 * (n & 1))) & 0xF]
+      n += 1
+
+  ranks = []
+  for r in range(7, -1, -1):
+    row, empty = "", 0
+    for f in range(8):
+      c = board[8 * r + f]
+      if c == ' ':
+        empty += 1
+        continue
+      if empty: row += str(empty)
+      row, empty = row + c, 0
+    ranks.append(row + (str(empty) if empty else ""))
+
+  flags = int(record['flags'])
+  castling = "".join(c for i, c in enumerate("KQkq") if flags >> (i + 1) & 1) or "-"
+  ep = int(record['ep_square'])
+  ep = "-" if ep == 64 else "abcdefgh"[ep % 8] + str(ep // 8 + 1)
+  return "%s %s %s %s %d %d" % ("/".join(ranks), "b" if flags & 1 else "w", castling, ep,
+                                int(record['rule50']), 1 + int(record['ply']) // 2)
@@ -0,0 +1,99 @@
+/*
+  Stockfish, a UCI chess playing engine derived from Glaurung 2.1
+  Copyright (C) 2004-2008 Tord Romstad (Glaurung author)
+  Copyright (C) 2008-2015 Marco Costalba, Joona Kiiski, Tord Romstad
+  Copyright (C) 2015-2016 Marco Costalba, Joona Kiiski, Gary Linscott, Tord Romstad
+
+  Stockfish is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Stockfish is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <unistd.h>  // For fsync
+
+#include "DedupTable.h"
+
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "Entries are saved as they are");
+
+
+/// DedupTable::resize() empties the table and makes room for positions distinct
+/// positions, keeping it at most half full.
+
+void DedupTable::resize(size_t positions) {
+
+  size_t n = 1024;
+  while (n < 2 * positions)
+      n *= 2;
+
+  entries.reset(new std::atomic<uint32_t>[n]());
+  mask = n - 1;
+}
+
+
+/// DedupTable::take() counts the position with the given key and returns true,
+/// unless it was already taken maxCount times.
+
+bool DedupTable::take(Key key, int maxCount) {
+
+  assert(mask && 0 < maxCount && maxCount <= MaxCount);
+
+  const uint32_t tag = std::max(uint32_t(key >> 36), 1U) << 4; // 0 marks an empty entry
+
+  for (size_t i = size_t(key) & mask, probes = 0; probes <= mask; i = (i + 1) & mask, ++probes)
+  {
+      uint32_t e = entries[i].load(std::memory_order_relaxed);
+
+      // A failed exchange reloads e, and another thread may have taken the entry
+      while (!e || (e & ~0xFU) == tag)
+      {
+          if (int(e & 0xF) >= maxCount)
+              return false;
+
+          if (entries[i].compare_exchange_weak(e, e ? e + 1 : tag | 1, std::memory_order_relaxed))
+              return true;
+      }
+  }
+
+  return true; // Full, which resize() makes room to avoid
+}
+
+
+/// DedupTable::save() writes the entries to the file at path and waits until
+/// they are on disk, and load() reads them back into a table of the same size.
+
+bool DedupTable::save(const std::string& path) const {
+
+  FILE* f = fopen(path.c_str(), "wb");
+  if (!f)
+      return false;
+
+  bool ok =    fwrite(entries.get(), sizeof(uint32_t), mask + 1, f) == mask + 1
+            && !fflush(f)
+            && !fsync(fileno(f));
+
+  return (fclose(f) == 0) && ok;
+}
+
+bool DedupTable::load(const std::string& path) {
+
+  FILE* f = fopen(path.c_str(), "rb");
+  if (!f)
+      return false;
+
+  bool ok = fread(entries.get(), sizeof(uint32_t), mask + 1, f) == mask + 1 && fgetc(f) == EOF;
+  fclose(f);
+  return ok;
+}
@@ -0,0 +1,57 @@
+/*
+  Stockfish, a UCI chess playing engine derived from Glaurung 2.1
+  Copyright (C) 2004-2008 Tord Romstad (Glaurung author)
+  Copyright (C) 2008-2015 Marco Costalba, Joona Kiiski, Tord Romstad
+  Copyright (C) 2015-2016 Marco Costalba, Joona Kiiski, Gary Linscott, Tord Romstad
+
+  Stockfish is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Stockfish is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef DEDUPTABLE_H_INCLUDED
+#define DEDUPTABLE_H_INCLUDED
+
+#include <atomic>
+#include <memory>
+#include <string>
+
+#include "types.h"
+
+/// DedupTable counts how many times each position, by its Zobrist key, has gone
+/// into a training set, so that a position can be kept at most a few times. It
+/// is an open addressing hash set of 32 bit entries, each holding the upper 28
+/// bits of a key and a 4 bit count. The lower bits of the key pick the entry,
+/// so two positions only share one when nearly all of their key bits are equal.
+/// Threads may take() positions at the same time.
+
+class DedupTable {
+
+public:
+  static const int MaxCount = 15;
+
+  DedupTable() : mask(0) {}
+  DedupTable(const DedupTable&) = delete;
+  DedupTable& operator=(const DedupTable&) = delete;
+
+  void resize(size_t positions);
+  bool take(Key key, int maxCount);
+  bool save(const std::string& path) const;
+  bool load(const std::string& path);
+
+private:
+  std::unique_ptr<std::atomic<uint32_t>[]> entries;
+  size_t mask;
+};
+
+#endif // #ifndef DEDUPTABLE_H_INCLUDED
@@ -0,0 +1,111 @@
+#ifndef FixedNet_h
+#define FixedNet_h
+#include "Layer.h"
+#include "LayerKernels.h"
+
+//A dense layer whose sizes and activation are known at compile time, reading the arrays of a loaded Layer
+//in place, so a network mapped from a shared weight file is not copied per process. activate() inlines the
+//shared kernel with constant bounds, so it is unrolled for these sizes and has no activation dispatch.
+template<int In, int Out, Activation Act>
+struct FixedLayer
+{
+  static const int Inputs = In;
+  static const int Outputs = Out;
+  static const int Stride = (In + LAYER_ALIGN - 1) / LAYER_ALIGN * LAYER_ALIGN;
+
+  const float * weights;
+  const float * biases;
+
+  //use the weights of a loaded Layer, false if its sizes differ. They must stay loaded while this is used.
+  bool load(const Layer& layer)
+  {
+    if (layer.inputs != In || layer.outputs != Out || layer.stride != Stride)
+      return false;
+    weights = layer._weights;
+    biases = layer._biases;
+    return true;
+  }
+
+  void activate(const float * in, float * out) const
+  {
+    LayerKernels::gemv<Act>(weights, biases, Out, In, Stride, in, out);
+  }
+};
+
+//The first layers, each reading its own consecutive block of the feature vector and writing
+//its own consecutive block of the first layer output. Unrolled by recursion over the list.
+template<typename... Subnets> struct FixedFirstLayers;
+
+template<> struct FixedFirstLayers<>
+{
+  static const int Inputs = 0;
+  static const int Outputs = 0;
+  bool load(Layer * const *) { return true; }
+  void activate(const int *, float *) const {}
+};
+
+template<typename S, typename... Rest>
+struct FixedFirstLayers<S, Rest...>
+{
+  static const int Inputs = S::Inputs + FixedFirstLayers<Rest...>::Inputs;
+  static const int Outputs = S::Outputs + FixedFirstLayers<Rest...>::Outputs;
+
+  S head;
+  FixedFirstLayers<Rest...> tail;
+
+  bool load(Layer * const * layers) { return head.load(*layers[0]) && tail.load(layers + 1); }
+
+  void activate(const int * features, float * out) const
+  {
+    alignas(LAYER_ALIGN * sizeof(float)) float in[S::Stride];
+    for (int j = 0; j < S::Inputs; j++)
+      in[j] = (float)features[j];
+    head.activate(in, out);
+    tail.activate(features + S::Inputs, out + S::Outputs);
+  }
+};
+
+//A KatyushaNet with its topology fixed at compile time: the Subnets first layers, a relu hidden
+//layer of Hidden units reading all their outputs, and a tanh output layer of Out units.
+//Every activation lives on the stack, so one FixedNet can be evaluated by any number of threads.
+template<int Hidden, int Out, typename... Subnets>
+class FixedNet
+{
+public:
+  typedef FixedFirstLayers<Subnets...> First;
+  static const int Features = First::Inputs;
+  static const int FirstOutputs = First::Outputs;
+
+  //use the weights of the loaded runtime layers, false if the topology differs
+  bool load(Layer * const * first_layers, int nfirst, const Layer& layer1, const Layer& outlayer)
+  {
+    return nfirst == int(sizeof...(Subnets))
+        && first.load(first_layers)
+        && hidden.load(layer1)
+        && out.load(outlayer);
+  }
+
+  float evaluate(const int * features) const
+  {
+    alignas(LAYER_ALIGN * sizeof(float)) float first_out[FirstOutputs];
+    first.activate(features, first_out);
+    return finish(first_out);
+  }
+
+  //the hidden and output layers from the first layer activations
+  float finish(const float * first_out) const
+  {
+    alignas(LAYER_ALIGN * sizeof(float)) float h[Hidden];
+    float result[Out];
+    hidden.activate(first_out, h);
+    out.activate(h, result);
+    return result[0];
+  }
+
+private:
+  First first;
+  FixedLayer<FirstOutputs, Hidden, ACT_RELU> hidden;
+  FixedLayer<Hidden, Out, ACT_TANH> out;
+};
+
+#endif
@@ -0,0 +1,764 @@
+/*
+  Stockfish, a UCI chess playing engine derived from Glaurung 2.1
+  Copyright (C) 2004-2008 Tord Romstad (Glaurung author)
+  Copyright (C) 2008-2015 Marco Costalba, Joona Kiiski, Tord Romstad
+  Copyright (C) 2015-2016 Marco Costalba, Joona Kiiski, Gary Linscott, Tord Romstad
+
+  Stockfish is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Stockfish is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <fcntl.h>     // For open
+#include <sys/mman.h>  // For mmap, munmap
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "bitboard.h"
+#include "GameReader.h"
+#include "movegen.h"
+
+namespace {
+
+  const char* StartFEN = "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1";
+
+  bool is_space(char c) { return c == ' ' || c == '\n' || c == '\r' || c == '\t'; }
+
+  // True if c is one of chars. Unlike std::strchr, the terminating null is not.
+  bool one_of(char c, const char* chars) { return c && std::strchr(chars, c); }
+
+  // A line is blank if it has nothing but its line end
+  bool blank_line(const char* p, const char* end) {
+    return p < end && (*p == '\n' || (*p == '\r' && p + 1 < end && p[1] == '\n'));
+  }
+
+  // The start of the line after the one p is in, or end
+  const char* next_line(const char* p, const char* end) {
+    const char* nl = (const char*)std::memchr(p, '\n', size_t(end - p));
+    return nl ? nl + 1 : end;
+  }
+
+  bool equals(const char* s, const char* e, const char* str) {
+    return size_t(e - s) == std::strlen(str) && !std::memcmp(s, str, size_t(e - s));
+  }
+
+  bool is_result(const char* s, const char* e) {
+    return equals(s, e, "1-0") || equals(s, e, "0-1") || equals(s, e, "1/2-1/2") || equals(s, e, "*");
+  }
+
+  int to_result(const char* s, const char* e) {
+    return equals(s, e, "1-0")     ? GameReader::WHITE_WINS
+         : equals(s, e, "0-1")     ? GameReader::BLACK_WINS
+         : equals(s, e, "1/2-1/2") ? GameReader::DRAW : GameReader::RESULT_UNKNOWN;
+  }
+
+  // A move in long algebraic notation, like e2e4 or e7e8q. Castling is written
+  // as the king's move (standard chess).
+  Move lan_to_move(const Position& pos, const char* s, size_t len) {
+
+    Square from = make_square(File(s[0] - 'a'), Rank(s[1] - '1'));
+    Square to   = make_square(File(s[2] - 'a'), Rank(s[3] - '1'));
+    Piece pc = pos.piece_on(from);
+    Move m;
+
+    if (pc == NO_PIECE || color_of(pc) != pos.side_to_move())
+        return MOVE_NONE;
+
+    if (len == 5)
+    {
+        char promotion = char(std::tolower((unsigned char)s[4]));
+        if (!one_of(promotion, "nbrq"))
+            return MOVE_NONE;
+
+        m = make<PROMOTION>(from, to, PieceType(KNIGHT + (std::strchr("nbrq", promotion) - "nbrq")));
+    }
+    else if (type_of(pc) == KING && distance<File>(from, to) == 2)
+        m = make<CASTLING>(from, make_square(to > from ? FILE_H : FILE_A, rank_of(from)));
+
+    else if (type_of(pc) == PAWN && to == pos.ep_square())
+        m = make<ENPASSANT>(from, to);
+
+    else
+        m = make_move(from, to);
+
+    return pos.pseudo_legal(m) && pos.legal(m, pos.pinned_pieces(pos.side_to_move())) ? m : MOVE_NONE;
+  }
+
+  // A move in standard algebraic notation, like Nbd7, exd5, e8=Q+ or O-O-O,
+  // found among the legal moves.
+  Move san_to_move(const Position& pos, const char* s, size_t len) {
+
+    while (len && one_of(s[len - 1], "+#!?"))
+        --len;
+
+    if (len >= 3 && (s[0] == 'O' || s[0] == '0'))
+    {
+        bool queenSide = len >= 5;
+        for (const auto& m : MoveList<LEGAL>(pos))
+            if (type_of(m) == CASTLING && (to_sq(m) < from_sq(m)) == queenSide)
+                return m;
+        return MOVE_NONE;
+    }
+
+    PieceType pt = PAWN, promotion = NO_PIECE_TYPE;
+    size_t i = 0;
+
+    if (len && one_of(s[0], "NBRQK"))
+        pt = PieceType(KNIGHT + (std::strchr("NBRQK", s[0]) - "NBRQK")), i = 1;
+
+    else if (len >= 2 && one_of(s[len - 1], "NBRQ"))
+    {
+        promotion = PieceType(KNIGHT + (std::strchr("NBRQ", s[len - 1]) - "NBRQ"));
+        len -= s[len - 2] == '=' ? 2 : 1;
+    }
+
+    if (   len < i + 2
+        || s[len - 2] < 'a' || s[len - 2] > 'h' || s[len - 1] < '1' || s[len - 1] > '8')
+        return MOVE_NONE;
+
+    Square to = make_square(File(s[len - 2] - 'a'), Rank(s[len - 1] - '1'));
+    int fromFile = -1, fromRank = -1;
+
+    for (size_t k = i; k < len - 2; ++k)
+        if (s[k] >= 'a' && s[k] <= 'h')
+            fromFile = s[k] - 'a';
+        else if (s[k] >= '1' && s[k] <= '8')
+            fromRank = s[k] - '1';
+        else if (s[k] != 'x' && s[k] != ':' && s[k] != '-')
+            return MOVE_NONE;
+
+    for (const auto& m : MoveList<LEGAL>(pos))
+    {
+        Square from = from_sq(m);
+
+        if (   type_of(m) == CASTLING
+            || to_sq(m) != to
+            || type_of(pos.piece_on(from)) != pt
+            || (type_of(m) == PROMOTION ? promotion_type(m) : NO_PIECE_TYPE) != promotion
+            || (fromFile >= 0 && file_of(from) != fromFile)
+            || (fromRank >= 0 && rank_of(from) != fromRank))
+            continue;
+
+        return m;
+    }
+
+    return MOVE_NONE;
+  }
+
+  // The piece at a square of the placement field of a FEN, or ' ' if there is none
+  char fen_piece(const char* s, const char* e, Square sq) {
+
+    int r = RANK_8, f = FILE_A;
+
+    for ( ; s < e && *s != ' '; ++s)
+        if (*s == '/')
+            --r, f = FILE_A;
+        else if (*s >= '1' && *s <= '8')
+            f += *s - '0';
+        else if (r == rank_of(sq) && f == file_of(sq))
+            return *s;
+        else
+            ++f;
+
+    return ' ';
+  }
+
+  // Whether the FEN of a SetUp game can be given to Position::set(), which trusts
+  // it: 8 ranks of 8 squares with a king of each color, at most 16 pieces and 8
+  // pawns of each color and no pawns on the first and last ranks, the side to
+  // move, castling rights of kings and rooks still on their squares, and an en
+  // passant square behind the pawn that just moved.
+  bool valid_fen(const char* s, size_t len) {
+
+    const char* e = s + len;
+    const char* p = s;
+    int ranks = 1, files = 0, kings[COLOR_NB] = {}, pieces[COLOR_NB] = {}, pawns[COLOR_NB] = {};
+
+    for ( ; p < e && *p != ' '; ++p)
+    {
+        if (*p == '/')
+        {
+            if (files != 8)
+                return false;
+            ++ranks, files = 0;
+        }
+        else if (*p >= '1' && *p <= '8')
+            files += *p - '0';
+
+        else if (!one_of(*p, "PNBRQKpnbrqk") || ((*p == 'P' || *p == 'p') && (ranks == 1 || ranks == 8)))
+            return false;
+
+        else
+        {
+            Color c = *p >= 'a' ? BLACK : WHITE;
+            kings[c] += *p == 'K' || *p == 'k';
+            pawns[c] += *p == 'P' || *p == 'p';
+            ++pieces[c];
+            ++files;
+        }
+
+        if (files > 8)
+            return false;
+    }
+
+    if (ranks != 8 || files != 8 || kings[WHITE] != 1 || kings[BLACK] != 1)
+        return false;
+
+    // Position keeps at most 16 pieces of each color, PackedPosition 32 in all
+    for (Color c = WHITE; c <= BLACK; ++c)
+        if (pieces[c] > 16 || pawns[c] > 8)
+            return false;
+
+    // The side to move
+    if (e - p < 3 || !one_of(p[1], "wb") || p[2] != ' ')
+        return false;
+
+    Color us = p[1] == 'w' ? WHITE : BLACK;
+
+    // Castling rights
+    for (p += 3; p < e && *p != ' ' && *p != '-'; ++p)
+    {
+        Color c = *p == 'K' || *p == 'Q' ? WHITE : BLACK;
+        Square rsq = one_of(*p, "Kk") ? relative_square(c, SQ_H1)
+                   : one_of(*p, "Qq") ? relative_square(c, SQ_A1) : SQ_NONE;
+
+        if (   rsq == SQ_NONE
+            || fen_piece(s, e, relative_square(c, SQ_E1)) != (c == WHITE ? 'K' : 'k')
+            || fen_piece(s, e, rsq) != (c == WHITE ? 'R' : 'r'))
+            return false;
+    }
+
+    if (p < e && *p == '-')
+        ++p;
+
+    // The en passant square
+    if (p + 1 >= e || p[0] != ' ')
+        return false;
+
+    if (p[1] != '-')
+        return    p + 2 < e && p[1] >= 'a' && p[1] <= 'h'
+               && p[2] == (us == WHITE ? '6' : '3')
+               && (p + 3 == e || p[3] == ' ');
+
+    return p + 2 == e || p[2] == ' ';
+  }
+
+} // namespace
+
+
+/// GameFile::open() maps the file at path. A gzipped file is only checked to
+/// be readable, and whether it is PGN, as its GameReaders stream it. An empty
+/// file has no games.
+
+bool GameFile::open(const std::string& path) {
+
+  close();
+  name = path;
+
+  if (path.size() > 3 && !path.compare(path.size() - 3, 3, ".gz"))
+  {
+      gzFile in = gzopen(path.c_str(), "rb");
+      if (!in)
+          return false;
+
+      char head[256];
+      int n = gzread(in, head, sizeof(head));
+      int i = 0;
+      while (i < n && is_space(head[i]))
+          ++i;
+
+      gz = n >= 0;
+      isPgn = i < n && head[i] == '[';
+      gzclose(in);
+      return gz;
+  }
+
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+      return false;
+
+  bool ok = map(fd);
+  ::close(fd);
+  return ok;
+}
+
+
+/// GameFile::map() maps the file open as fd and finds out whether it is PGN
+
+bool GameFile::map(int fd) {
+
+  struct stat st;
+  if (fstat(fd, &st))
+      return false;
+
+  bytes = size_t(st.st_size);
+  mem = bytes ? mmap(nullptr, bytes, PROT_READ, MAP_SHARED, fd, 0) : nullptr;
+  if (mem == MAP_FAILED)
+  {
+      mem = nullptr;
+      bytes = 0;
+      return false;
+  }
+
+  if (mem)
+      madvise(mem, bytes, MADV_SEQUENTIAL);
+
+  const char* p = data();
+  while (p < data() + bytes && is_space(*p))
+      ++p;
+
+  isPgn = p < data() + bytes && *p == '[';
+  return true;
+}
+
+
+/// GameFile::close() unmaps the file
+
+void GameFile::close() {
+
+  if (mem)
+      munmap(mem, bytes);
+
+  mem = nullptr;
+  bytes = 0;
+  isPgn = gz = false;
+}
+
+
+/// GameFile::split() splits the file into n byte ranges of about the same size,
+/// returning their n + 1 bounds. Each range starts where a game does, right
+/// after a blank line or at the first tag pair of a PGN game, so every game
+/// falls into exactly one of them.
+
+std::vector<size_t> GameFile::split(int n) const {
+
+  if (gz)
+      return split_stream(n);
+
+  const char* end = data() + bytes;
+  std::vector<size_t> bounds(1, 0);
+
+  for (int k = 1; k < n; ++k)
+  {
+      // Finish the line the split point falls in, then the game
+      size_t b = std::max(bytes * k / n, bounds.back());
+      const char* p = b ? next_line(data() + b - 1, end) : data();
+
+      if (isPgn)
+      {
+          // The tag pairs of a game follow a line that is not one
+          const char* prev = p;
+          while (prev > data() && prev[-1] == '\n' && prev - 1 > data() && prev[-2] != '\n')
+              for (--prev; prev > data() && prev[-1] != '\n'; --prev) {}
+
+          bool afterTag = prev < p && *prev == '[';
+          for ( ; p < end && (*p != '[' || afterTag); p = next_line(p, end))
+              afterTag = *p == '[';
+      }
+      else
+      {
+          while (p < end && !blank_line(p, end))
+              p = next_line(p, end);
+
+          p = next_line(p, end);
+      }
+
+      bounds.push_back(size_t(p - data()));
+  }
+
+  bounds.push_back(bytes);
+  return bounds;
+}
+
+
+/// GameFile::split_stream() splits a streamed file, which is read through once
+/// to find where its games start. Up to MaxStarts of them are kept, and when
+/// there are more every other one is dropped. The bounds are the first starts
+/// kept after the split points.
+
+std::vector<size_t> GameFile::split_stream(int n) const {
+
+  const size_t MaxStarts = 1 << 16;
+
+  std::vector<size_t> starts, bounds(1, 0);
+  size_t spacing = 1;
+  GameReader reader(*this);
+  GameReader::Game g;
+
+  while (reader.next(g))
+      if (starts.empty() || g.offset - starts.back() >= spacing)
+      {
+          starts.push_back(g.offset);
+
+          if (starts.size() == MaxStarts)
+          {
+              for (size_t i = 0; i < MaxStarts / 2; ++i)
+                  starts[i] = starts[2 * i];
+
+              starts.resize(MaxStarts / 2);
+              spacing *= 2;
+          }
+      }
+
+  size_t total = reader.offset();
+
+  for (int k = 1; k < n; ++k)
+  {
+      auto it = std::lower_bound(starts.begin(), starts.end(), total * k / n);
+      bounds.push_back(std::max(it != starts.end() ? *it : total, bounds.back()));
+  }
+
+  bounds.push_back(std::max(total, bounds.back()));
+  return bounds;
+}
+
+
+/// A GameReader of a streamed file opens the file on its own and inflates it up
+/// to the start of its range. Its buffer is allocated when the first game is read.
+
+GameReader::GameReader(const GameFile& f, size_t from, size_t to)
+  : file(f), in(nullptr), data(f.data()), cur(f.data() + std::min(from, f.size())),
+    end(f.data() + f.size()), base(0), last(std::min(to, f.size())), eof(true) {
+
+  filter.minElo = 0;
+  filter.results = AnyResult;
+
+  if (!f.streamed())
+      return;
+
+  data = cur = end = nullptr;
+  base = from;
+  last = to;
+  in = gzopen(f.path().c_str(), "rb");
+
+  if (in)
+  {
+      gzbuffer(in, 1 << 17);
+      eof = from && gzseek(in, z_off_t(from), SEEK_SET) != z_off_t(from);
+  }
+}
+
+
+GameReader::~GameReader() {
+
+  if (in)
+      gzclose(in);
+}
+
+
+/// GameReader::refill() moves the text from the current game on to the start of
+/// the buffer of a streamed file, and reads more after it. The buffer grows when
+/// the game takes more than half of it.
+
+void GameReader::refill() {
+
+  const size_t Window = 1 << 20;
+
+  size_t keep = size_t(end - cur);
+  base += size_t(cur - data);
+
+  if (keep && cur != buf.data())
+      std::memmove(buf.data(), cur, keep);
+
+  if (buf.empty() || keep > buf.size() / 2)
+      buf.resize(std::max(Window, 2 * buf.size()));
+
+  int n = gzread(in, buf.data() + keep, unsigned(buf.size() - keep));
+  eof = n <= 0;
+
+  data = cur = buf.data();
+  end = data + keep + std::max(n, 0);
+}
+
+
+/// GameReader::scan() reads the game at cur into g and returns where the next
+/// game starts. If the game runs up to the end of the text read so far, more of
+/// a streamed file may belong to it.
+
+const char* GameReader::scan(Game& g) const {
+
+  const char* p = cur;
+
+  while (p < end && blank_line(p, end))
+      p = next_line(p, end);
+
+  g.tags = p;
+  g.offset = base + size_t(p - data);
+
+  if (file.pgn())
+  {
+      // The tag pairs, then the moves up to the tag pairs of the next game
+      while (p < end && *p == '[')
+          p = next_line(p, end);
+
+      g.begin = p;
+      while (p < end && *p != '[')
+          p = next_line(p, end);
+
+      g.end = p;
+  }
+  else
+  {
+      // The moves up to the next blank line, which is consumed with them
+      g.begin = p;
+      while (p < end && !blank_line(p, end))
+          p = next_line(p, end);
+
+      g.end = p;
+      p = next_line(p, end);
+  }
+
+  return p;
+}
+
+
+/// GameReader::next() reads the next game that starts in the range of the
+/// reader and passes the filter. Returns false when there is none left.
+
+bool GameReader::next(Game& g) {
+
+  do {
+      const char* p = scan(g);
+
+      while (g.end == end && !eof)
+      {
+          refill();
+          p = scan(g);
+      }
+
+      if (g.tags == end || g.offset >= last)
+          return false;
+
+      cur = p;
+
+      MoveToken v;
+      g.result = tag(g, "Result", v) ? to_result(v.str, v.str + v.len) : RESULT_UNKNOWN;
+
+  } while (!accept(g));
+
+  return true;
+}
+
+
+/// GameReader::accept() checks a game against the filter
+
+bool GameReader::accept(const Game& g) const {
+
+  return    (filter.results >> (g.result + 1) & 1)
+         && (!filter.minElo || (elo(g, WHITE) >= filter.minElo && elo(g, BLACK) >= filter.minElo));
+}
+
+
+/// GameReader::next_move() reads the move at p, of a game ending at end, into
+/// t and advances p past it. Move numbers, comments, variations and numeric
+/// annotations are skipped. Returns false at the result or the end of the game.
+
+bool GameReader::next_move(const char*& p, const char* end, MoveToken& t) {
+
+  while (p < end)
+  {
+      char c = *p;
+
+      if (is_space(c) || c == ')')
+          ++p;
+
+      else if (c == '{')
+      {
+          const char* close = (const char*)std::memchr(p, '}', size_t(end - p));
+          p = close ? close + 1 : end;
+      }
+      else if (c == ';')
+          p = next_line(p, end);
+
+      else if (c == '(')
+      {
+          for (int depth = 0; p < end; ++p)
+          {
+              if (*p == '{')
+              {
+                  const char* close = (const char*)std::memchr(p, '}', size_t(end - p));
+                  p = close ? close : end - 1;
+              }
+              else if (*p == '(')
+                  ++depth;
+              else if (*p == ')' && !--depth)
+                  break;
+          }
+          p = std::min(p + 1, end);
+      }
+      else if (c == '$')
+          for (++p; p < end && std::isdigit((unsigned char)*p); ++p) {}
+
+      else
+      {
+          const char* s = p;
+          while (p < end && !is_space(*p) && !one_of(*p, "{}();"))
+              ++p;
+
+          if (is_result(s, p))
+              return false;
+
+          // Move numbers: 12. or 12... on their own, or in front of the move
+          const char* q = s;
+          while (q < p && std::isdigit((unsigned char)*q))
+              ++q;
+
+          const char* r = q;
+          while (r < p && *r == '.')
+              ++r;
+
+          if (r == p)
+              continue;
+
+          t.str = r > q ? r : s;
+          t.len = size_t(p - t.str);
+          return true;
+      }
+  }
+
+  return false;
+}
+
+
+/// GameReader::count_moves() returns the number of moves of a game
+
+int GameReader::count_moves(const Game& g) {
+
+  int n = 0;
+  const char* p = g.begin;
+  MoveToken t;
+
+  while (next_move(p, g.end, t))
+      ++n;
+
+  return n;
+}
+
+
+/// GameReader::to_move() converts a move in SAN or long algebraic notation to a
+/// Move, like UCI::to_move() but without building strings. Returns MOVE_NONE
+/// for moves that are illegal in pos or malformed.
+
+Move GameReader::to_move(const Position& pos, const MoveToken& t) {
+
+  const char* s = t.str;
+
+  if (   (t.len == 4 || t.len == 5)
+      && s[0] >= 'a' && s[0] <= 'h' && s[1] >= '1' && s[1] <= '8'
+      && s[2] >= 'a' && s[2] <= 'h' && s[3] >= '1' && s[3] <= '8')
+      return lan_to_move(pos, s, t.len);
+
+  return san_to_move(pos, s, t.len);
+}
+
+
+/// GameReader::tag() finds the value of the tag pair name of a game
+
+bool GameReader::tag(const Game& g, const char* name, MoveToken& value) {
+
+  for (const char* p = g.tags; p < g.begin; p = next_line(p, g.begin))
+  {
+      const char* e = next_line(p, g.begin);
+      const char* s = p + 1;
+      const char* n = s;
+      while (n < e && !is_space(*n))
+          ++n;
+
+      if (*p != '[' || !equals(s, n, name))
+          continue;
+
+      const char* open = (const char*)std::memchr(n, '"', size_t(e - n));
+      const char* close = open ? (const char*)std::memchr(open + 1, '"', size_t(e - open - 1)) : nullptr;
+      if (!close)
+          return false;
+
+      value.str = open + 1;
+      value.len = size_t(close - open - 1);
+      return true;
+  }
+
+  return false;
+}
+
+
+/// GameReader::setup() sets pos to the position a game starts from: the one of
+/// its FEN tag, or the start position if it has none. Returns false if the FEN
+/// is malformed or not a legal position, or for a SetUp game without one.
+
+bool GameReader::setup(const Game& g, Position& pos, Thread* th) {
+
+  MoveToken fen, setUp;
+
+  if (!tag(g, "FEN", fen))
+  {
+      if (tag(g, "SetUp", setUp) && equals(setUp.str, setUp.str + setUp.len, "1"))
+          return false;
+
+      pos.set(StartFEN, false, th);
+      return true;
+  }
+
+  if (!valid_fen(fen.str, fen.len))
+      return false;
+
+  pos.set(std::string(fen.str, fen.len), false, th);
+
+  // The side that just moved must not have left its king in check
+  Color them = ~pos.side_to_move();
+  return !(pos.attackers_to(pos.square<KING>(them)) & pos.pieces(pos.side_to_move()));
+}
+
+
+/// GameReader::elo() returns the rating of the player of color c, 0 if unknown
+
+int GameReader::elo(const Game& g, Color c) {
+
+  MoveToken v;
+  int elo = 0;
+
+  if (tag(g, c == WHITE ? "WhiteElo" : "BlackElo", v))
+      for (size_t i = 0; i < v.len && std::isdigit((unsigned char)v.str[i]); ++i)
+          elo = 10 * elo + (v.str[i] - '0');
+
+  return elo;
+}
+
+
+/// GameReader::parse_results() converts a list of results like "1-0 0-1" to a
+/// Filter::results mask. "*" stands for an unknown result, and "any" or an
+/// empty list for all of them.
+
+unsigned GameReader::parse_results(const std::string& s) {
+
+  unsigned mask = 0;
+  size_t i = 0;
+
+  while (i < s.size())
+  {
+      size_t j = s.find_first_of(" ,", i);
+      j = j == std::string::npos ? s.size() : j;
+
+      if (s.compare(i, j - i, "any") == 0)
+          mask = AnyResult;
+      else if (j > i)
+          mask |= 1 << (to_result(s.data() + i, s.data() + j) + 1);
+
+      i = j + 1;
+  }
+
+  return mask ? mask : AnyResult;
+}
@@ -0,0 +1,144 @@
+/*
+  Stockfish, a UCI chess playing engine derived from Glaurung 2.1
+  Copyright (C) 2004-2008 Tord Romstad (Glaurung author)
+  Copyright (C) 2008-2015 Marco Costalba, Joona Kiiski, Tord Romstad
+  Copyright (C) 2015-2016 Marco Costalba, Joona Kiiski, Gary Linscott, Tord Romstad
+
+  Stockfish is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Stockfish is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef GAMEREADER_H_INCLUDED
+#define GAMEREADER_H_INCLUDED
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "position.h"
+
+struct gzFile_s;
+
+/// GameFile maps a file of games, either PGN or the output of pgn-extract
+/// --nomovenumbers --notags --noresults -Wlalg: the moves of each game in long
+/// algebraic notation, separated by spaces and newlines, and a blank line after
+/// the game. A file starting with a tag pair is read as PGN. The games are read
+/// straight from the mapping by GameReaders. A file ending in .gz is not mapped
+/// but streamed: each GameReader inflates it on its own, through a buffer that
+/// only has to hold a game at a time.
+
+class GameFile {
+
+public:
+  GameFile() : mem(nullptr), bytes(0), isPgn(false), gz(false) {}
+  ~GameFile() { close(); }
+  GameFile(const GameFile&) = delete;
+  GameFile& operator=(const GameFile&) = delete;
+
+  bool open(const std::string& path);
+  void close();
+  std::vector<size_t> split(int n) const;
+
+  const char* data() const { return (const char*)mem; }
+  size_t size() const { return bytes; }
+  bool pgn() const { return isPgn; }
+  bool streamed() const { return gz; }
+  const std::string& path() const { return name; }
+
+private:
+  bool map(int fd);
+  std::vector<size_t> split_stream(int n) const;
+
+  std::string name;
+  void* mem;
+  size_t bytes;
+  bool isPgn;
+  bool gz;
+};
+
+
+/// MoveToken is a move of a game, or the value of a tag, as it stands in the file
+
+struct MoveToken {
+  const char* str;
+  size_t len;
+};
+
+
+/// GameReader reads the games of a GameFile that start in a byte range, one at
+/// a time. A Game is the text of its tag pairs and moves in the mapping, or in
+/// the buffer of a streamed file until the next game is read, which is split
+/// into MoveTokens and parsed into Moves without copying it. Move numbers,
+/// comments, variations, annotations and the result are skipped, and moves may
+/// be in SAN or in long algebraic notation. Games the filter rejects are skipped
+/// as well.
+
+class GameReader {
+
+public:
+  // Game results, from White's point of view
+  enum Result { BLACK_WINS = -1, DRAW = 0, WHITE_WINS = 1, RESULT_UNKNOWN = 2 };
+
+  struct Game {
+    const char* tags;
+    const char* begin;  // The tags end where the moves begin
+    const char* end;
+    size_t offset;      // Of the game in the file
+    int result;
+  };
+
+  // Which games to read: both players rated at least minElo (0 for unrated
+  // games too), and a result in results, a bitmask of 1 << (result + 1).
+  struct Filter {
+    int minElo;
+    unsigned results;
+  };
+
+  static const unsigned AnyResult = 0xF;
+
+  GameReader(const GameFile& f, size_t from = 0, size_t to = SIZE_MAX);
+  ~GameReader();
+  GameReader(const GameReader&) = delete;
+  GameReader& operator=(const GameReader&) = delete;
+
+  bool next(Game& g);
+  size_t offset() const { return base + size_t(cur - data); }
+
+  Filter filter;
+
+  static bool next_move(const char*& p, const char* end, MoveToken& t);
+  static int count_moves(const Game& g);
+  static Move to_move(const Position& pos, const MoveToken& t);
+  static bool tag(const Game& g, const char* name, MoveToken& value);
+  static bool setup(const Game& g, Position& pos, Thread* th);
+  static int elo(const Game& g, Color c);
+  static unsigned parse_results(const std::string& s);
+
+private:
+  const char* scan(Game& g) const;
+  void refill();
+  bool accept(const Game& g) const;
+
+  const GameFile& file;
+  gzFile_s* in;      // The stream of a streamed file
+  std::vector<char> buf;
+  const char* data;  // The text read so far, which starts at offset base
+  const char* cur;
+  const char* end;
+  size_t base;
+  size_t last;       // Games must start before this offset
+  bool eof;          // The text read so far ends where the file does
+};
+
+#endif // #ifndef GAMEREADER_H_INCLUDED
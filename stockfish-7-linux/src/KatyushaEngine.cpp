@@ -1,22 +1,170 @@
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cmath>
+#include <iomanip>
+#include <memory>
+
 #include "KatyushaEngine.h"
+#include "misc.h"
 
-KatyushaNet network;
+//The weights evaluations use. A new set is loaded, checked and quantized aside while the searches go on, then
+//published by swapping this pointer and counting the publication. Each thread holds on to the set it took until
+//it sees the count change, so evaluations in flight finish on the old weights, which are freed with the last
+//reference to them.
+std::shared_ptr<const KatyushaNet> current;
+std::atomic<unsigned> publications(0);
 string weightsfile = "/home/benjamin/Katyusha/stockfish-7-linux/src/katyusha_weights.npz";
-int pos_rep_arr[Analyze::NB_FEATURES];
-bool is_active = true;
+//the evaluation settings are read by the search threads while the UCI thread may change them
+std::atomic<bool> is_active(true);
+//let the specialized endgame evaluators score the positions they know instead of the network
+std::atomic<bool> endgames(true);
+//evaluate with the int16 network instead of the float one
+std::atomic<bool> quantized(false);
+//back the mappings of native weight files with huge pages
+bool huge_pages = false;
 
 bool KatyushaEngine::engine_active()
 {
   return is_active;
 }
 
-void KatyushaEngine::activate() {is_active = true;}
+//there is nothing to evaluate with until a network is loaded
+void KatyushaEngine::activate() {is_active = bool(std::atomic_load(&current));}
 void KatyushaEngine::deactivate() {is_active = false;}
 
+bool KatyushaEngine::use_endgames() {return endgames;}
+void KatyushaEngine::set_use_endgames(bool b) {endgames = b;}
+
+bool KatyushaEngine::use_quantized() {return quantized;}
+
+void KatyushaEngine::set_use_huge_pages(bool b) {huge_pages = b;}
+
+namespace {
+
+const char* StartFEN = "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1";
+
+}
+
+//feature vectors of the positions of random games, the seed makes them the same on every run
+vector<vector<int> > KatyushaEngine::sample_features(uint64_t seed, int games, int plies)
+{
+  PRNG rng(seed);
+  vector<vector<int> > samples;
+  vector<StateInfo> st(plies);
+  for (int g = 0; g < games; g++)
+  {
+    Position pos(StartFEN, false, Threads.main());
+    for (int ply = 0; ply < plies; ply++)
+    {
+      MoveList<LEGAL> moves(pos);
+      if (!moves.size())
+        break;
+      Move m = *(moves.begin() + rng.rand<unsigned>() % moves.size());
+      pos.do_move(m, st[ply], pos.gives_check(m, CheckInfo(pos)));
+      samples.push_back(vector<int>(Analyze::NB_FEATURES));
+      Analyze::Katyusha_pos_rep(pos, samples.back().data());
+    }
+  }
+  return samples;
+}
+
+//the activation ranges are measured on positions of random games
+void KatyushaEngine::quantize(KatyushaNet& net)
+{
+  net.quantize(sample_features(1070372, 32, 80));
+}
+
+namespace {
+
+//measuring the activation ranges takes a while, so a network is only quantized to be evaluated quantized
+void publish(std::shared_ptr<KatyushaNet> net, bool q)
+{
+  if (q)
+    KatyushaEngine::quantize(*net);
+  std::atomic_store(&current, std::shared_ptr<const KatyushaNet>(std::move(net)));
+  publications.fetch_add(1, std::memory_order_release);
+}
+
+//load the weights into a new network and publish it, false if the file does not hold a network, or if expected is
+//given and the network is not the one with that native file checksum
+bool load_network(const string& file, const uint32_t* expected = nullptr)
+{
+  std::shared_ptr<KatyushaNet> net = std::make_shared<KatyushaNet>();
+  if (!net->load(file, huge_pages) || (expected && net->native_checksum() != *expected))
+    return false;
+  publish(std::move(net), quantized);
+  return true;
+}
+
+//the network th evaluates with, the last one published when th last looked
+const KatyushaNet& thread_network(Thread* th)
+{
+  const unsigned p = publications.load(std::memory_order_acquire);
+  if (th->networkPublication != p)
+  {
+    th->network = std::atomic_load(&current);
+    th->networkPublication = p;
+  }
+  return *th->network;
+}
+
+//the cached evaluations of the pawn, material and evaluation caches are valid for one network in one mode
+unsigned generation(const KatyushaNet& net, bool q)
+{
+  return 2 * net.version() + q;
+}
+
+}
+
+//the network in use is quantized the first time it is needed, a copy of it is published for that which shares
+//its weights. Threads go on evaluating in floats until they pick up the copy.
+void KatyushaEngine::set_use_quantized(bool b)
+{
+  std::shared_ptr<const KatyushaNet> network = get_network();
+  if (b && network && !network->quantized())
+  {
+    std::shared_ptr<KatyushaNet> net = std::make_shared<KatyushaNet>();
+    net->same_weights(*network);
+    publish(std::move(net), true);
+  }
+  quantized = b;
+}
+
+//the old weights stay in use if the new ones cannot be loaded. If there were none, Katyusha is activated.
 void KatyushaEngine::setWeightsfile(string newname)
 {
-  weightsfile = newname;
-  network.load(weightsfile);
+  const bool first = !get_network();
+  if (load_network(newname))
+  {
+    weightsfile = newname;
+    if (first)
+      activate();
+  }
+  else
+    sync_cout << "info string Failed to load the network of " << newname << ", still using " << weightsfile << sync_endl;
+}
+
+//evaluate with the native weight file file_name, mapped shared so all processes that use it share one copy of the
+//weights. The first process to get here creates it from the network it has, the others find it and map it. What
+//is mapped has to be the network in use, in case another process replaced the file in between.
+void KatyushaEngine::setSharedWeights(string file_name)
+{
+  if (file_name.empty() || file_name == "<empty>")
+    return;
+  std::shared_ptr<const KatyushaNet> network = get_network();
+  if (!network)
+  {
+    setWeightsfile(file_name);
+    return;
+  }
+  const uint32_t sum = network->native_checksum();
+  if (!network->share(file_name, huge_pages))
+    sync_cout << "info string Failed to create the shared weights " << file_name << sync_endl;
+  else if (!load_network(file_name, &sum))
+    sync_cout << "info string " << file_name << " does not hold the weights of " << weightsfile << ", still using them" << sync_endl;
+  else
+    weightsfile = file_name;
 }
 
 string KatyushaEngine::getWeightsfile()
@@ -24,15 +172,251 @@ string KatyushaEngine::getWeightsfile()
   return weightsfile;
 }
 
+std::shared_ptr<const KatyushaNet> KatyushaEngine::get_network()
+{
+  return std::atomic_load(&current);
+}
+
+//publish a copy of the network with its weights changed by the step of a KatyushaOptimizer
+void KatyushaEngine::update_network(const KatyushaGradient& delta)
+{
+  std::shared_ptr<KatyushaNet> net = std::make_shared<KatyushaNet>();
+  net->assign(*get_network());
+  net->adjust(delta);
+  publish(std::move(net), quantized);
+}
+
 void KatyushaEngine::init()
 {
-  network.load(weightsfile);
+  if (!load_network(weightsfile))
+  {
+    sync_cout << "info string Failed to load the network of " << weightsfile << ", Katyusha is inactive" << sync_endl;
+    deactivate();
+  }
 }
 
+//report how far the quantized evaluations are from the float ones, on the positions of a file with one fen per line,
+//or on random games other than the ones the activation ranges were measured on
+void KatyushaEngine::quantization_error(std::istringstream& is)
+{
+  string infile;
+  vector<vector<int> > samples;
+  if (is >> infile)
+  {
+    ifstream in(infile);
+    string fen;
+    while (getline(in, fen))
+    {
+      if (!fen.length()) continue;
+      Position pos(fen, false, Threads.main());
+      samples.push_back(vector<int>(Analyze::NB_FEATURES));
+      Analyze::Katyusha_pos_rep(pos, samples.back().data());
+    }
+  }
+  else
+    samples = sample_features(20160710, 64, 80);
+
+  KatyushaScratch& scratch = Threads.main()->netScratch;
+  std::shared_ptr<const KatyushaNet> network = get_network();
+  if (!network)
+    return;
+  if (!network->quantized())
+  {
+    std::shared_ptr<KatyushaNet> net = std::make_shared<KatyushaNet>();
+    net->same_weights(*network);
+    quantize(*net);
+    network = net;
+  }
+  double mean, worst;
+  quantization_error(*network, samples, scratch, mean, worst);
+
+  //to_stockfish_value makes one unit of raw evaluation 50 pawns
+  const double cp = 50 * 100;
+  sync_cout << "Positions: " << samples.size()
+            << "\nMean error: " << std::defaultfloat << mean << " (" << std::fixed << std::setprecision(2) << cp * mean << " cp)"
+            << "\nMax error: " << std::defaultfloat << worst << " (" << std::fixed << cp * worst << " cp)" << sync_endl;
+}
+
+//the mean and the largest difference between the quantized and the float evaluations of the samples by net,
+//which must be quantized, in units of the network output
+void KatyushaEngine::quantization_error(const KatyushaNet& net, const vector<vector<int> >& samples,
+                                        KatyushaScratch& scratch, double& mean, double& worst)
+{
+  double sum = 0;
+  worst = 0;
+  for (size_t i = 0; i < samples.size(); i++)
+  {
+    double err = std::abs(net.evaluate(samples[i].data(), scratch) - net.evaluate_quantized(samples[i].data(), scratch));
+    sum += err;
+    worst = std::max(worst, err);
+  }
+  mean = sum / (samples.size() ? samples.size() : 1);
+}
+
+//convert_weights <in> <out>: read the weights in either format and write them to out, as an npz archive if its name
+//ends in .npz and as a native weight file otherwise
+void KatyushaEngine::convert_weights(std::istringstream& is)
+{
+  string infile, outfile;
+  if (!(is >> infile) || !(is >> outfile))
+  {
+    sync_cout << "Usage: convert_weights <in> <out>" << sync_endl;
+    return;
+  }
+
+  KatyushaNet net;
+  if (!net.load(infile))
+  {
+    sync_cout << infile << " does not hold a network" << sync_endl;
+    return;
+  }
+  const string npz = ".npz";
+  const bool archive = outfile.size() >= npz.size() && !outfile.compare(outfile.size() - npz.size(), npz.size(), npz);
+  if (archive ? !net.save(outfile) : !net.save_native(outfile))
+  {
+    sync_cout << "Failed to write " << outfile << sync_endl;
+    return;
+  }
+  sync_cout << "Converted " << infile << " to " << outfile << sync_endl;
+}
+
+namespace {
+
+//beyond this many plies without an up to date accumulator it is cheaper to start from scratch
+const int MaxAccumulatorWalk = 16;
+
+static_assert(MaxAccumulatorWalk < KatyushaScratch::AccumulatorSlots, "The states of a walk need slots of their own");
+
+//the accumulator slot of si in the scratch of the thread, claimed for si if it is not its own
+float * accumulator(KatyushaScratch& scratch, StateInfo * si, bool claim)
+{
+  const int slot = si->accumulatorPly % KatyushaScratch::AccumulatorSlots;
+  if (claim)
+    scratch.accumulatorOwner[slot] = si;
+  return scratch.boardAccumulator[slot];
+}
+
+bool has_accumulator(const KatyushaScratch& scratch, const StateInfo * si, unsigned version)
+{
+  return   si->accumulatorVersion == version
+        && scratch.accumulatorOwner[si->accumulatorPly % KatyushaScratch::AccumulatorSlots] == si;
+}
+
+//the board feature accumulator of the current position. Walk back to the closest position with an up to
+//date accumulator and apply the changes of each move from there, filling in the positions on the way.
+//The walk never goes past the start state of pos, the states before it may be shared with other threads.
+const float * board_accumulator(const KatyushaNet& network, const Position& pos)
+{
+  KatyushaScratch& scratch = pos.this_thread()->netScratch;
+  const unsigned version = network.version();
+  StateInfo * path[MaxAccumulatorWalk];
+  int n = 0;
+  StateInfo * si = pos.state();
+
+  while (!has_accumulator(scratch, si, version))
+  {
+    if (pos.is_start_state(si) || n == MaxAccumulatorWalk)
+    {
+      float * acc = accumulator(scratch, pos.state(), true);
+      network.refresh(pos.board_features(), acc);
+      pos.state()->accumulatorVersion = version;
+      return acc;
+    }
+    path[n++] = si;
+    si = si->previous;
+  }
+
+  while (n--)
+  {
+    network.update(accumulator(scratch, si, false), accumulator(scratch, path[n], true),
+                   path[n]->changedFeatures, path[n]->featureChanges);
+    path[n]->accumulatorVersion = version;
+    si = path[n];
+  }
+  return accumulator(scratch, si, false);
+}
+
+//the network evaluation of pos, without going through the thread's evaluation cache
+Value evaluate_network(const KatyushaNet& network, bool q, const Position& pos)
+{
+  KatyushaScratch& scratch = pos.this_thread()->netScratch;
+  const unsigned gen = generation(network, q);
+  //a position set up while Katyusha was inactive has no board features to start from
+  const bool tracked = pos.tracks_features();
+  if (tracked)
+  {
+    std::copy(pos.board_features(), pos.board_features() + Analyze::NB_FEATURES, scratch.features);
+    Analyze::Katyusha_attack_features(pos, scratch.features);
+  }
+  else
+    Analyze::Katyusha_pos_rep(pos, scratch.features);
+#ifndef NDEBUG
+  int full[Analyze::NB_FEATURES];
+  Analyze::Katyusha_pos_rep(pos, full);
+  assert(std::equal(full, full + Analyze::NB_FEATURES, scratch.features));
+#endif
+  //evaluated from scratch, the pawn and global subnets are skipped when the pawn and material tables have their outputs
+  if (q || !network.incremental() || !tracked)
+  {
+    Analyze::SubnetCache * cache[SUBNET_NB] = {};
+    cache[PAWN_NET] = pos.this_thread()->subnetTable.pawns(pos);
+    cache[GLOBAL_NET] = pos.this_thread()->subnetTable.global(pos);
+    if (q)
+      return KatyushaEngine::to_stockfish_value(network.evaluate_quantized(scratch.features, scratch, cache, gen));
+
+    Analyze::to_sparse(scratch.features, scratch.sparse);
+    float raw = network.evaluate_sparse(scratch.sparse, scratch, cache, gen);
+    assert(std::abs(raw - network.evaluate(scratch.features, scratch)) < 1e-3);
+    return KatyushaEngine::to_stockfish_value(raw);
+  }
+
+  float raw = network.evaluate(board_accumulator(network, pos), scratch.features, scratch);
+  assert(std::abs(raw - network.evaluate(scratch.features, scratch)) < 1e-3);
+  return KatyushaEngine::to_stockfish_value(raw);
+}
+
+}
+
+//the network is shared by all search threads, the features and activations go to the thread's own scratch space
+//the board features are kept up to date by do_move and undo_move, only the attack features are computed here
+//a weight change is picked up here, between two evaluations
 Value KatyushaEngine::evaluate(const Position& pos)
 {
-  Analyze::Katyusha_pos_rep(pos, pos_rep_arr);
-  return to_stockfish_value(network.evaluate(pos_rep_arr));
+  const KatyushaNet& network = thread_network(pos.this_thread());
+  //a network published before quantized mode was turned on is evaluated in floats
+  const bool q = quantized && network.quantized();
+  KatyushaEvalCache& cache = pos.this_thread()->evalCache;
+  Value v;
+  if (cache.probe(pos.key(), generation(network, q), v))
+    return v;
+
+  v = evaluate_network(network, q, pos);
+  cache.store(pos.key(), v);
+  return v;
+}
+
+//print the hits and misses of the evaluation caches of all threads
+void KatyushaEngine::eval_cache_stats()
+{
+  uint64_t hits = 0, misses = 0;
+  for (Thread* th : Threads)
+  {
+    hits += th->evalCache.hits;
+    misses += th->evalCache.misses;
+  }
+  sync_cout << "Eval cache hits: " << hits << " misses: " << misses
+            << " hit rate: " << std::fixed << std::setprecision(1)
+            << (hits + misses ? 100.0 * hits / (hits + misses) : 0.0) << "%" << sync_endl;
+}
+
+//score n feature vectors (TOTAL_FEATURES each) in one pass of the network, from White's point of view like evaluate()
+//uses the main thread's scratch space, so only call it while no search is running
+void KatyushaEngine::evaluate_batch(const int* features, size_t n, Value* out)
+{
+  vector<float> raw(n);
+  get_network()->evaluate_batch(features, n, raw.data(), Threads.main()->netScratch);
+  for (size_t i = 0; i < n; i++)
+    out[i] = to_stockfish_value(raw[i]);
 }
 
 Value KatyushaEngine::to_stockfish_value(float raw_eval)
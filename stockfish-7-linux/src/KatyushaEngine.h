@@ -1,6 +1,8 @@
 #ifndef KatyushaEngine_H
 #define KatyushaEngine_H
 
+#include <memory>
+
 #include "analyze.h"
 #include "KatyushaNet.h"
 #include "types.h"
@@ -8,12 +10,29 @@
 namespace KatyushaEngine {
    void init();
    Value evaluate(const Position& pos);
+   void evaluate_batch(const int* features, size_t n, Value* out);
    Value to_stockfish_value(float raw_eval);
    bool engine_active();
    void activate();
    void deactivate();
+   bool use_endgames();
+   void set_use_endgames(bool b);
+   bool use_quantized();
+   void set_use_quantized(bool b);
+   void set_use_huge_pages(bool b);
+   //the feature vectors of the positions of random games, and the network quantized on the ones it is measured on
+   vector<vector<int> > sample_features(uint64_t seed, int games, int plies);
+   void quantize(KatyushaNet& net);
+   void quantization_error(std::istringstream& is);
+   void quantization_error(const KatyushaNet& net, const vector<vector<int> >& samples, KatyushaScratch& scratch,
+                           double& mean, double& worst);
+   void convert_weights(std::istringstream& is);
+   void eval_cache_stats();
    void setWeightsfile(string newname);
    string getWeightsfile();
+   void setSharedWeights(string file_name);
+   std::shared_ptr<const KatyushaNet> get_network();
+   void update_network(const KatyushaGradient& delta);
 }
 
 #endif
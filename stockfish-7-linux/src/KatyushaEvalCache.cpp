@@ -0,0 +1,147 @@
+/*
+  Stockfish, a UCI chess playing engine derived from Glaurung 2.1
+  Copyright (C) 2004-2008 Tord Romstad (Glaurung author)
+  Copyright (C) 2008-2015 Marco Costalba, Joona Kiiski, Tord Romstad
+  Copyright (C) 2015-2016 Marco Costalba, Joona Kiiski, Gary Linscott, Tord Romstad
+
+  Stockfish is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Stockfish is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cassert>
+#include <cstring>   // For std::memset, std::memmove
+#include <iostream>
+
+#include "bitboard.h"
+#include "KatyushaEvalCache.h"
+#include "position.h"
+
+
+/// KatyushaEvalCache::resize() sets the size of the cache in megabytes, rounded
+/// down to a power of 2 number of buckets. A size of 0 disables the cache.
+
+void KatyushaEvalCache::resize(size_t mbSize) {
+
+  size_t newBucketCount = mbSize ? size_t(1) << msb((mbSize * 1024 * 1024) / sizeof(Bucket)) : 0;
+
+  if (newBucketCount == bucketCount)
+      return;
+
+  bucketCount = newBucketCount;
+
+  free(mem);
+  mem = table = nullptr;
+  hits = misses = 0;
+
+  if (!bucketCount)
+      return;
+
+  mem = calloc(bucketCount * sizeof(Bucket) + CacheLineSize - 1, 1);
+
+  if (!mem)
+  {
+      std::cerr << "Failed to allocate " << mbSize
+                << "MB for the evaluation cache." << std::endl;
+      exit(EXIT_FAILURE);
+  }
+
+  table = (Bucket*)((uintptr_t(mem) + CacheLineSize - 1) & ~(CacheLineSize - 1));
+}
+
+
+/// KatyushaEvalCache::clear() empties the cache
+
+void KatyushaEvalCache::clear() {
+
+  if (table)
+      std::memset(table, 0, bucketCount * sizeof(Bucket));
+}
+
+
+/// KatyushaEvalCache::probe() looks up the evaluation of the position with the
+/// given key in generation gen. The upper 32 bits of the key are checked in the
+/// bucket given by the lower ones.
+
+bool KatyushaEvalCache::probe(Key key, unsigned gen, Value& v) {
+
+  if (!table)
+      return false;
+
+  if (gen != generation)
+  {
+      clear();
+      generation = gen;
+  }
+
+  const Entry* e = bucket(key)->entry;
+  const uint32_t key32 = key >> 32;
+
+  for (int i = 0; i < BucketSize; ++i)
+      if (e[i].used && e[i].key32 == key32)
+      {
+          ++hits;
+          v = Value(e[i].value);
+          return true;
+      }
+
+  ++misses;
+  return false;
+}
+
+
+/// KatyushaEvalCache::store() puts an evaluation at the front of its bucket,
+/// dropping the oldest entry.
+
+void KatyushaEvalCache::store(Key key, Value v) {
+
+  if (!table)
+      return;
+
+  assert(v >= INT16_MIN && v <= INT16_MAX);
+
+  Entry* e = bucket(key)->entry;
+  std::memmove(e + 1, e, (BucketSize - 1) * sizeof(Entry));
+  e[0].key32 = uint32_t(key >> 32);
+  e[0].value = int16_t(v);
+  e[0].used = 1;
+}
+
+
+/// KatyushaSubnetTable::probe() returns the cache of the entry for key,
+/// emptied if the entry held another key. The table is allocated on first use.
+
+Analyze::SubnetCache* KatyushaSubnetTable::probe(std::vector<Entry>& table, size_t size, Key key) {
+
+  if (table.empty())
+      table.resize(size);
+
+  Entry& e = table[(uint32_t)key & (size - 1)];
+  if (e.key != key)
+  {
+      e.key = key;
+      e.cache.generation = 0;
+  }
+  return &e.cache;
+}
+
+Analyze::SubnetCache* KatyushaSubnetTable::pawns(const Position& pos) {
+  return probe(pawnTable, PawnEntries, pos.pawn_key());
+}
+
+/// The global subnet also reads the side to move and the castling rights
+
+Analyze::SubnetCache* KatyushaSubnetTable::global(const Position& pos) {
+
+  Key k = pos.material_key() ^ (Key(pos.can_castle(ANY_CASTLING) * 2 + pos.side_to_move() + 1) * 0x9E3779B97F4A7C15ULL);
+  return probe(globalTable, GlobalEntries, k);
+}
@@ -0,0 +1,107 @@
+/*
+  Stockfish, a UCI chess playing engine derived from Glaurung 2.1
+  Copyright (C) 2004-2008 Tord Romstad (Glaurung author)
+  Copyright (C) 2008-2015 Marco Costalba, Joona Kiiski, Tord Romstad
+  Copyright (C) 2015-2016 Marco Costalba, Joona Kiiski, Gary Linscott, Tord Romstad
+
+  Stockfish is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Stockfish is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef KATYUSHAEVALCACHE_H_INCLUDED
+#define KATYUSHAEVALCACHE_H_INCLUDED
+
+#include <cstdint>
+#include <vector>
+
+#include "KatyushaFeatures.h"
+#include "misc.h"
+#include "types.h"
+
+class Position;
+
+/// KatyushaEvalCache stores the network evaluation of positions, keyed by their
+/// Zobrist key. Each thread has its own, like the pawn and material tables, so
+/// it needs no locking. A bucket is one cache line of entries kept in most
+/// recently stored first order; the oldest entry is the one replaced. The
+/// entries are only valid for one generation of the evaluation (weights and
+/// mode), the cache clears itself when asked about another one.
+
+class KatyushaEvalCache {
+
+  struct Entry {
+    uint32_t key32;
+    int16_t  value;
+    uint16_t used;
+  };
+
+  static const int CacheLineSize = 64;
+  static const int BucketSize = 8;
+
+  struct Bucket {
+    Entry entry[BucketSize];
+  };
+
+  static_assert(CacheLineSize % sizeof(Bucket) == 0, "Bucket size incorrect");
+
+public:
+  KatyushaEvalCache() : hits(0), misses(0), bucketCount(0), generation(0), mem(nullptr), table(nullptr) {}
+  ~KatyushaEvalCache() { free(mem); }
+  KatyushaEvalCache(const KatyushaEvalCache&) = delete;
+  KatyushaEvalCache& operator=(const KatyushaEvalCache&) = delete;
+
+  bool probe(Key key, unsigned gen, Value& v);
+  void store(Key key, Value v);
+  void resize(size_t mbSize);
+  void clear();
+
+  uint64_t hits, misses;
+
+private:
+  Bucket* bucket(Key key) const { return &table[(size_t)key & (bucketCount - 1)]; }
+
+  size_t bucketCount;
+  unsigned generation;
+  void* mem;
+  Bucket* table;
+};
+
+
+/// KatyushaSubnetTable keeps the outputs of the pawn and global subnets of the
+/// network for the paths that evaluate the first layer from scratch (the
+/// quantized network, and networks too wide for an accumulator), keyed by the
+/// pawn key and by the material key, side to move and castling rights. It is
+/// kept apart from the pawn and material tables so that their entries stay
+/// small, and it is only allocated when one of those paths first asks for it.
+
+class KatyushaSubnetTable {
+
+  struct Entry {
+    Key key;
+    Analyze::SubnetCache cache;
+  };
+
+  static const size_t PawnEntries = 16384;
+  static const size_t GlobalEntries = 8192;
+
+public:
+  Analyze::SubnetCache* pawns(const Position& pos);
+  Analyze::SubnetCache* global(const Position& pos);
+
+private:
+  static Analyze::SubnetCache* probe(std::vector<Entry>& table, size_t size, Key key);
+
+  std::vector<Entry> pawnTable, globalTable;
+};
+
+#endif // #ifndef KATYUSHAEVALCACHE_H_INCLUDED
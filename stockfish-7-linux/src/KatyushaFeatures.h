@@ -0,0 +1,184 @@
+/*
+  Stockfish, a UCI chess playing engine derived from Glaurung 2.1
+  Copyright (C) 2004-2008 Tord Romstad (Glaurung author)
+  Copyright (C) 2008-2015 Marco Costalba, Joona Kiiski, Tord Romstad
+  Copyright (C) 2015-2016 Marco Costalba, Joona Kiiski, Gary Linscott, Tord Romstad
+
+  Stockfish is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Stockfish is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+//Author: Benjamin Pachev 2016
+
+#ifndef KATYUSHAFEATURES_H_INCLUDED
+#define KATYUSHAFEATURES_H_INCLUDED
+
+#include <cstdint>
+
+#include "types.h"
+
+// The layout of Katyusha's feature vector. It lives apart from analyze.h so that
+// Position can keep the board features up to date in do_move() and undo_move().
+
+namespace Analyze {
+  //The features are as follows
+  // Side to move:
+  // Castling WK, WQ, BK, BQ
+
+  enum feature {
+     SIDE_TO_MOVE,
+     WCASTLE_OO,
+     WCASTLE_OOO,
+     BCASTLE_OO,
+     BCASTLE_OOO,
+     NUM_WQ,
+     NUM_WR,
+     NUM_WB,
+     NUM_WN,
+     NUM_WP,
+     NUM_BQ,
+     NUM_BR,
+     NUM_BB,
+     NUM_BN,
+     NUM_BP,
+     WK_RANK, WK_FILE, BK_RANK, BK_FILE,
+     WQ1_EXISTS, WQ1_RANK, WQ1_FILE, WQ1_MIN_DEFENDER, WQ1_MIN_ATTACKER, WQ1_SQUARES,
+     WR1_EXISTS, WR1_RANK, WR1_FILE, WR1_MIN_DEFENDER, WR1_MIN_ATTACKER, WR1_SQUARES,
+     WR2_EXISTS, WR2_RANK, WR2_FILE, WR2_MIN_DEFENDER, WR2_MIN_ATTACKER, WR2_SQUARES,
+     WB1_EXISTS, WB1_RANK, WB1_FILE, WB1_MIN_DEFENDER, WB1_MIN_ATTACKER, WB1_SQUARES,
+     WB2_EXISTS, WB2_RANK, WB2_FILE, WB2_MIN_DEFENDER, WB2_MIN_ATTACKER, WB2_SQUARES,
+     WK1_EXISTS, WK1_RANK, WK1_FILE, WK1_MIN_DEFENDER, WK1_MIN_ATTACKER,
+     WK2_EXISTS, WK2_RANK, WK2_FILE, WK2_MIN_DEFENDER, WK2_MIN_ATTACKER,
+     WP1_EXISTS, WP1_RANK, WP1_FILE, WP1_MIN_DEFENDER, WP1_MIN_ATTACKER, WP2_EXISTS, WP2_RANK, WP2_FILE, WP2_MIN_DEFENDER, WP2_MIN_ATTACKER, WP3_EXISTS, WP3_RANK, WP3_FILE, WP3_MIN_DEFENDER, WP3_MIN_ATTACKER, WP4_EXISTS, WP4_RANK, WP4_FILE, WP4_MIN_DEFENDER, WP4_MIN_ATTACKER,
+     WP5_EXISTS, WP5_RANK, WP5_FILE, WP5_MIN_DEFENDER, WP5_MIN_ATTACKER, WP6_EXISTS, WP6_RANK, WP6_FILE, WP6_MIN_DEFENDER, WP6_MIN_ATTACKER, WP7_EXISTS, WP7_RANK, WP7_FILE, WP7_MIN_DEFENDER, WP7_MIN_ATTACKER, WP8_EXISTS, WP8_RANK, WP8_FILE, WP8_MIN_DEFENDER, WP8_MIN_ATTACKER,
+     BQ1_EXISTS, BQ1_RANK, BQ1_FILE, BQ1_MIN_DEFENDER, BQ1_MIN_ATTACKER, BQ1_SQUARES, BR1_EXISTS, BR1_RANK, BR1_FILE, BR1_MIN_DEFENDER, BR1_MIN_ATTACKER, BR1_SQUARES, BR2_EXISTS, BR2_RANK, BR2_FILE, BR2_MIN_DEFENDER, BR2_MIN_ATTACKER, BR2_SQUARES,
+     BB1_EXISTS, BB1_RANK, BB1_FILE, BB1_MIN_DEFENDER, BB1_MIN_ATTACKER, BB1_SQUARES, BB2_EXISTS, BB2_RANK, BB2_FILE, BB2_MIN_DEFENDER, BB2_MIN_ATTACKER, BB2_SQUARES,
+     BK1_EXISTS, BK1_RANK, BK1_FILE, BK1_MIN_DEFENDER, BK1_MIN_ATTACKER, BK2_EXISTS, BK2_RANK, BK2_FILE, BK2_MIN_DEFENDER, BK2_MIN_ATTACKER,
+     BP1_EXISTS, BP1_RANK, BP1_FILE, BP1_MIN_DEFENDER, BP1_MIN_ATTACKER, BP2_EXISTS, BP2_RANK, BP2_FILE, BP2_MIN_DEFENDER, BP2_MIN_ATTACKER,
+     BP3_EXISTS, BP3_RANK, BP3_FILE, BP3_MIN_DEFENDER, BP3_MIN_ATTACKER, BP4_EXISTS, BP4_RANK, BP4_FILE, BP4_MIN_DEFENDER, BP4_MIN_ATTACKER, BP5_EXISTS, BP5_RANK, BP5_FILE, BP5_MIN_DEFENDER, BP5_MIN_ATTACKER,
+     BP6_EXISTS, BP6_RANK, BP6_FILE, BP6_MIN_DEFENDER, BP6_MIN_ATTACKER,
+     BP7_EXISTS, BP7_RANK, BP7_FILE, BP7_MIN_DEFENDER, BP7_MIN_ATTACKER,
+     BP8_EXISTS, BP8_RANK, BP8_FILE, BP8_MIN_DEFENDER, BP8_MIN_ATTACKER,
+     ATTACK_SQUARE_OFF,
+     DEFEND_SQUARE_OFF = ATTACK_SQUARE_OFF+64,
+     WHITE_PAWN_FILE = DEFEND_SQUARE_OFF+64,
+     BLACK_PAWN_FILE = WHITE_PAWN_FILE+8,
+     NB_FEATURES = BLACK_PAWN_FILE+8
+  };
+
+  // Each represented piece has a slot of consecutive features, e.g. WR2_EXISTS ... WR2_SQUARES.
+  // Knights and pawns have no SQUARES entry.
+  enum SlotFeature {
+     SLOT_EXISTS, SLOT_RANK, SLOT_FILE, SLOT_MIN_DEFENDER, SLOT_MIN_ATTACKER, SLOT_SQUARES
+  };
+
+  // Slots per piece type, the size of one slot and the first feature of the first slot
+  constexpr int SlotCount[PIECE_TYPE_NB] = { 0, 8, 2, 2, 2, 1, 0, 0 };
+  constexpr int SlotSize[PIECE_TYPE_NB]  = { 0, 5, 5, 6, 6, 6, 0, 0 };
+  constexpr int SlotBase[COLOR_NB][PIECE_TYPE_NB] = {
+    { 0, WP1_EXISTS, WK1_EXISTS, WB1_EXISTS, WR1_EXISTS, WQ1_EXISTS, 0, 0 },
+    { 0, BP1_EXISTS, BK1_EXISTS, BB1_EXISTS, BR1_EXISTS, BQ1_EXISTS, 0, 0 }
+  };
+  constexpr int CountFeature[COLOR_NB][PIECE_TYPE_NB] = {
+    { 0, NUM_WP, NUM_WN, NUM_WB, NUM_WR, NUM_WQ, 0, 0 },
+    { 0, NUM_BP, NUM_BN, NUM_BB, NUM_BR, NUM_BQ, 0, 0 }
+  };
+  constexpr int PawnFileBase[COLOR_NB] = { WHITE_PAWN_FILE, BLACK_PAWN_FILE };
+
+  // Feature layouts. A layout maps the colors and squares of the position to the ones
+  // the features are written for, given the side to move. The feature extractor in
+  // analyze.cpp is generated for the layout selected by FeatureLayout.
+  // Absolute: White's pieces go to the white features and the board is as it is.
+  struct AbsoluteLayout {
+    static Color color(Color, Color c) { return c; }
+    static Square square(Color, Square s) { return s; }
+  };
+
+  // SideRelative: the side to move's pieces go to the white features and the board is
+  // flipped vertically when Black is to move, so the side to move always plays up.
+  struct SideRelativeLayout {
+    static Color color(Color stm, Color c) { return stm == WHITE ? c : ~c; }
+    static Square square(Color stm, Square s) { return stm == WHITE ? s : ~s; }
+  };
+
+  // The networks are trained on the absolute layout, and Position only keeps the board
+  // features of that one up to date.
+  typedef AbsoluteLayout FeatureLayout;
+
+  // The board features are the ones that only depend on where the pieces stand:
+  // side to move, castling rights, material, and the existence and coordinates of
+  // each slot. Position updates them incrementally. All other features depend on
+  // attacks and are computed for the position at hand by Katyusha_attack_features().
+  inline bool is_board_feature(int f) {
+    if (f < WQ1_EXISTS)
+        return true;
+    if (f >= ATTACK_SQUARE_OFF)
+        return f >= WHITE_PAWN_FILE;
+    for (Color c = WHITE; c <= BLACK; ++c)
+        for (PieceType pt = PAWN; pt <= QUEEN; ++pt)
+            if (f >= SlotBase[c][pt] && f < SlotBase[c][pt] + SlotCount[pt] * SlotSize[pt])
+                return (f - SlotBase[c][pt]) % SlotSize[pt] <= SLOT_FILE;
+    return false;
+  }
+
+  // One board feature changed by a move, recorded in the StateInfo of the move
+  struct FeatureChange {
+    uint16_t index;
+    int8_t from, to;
+  };
+
+  const int MAX_FEATURE_CHANGES = 32;
+
+  // The nonzero features of a position in increasing index order, the first layer of the
+  // network then only has to read the weight columns of these.
+  struct SparseFeatures {
+    int count;
+    uint16_t index[NB_FEATURES];
+    int16_t value[NB_FEATURES];
+  };
+
+  // Collect the nonzero entries of a dense feature vector, without branching on them
+  template<typename T>
+  inline void to_sparse(const T* features, SparseFeatures& sf) {
+    int n = 0;
+    for (int i = 0; i < NB_FEATURES; ++i)
+    {
+        sf.index[n] = uint16_t(i);
+        sf.value[n] = int16_t(features[i]);
+        n += features[i] != 0;
+    }
+    sf.count = n;
+  }
+
+  // Largest first layer of the network whose pre-activations can be kept per
+  // ply in StateInfo. Networks with a wider first layer are evaluated from scratch.
+  const int MAX_ACCUMULATOR = 256;
+
+  // First layer outputs of one subnet of the network, for the subnets whose inputs only
+  // depend on the pawns (the pawn files) or mostly on the material (the global features).
+  // They are kept in the pawn and material hash tables, holding the relu outputs of the
+  // float network or the int32 sums of the quantized one for the evaluation generation
+  // they were computed in, 0 if none. Wider subnets are not cached.
+  const int MAX_CACHED_OUTPUTS = 32;
+
+  struct SubnetCache {
+    unsigned generation;
+    union {
+      float outputs[MAX_CACHED_OUTPUTS];
+      int32_t sums[MAX_CACHED_OUTPUTS];
+    };
+  };
+
+} // namespace Analyze
+
+#endif // #ifndef KATYUSHAFEATURES_H_INCLUDED
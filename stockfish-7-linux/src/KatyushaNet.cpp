@@ -1,62 +1,971 @@
+#include <atomic>
+#include <cerrno>
+#include <cmath>
+#include <stdexcept>
+#include <fcntl.h>     // For open
+#include <sys/mman.h>  // For mmap, munmap
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
 #include "KatyushaNet.h"
+#include "KatyushaNetFile.h"
+#include "LayerKernels.h"
+#include "misc.h"
+
+namespace {
+
+//the attack accumulator of a thread is computed from scratch this often, so rounding errors do not pile up
+const int AccumulatorRefreshPeriod = 4096;
+
+std::atomic<unsigned> loaded_versions(0);
+
+//crc32 of a native weight file, in pieces zlib's length type can hold
+uint32_t checksum(const char * data, size_t n)
+{
+  uLong crc = crc32(0, Z_NULL, 0);
+  for (size_t done = 0; done < n; )
+  {
+    uInt len = uInt(std::min(n - done, size_t(1) << 30));
+    crc = crc32(crc, (const Bytef*)data + done, len);
+    done += len;
+  }
+  return uint32_t(crc);
+}
+
+}
+
 
+//false if the archive has no weights and biases of matching shapes for layer_name
+bool KatyushaNet::load_layer(string layer_name, Layer* layer, cnpy::npz_t& archive)
+{
+  cnpy::npz_t::iterator weights = archive.find(layer_name + "_weights");
+  cnpy::npz_t::iterator biases = archive.find(layer_name + "_biases");
+  if (   weights == archive.end() || biases == archive.end()
+      || weights->second.shape.size() != 2 || biases->second.shape.size() != 1
+      || weights->second.shape[1] != biases->second.shape[0]
+      || weights->second.word_size != sizeof(float) || biases->second.word_size != sizeof(float))
+    return false;
+
+  layer->init_unitialized(weights->second.shape[0], weights->second.shape[1]);
+  layer->setBiases((float*)biases->second.data);
+  layer->weightsFromRotated((float*)weights->second.data);
+  return true;
+}
 
-void KatyushaNet::load_layer(string layer_name, Layer* layer, cnpy::npz_t& archive)
+//the archive is checked before anything is derived from it: every layer must be there with the shape of the topology,
+//and all weights finite. Returns false if it is not a network, the layers are then in an unspecified state.
+bool KatyushaNet::load(string archive_name, bool huge_pages)
 {
-  string wname = layer_name;
-  wname += "_weights";
-  cnpy::NpyArray weights = archive[wname];
-  string bname = layer_name;
-  bname += "_biases";
-  cnpy::NpyArray biases = archive[bname];
-  assert(weights.shape[1] == biases.shape[0]);
-  assert(weights.word_size == sizeof(float));
-  assert(biases.word_size == sizeof(float));
+  ifstream file(archive_name, ios::binary);
+  if (!file)
+    return false;
+  char magic[sizeof(KatyushaNetFile::Magic)] = {};
+  file.read(magic, sizeof(magic));
+  file.close();
+
+  unmap();
+  if (!memcmp(magic, KatyushaNetFile::Magic, sizeof(magic)))
+    return load_native(archive_name, huge_pages);
 
-  layer->init_unitialized(weights.shape[0], weights.shape[1]);
-  layer->setBiases((float*)biases.data);
-  layer->weightsFromRotated((float*)weights.data);
-  delete[] weights.data;
-  delete[] biases.data;
+  //cnpy throws on a file that is not an npz archive, or a corrupt one
+  cnpy::npz_t weights_npz;
+  bool ok = true;
+  try
+  {
+    weights_npz = cnpy::npz_load(archive_name);
+    for (size_t i = 0; i < initial_layers.size() && ok; i++)
+      ok = load_layer(initial_layers[i].name, (Layer*)(initial_layers[i].layer), weights_npz)
+        && initial_layers[i].layer->inputs == initial_layers[i].inputs;
+
+    ok = ok && load_layer("layer1", (Layer*)(&layer1), weights_npz)
+            && load_layer("outlayer", (Layer*)(&out), weights_npz);
+  }
+  catch (const std::exception&)
+  {
+    ok = false;
+  }
+  for (cnpy::npz_t::iterator it = weights_npz.begin(); it != weights_npz.end(); ++it)
+    it->second.destruct();
+  if (!ok || !valid())
+    return false;
+
+  prepare();
+  return true;
 }
 
-void KatyushaNet::load(string archive_name)
+//the layers fit together as the topology expects and all weights are finite
+bool KatyushaNet::valid() const
 {
-  cnpy::npz_t weights_npz = cnpy::npz_load(archive_name);
   for (size_t i = 0; i < initial_layers.size(); i++)
+    if (initial_layers[i].layer->inputs != initial_layers[i].inputs)
+      return false;
+
+  int first_outputs = 0;
+  for (size_t i = 0; i < initial_layers.size(); i++)
+    first_outputs += initial_layers[i].layer->outputs;
+  if (layer1.inputs != first_outputs || out.inputs != layer1.outputs || out.outputs != 1)
+    return false;
+
+  for (const Layer * l : layers())
+    for (int o = 0; o < l->outputs; o++)
+    {
+      if (!std::isfinite(l->_biases[o]))
+        return false;
+      for (int k = 0; k < l->inputs; k++)
+        if (!std::isfinite(l->_weights[size_t(o) * l->stride + k]))
+          return false;
+    }
+  return true;
+}
+
+//map the file and point the layers at its arrays. Everything is checked before a layer is touched.
+bool KatyushaNet::load_native(string file_name, bool huge_pages)
+{
+  using namespace KatyushaNetFile;
+
+  int fd = ::open(file_name.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  if (fstat(fd, &st) || size_t(st.st_size) < sizeof(Header))
+  {
+    ::close(fd);
+    return false;
+  }
+  const size_t bytes = size_t(st.st_size);
+  void * map = mmap(0, bytes, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (map == MAP_FAILED)
+    return false;
+  mapped.reset((char*)map, [bytes](char * p) { munmap(p, bytes); });
+  mapped_bytes = bytes;
+#ifdef MADV_HUGEPAGE
+  if (huge_pages)
+    madvise(map, mapped_bytes, MADV_HUGEPAGE);
+#else
+  (void)huge_pages;
+#endif
+
+  const char * base = mapped.get();
+  const Header * h = (const Header*)base;
+  const LayerRecord * records = (const LayerRecord*)(base + sizeof(Header));
+  vector<Layer*> l = layers();
+  vector<string> names = layer_names();
+  if (   memcmp(h->magic, Magic, sizeof(Magic)) || h->version != Version || h->bytes > mapped_bytes
+      || h->layers != l.size() || sizeof(Header) + l.size() * sizeof(LayerRecord) > h->bytes
+      || h->checksum != checksum(base + sizeof(Header), h->bytes - sizeof(Header)))
   {
-    load_layer(initial_layers[i].name, (Layer*)(initial_layers[i].layer), weights_npz);
+    unmap();
+    return false;
   }
 
-  load_layer("layer1", (Layer*)(&layer1), weights_npz);
-  load_layer("outlayer", (Layer*)(&out), weights_npz);
+  for (size_t i = 0; i < l.size(); i++)
+  {
+    const LayerRecord& r = records[i];
+    const uint64_t weight_bytes = uint64_t(r.stride) * r.outputs * sizeof(float);
+    const uint64_t bias_bytes = uint64_t(layer_padded(r.outputs)) * sizeof(float);
+    if (   strncmp(r.name, names[i].c_str(), sizeof(r.name)) || !r.inputs || !r.outputs
+        || r.stride != uint32_t(layer_padded(r.inputs)) || r.activation != uint32_t(l[i]->activation_type())
+        || r.weights % Align || r.biases % Align
+        || r.weights > h->bytes || weight_bytes > h->bytes - r.weights
+        || r.biases > h->bytes || bias_bytes > h->bytes - r.biases)
+    {
+      unmap();
+      return false;
+    }
+  }
+
+  //layer1 reads all first layer outputs, so its inputs are the width of the column table
+  const uint64_t column_bytes = uint64_t(h->features) * records[l.size() - 2].inputs * sizeof(float);
+  if (   h->features != TOTAL_FEATURES || h->columns % Align
+      || h->columns > h->bytes || column_bytes > h->bytes - h->columns)
+  {
+    unmap();
+    return false;
+  }
+  mapped_columns = (const float*)(base + h->columns);
+
+  for (size_t i = 0; i < l.size(); i++)
+    l[i]->useParams(records[i].inputs, records[i].outputs,
+                    (float*)(mapped.get() + records[i].weights), (float*)(mapped.get() + records[i].biases));
+  if (!valid())
+    return false;
+
+  prepare();
+  return true;
+}
+
+void KatyushaNet::unmap()
+{
+  mapped.reset();
+  mapped_bytes = 0;
+  mapped_columns = 0;
+}
+
+void KatyushaNet::assign(const KatyushaNet& net)
+{
+  vector<Layer*> l = layers();
+  vector<const Layer*> from = net.layers();
+  for (size_t i = 0; i < l.size(); i++)
+    l[i]->copyParams(*from[i]);
+  //the copies are this network's own, a file it was mapped from is no longer used
+  unmap();
+  prepare();
 }
 
+void KatyushaNet::same_weights(const KatyushaNet& net)
+{
+  if (!net.mapped)
+  {
+    assign(net);
+    return;
+  }
+  vector<Layer*> l = layers();
+  vector<const Layer*> from = net.layers();
+  for (size_t i = 0; i < l.size(); i++)
+    l[i]->useParams(from[i]->inputs, from[i]->outputs, from[i]->_weights, from[i]->_biases);
+  mapped = net.mapped;
+  mapped_bytes = net.mapped_bytes;
+  mapped_columns = net.mapped_columns;
+  prepare();
+}
 
-float KatyushaNet::evaluate(int * pos_features)
+void KatyushaNet::prepare()
 {
-  float fvec[TOTAL_FEATURES];
-  for (int i = 0; i < TOTAL_FEATURES; i++)
+  scratch_floats = 0;
+  quant_scratch_floats = 0;
+  for (size_t i = 0; i < initial_layers.size(); i++)
+    scratch_floats += layer_padded(initial_layers[i].layer->inputs);
+  scratch_floats += layer_padded(layer1.inputs) + layer_padded(layer1.outputs) + layer_padded(out.outputs);
+  load_fixed();
+
+  //lay out the first layer weights by feature for the accumulators and the sparse first layer
+  weights_version = ++loaded_versions;
+  accumulator_size = layer1.inputs <= Analyze::MAX_ACCUMULATOR ? layer1.inputs : 0;
+  //the column table of a mapped file is read in place, its checksum was verified when it was loaded
+  if (mapped_columns)
+    vector<float>().swap(column_mem);
+  else
+    column_mem.assign(size_t(TOTAL_FEATURES) * layer1.inputs, 0);
+  column_off.assign(TOTAL_FEATURES, 0);
+  column_len.assign(TOTAL_FEATURES, 0);
+  column_subnet.assign(TOTAL_FEATURES, 0);
+  first_biases.assign(layer1.inputs, 0);
+  attack_features.clear();
+
+  int in_off = 0, out_off = 0;
+  for (size_t i = 0; i < initial_layers.size(); i++)
   {
-    fvec[i] = (float)pos_features[i];
+    const Layer * l = initial_layers[i].layer;
+    for (int j = 0; j < l->inputs; j++)
+    {
+      column_off[in_off+j] = out_off;
+      column_len[in_off+j] = l->outputs;
+      column_subnet[in_off+j] = int(i);
+      if (!mapped_columns)
+        for (int k = 0; k < l->outputs; k++)
+          column_mem[size_t(in_off+j) * layer1.inputs + out_off + k] = l->_weights[k*l->stride + j];
+    }
+    memcpy(&first_biases[out_off], l->_biases, l->outputs*sizeof(float));
+    in_off += l->inputs;
+    out_off += l->outputs;
   }
 
-  float * f = fvec;
+  for (int f = 0; f < TOTAL_FEATURES; f++)
+    if (!Analyze::is_board_feature(f))
+      attack_features.push_back(f);
+
+  columns = mapped_columns ? mapped_columns : column_mem.data();
+}
+
+//evaluate the loaded layers with the compiled topology if they have it
+void KatyushaNet::load_fixed()
+{
+  vector<Layer*> first;
+  for (size_t i = 0; i < initial_layers.size(); i++)
+    first.push_back(initial_layers[i].layer);
+  fixed = fixed_net.load(first.data(), int(first.size()), layer1, out) ? &fixed_net : 0;
+}
+
+void KatyushaNet::add_column(float * acc, int feature, int value) const
+{
+  const float * col = &columns[size_t(feature) * layer1.inputs];
+  const float v = (float)value;
+  for (int k = column_off[feature], end = k + column_len[feature]; k < end; k++)
+    acc[k] += v * col[k];
+}
 
-  float first_layer_out[layer1.inputs];
+void KatyushaNet::refresh(const int8_t * board_features, float * acc) const
+{
+  memcpy(acc, first_biases.data(), accumulator_size*sizeof(float));
+  for (int f = 0; f < TOTAL_FEATURES; f++)
+    if (board_features[f])
+      add_column(acc, f, board_features[f]);
+}
 
+void KatyushaNet::update(const float * prev, float * acc, const Analyze::FeatureChange * changes, int count) const
+{
+  memcpy(acc, prev, accumulator_size*sizeof(float));
+  for (int i = 0; i < count; i++)
+    add_column(acc, changes[i].index, changes[i].to - changes[i].from);
+}
+
+//same scratch layout as the other evaluate, the first layer inputs are not used
+float KatyushaNet::evaluate(const float * board_acc, const int * pos_features, KatyushaScratch& scratch) const
+{
+  assert(incremental());
+  const int side = pos_features[Analyze::SIDE_TO_MOVE];
+  float * attack_acc = scratch.attackAccumulator[side];
+  int * last = scratch.lastFeatures[side];
+
+  if (scratch.accumulatorVersion[side] != weights_version || scratch.accumulatorUpdates[side] >= AccumulatorRefreshPeriod)
+  {
+    memset(attack_acc, 0, accumulator_size*sizeof(float));
+    for (size_t i = 0; i < attack_features.size(); i++)
+    {
+      const int f = attack_features[i];
+      if ((last[f] = pos_features[f]))
+        add_column(attack_acc, f, last[f]);
+    }
+    scratch.accumulatorVersion[side] = weights_version;
+    scratch.accumulatorUpdates[side] = 0;
+  }
+  else
+  {
+    for (size_t i = 0; i < attack_features.size(); i++)
+    {
+      const int f = attack_features[i];
+      if (pos_features[f] != last[f])
+      {
+        add_column(attack_acc, f, pos_features[f] - last[f]);
+        last[f] = pos_features[f];
+      }
+    }
+    scratch.accumulatorUpdates[side]++;
+  }
+
+  float * first_layer_out = first_layer_output(scratch);
+
+  for (int k = 0; k < accumulator_size; k++)
+  {
+    const float x = board_acc[k] + attack_acc[k];
+    first_layer_out[k] = x > 0 ? x : 0;
+  }
+
+  return finish(first_layer_out);
+}
+
+//the activations of one block of positions are laid out like those of evaluate(), one array per layer
+//with the positions one after the other
+void KatyushaNet::evaluate_batch(const int * pos_features, size_t n, float * out_arr, KatyushaScratch& scratch) const
+{
+  const int Block = 32;
+  float * fvec = scratch.floats(Block * scratch_floats);
+
+  for (size_t start = 0; start < n; start += Block)
+  {
+    const int count = int(min(n - start, size_t(Block)));
+    const int * block_features = pos_features + start * TOTAL_FEATURES;
+
+    float * first_layer_in = fvec;
+    float * first_layer_out = fvec;
+    for (size_t i = 0; i < initial_layers.size(); i++)
+      first_layer_out += Block * layer_padded(initial_layers[i].layer->inputs);
+    float * hidden = first_layer_out + Block * layer_padded(layer1.inputs);
+    float * result = hidden + Block * layer_padded(layer1.outputs);
+
+    int in_off = 0, out_off = 0;
+    for (size_t i = 0; i < initial_layers.size(); i++)
+    {
+      const Layer * l = initial_layers[i].layer;
+      const int in_stride = layer_padded(l->inputs);
+      for (int p = 0; p < count; p++)
+        for (int j = 0; j < l->inputs; j++)
+          first_layer_in[p*in_stride + j] = (float)block_features[p*TOTAL_FEATURES + in_off + j];
+
+      l->activate_batch(first_layer_in, in_stride, first_layer_out + out_off, layer_padded(layer1.inputs), count);
+      in_off += l->inputs;
+      out_off += l->outputs;
+      first_layer_in += Block * in_stride;
+    }
+
+    layer1.activate_batch(first_layer_out, layer_padded(layer1.inputs), hidden, layer_padded(layer1.outputs), count);
+    out.activate_batch(hidden, layer_padded(layer1.outputs), result, layer_padded(out.outputs), count);
+    for (int p = 0; p < count; p++)
+      out_arr[start + p] = result[p * layer_padded(out.outputs)];
+  }
+}
+
+namespace {
+
+//bytes rounded up to whole QUANT_ALIGN blocks, so every array of the quantized scratch layout is aligned
+inline size_t quant_block(size_t bytes) { return (bytes + QUANT_ALIGN - 1) / QUANT_ALIGN * QUANT_ALIGN; }
+
+}
+
+void KatyushaNet::quantize(const vector<vector<int> >& samples)
+{
+  //the largest activation of each first layer output over the samples, and over all outputs
+  vector<float> largest(layer1.inputs, 0);
+  float overall = 0;
+  KatyushaScratch scratch;
+  for (size_t s = 0; s < samples.size(); s++)
+  {
+    assert(samples[s].size() >= TOTAL_FEATURES);
+    const float * a = first_layers(samples[s].data(), scratch);
+    for (int k = 0; k < layer1.inputs; k++)
+    {
+      largest[k] = max(largest[k], a[k]);
+      overall = max(overall, a[k]);
+    }
+  }
+
+  //activations are stored as 0..QUANT_ACT_MAX. Positions the samples miss reach past the largest activation
+  //seen, so twice it maps to QUANT_ACT_MAX, and an output that stayed small or never fired in the samples gets
+  //the range of a quarter of the largest activation of all.
+  vector<float> act_scale(layer1.inputs);
+  for (int k = 0; k < layer1.inputs; k++)
+  {
+    const float range = max(2 * largest[k], overall / 4);
+    act_scale[k] = QUANT_ACT_MAX / (range > 0 ? range : 1);
+  }
+
+  act_mult.resize(layer1.inputs);
+  size_t bytes = 0;
   int out_off = 0;
+  for (size_t i = 0; i < initial_layers.size(); i++)
+  {
+    Int16Layer * q = initial_layers[i].qlayer;
+    q->quantize(*initial_layers[i].layer, 0);
+    for (int k = 0; k < q->outputs; k++)
+      act_mult[out_off+k] = act_scale[out_off+k] / q->row_scale[k];
+    out_off += q->outputs;
+    bytes += quant_block(q->stride * sizeof(int16_t));
+  }
+  qlayer1.quantize(layer1, act_scale.data(), QUANT_ACT_MAX);
+
+  bytes += quant_block(layer1.inputs * sizeof(int32_t)) + quant_block(qlayer1.stride * sizeof(int16_t))
+         + quant_block(layer1.outputs * sizeof(int32_t))
+         + quant_block(layer_padded(layer1.outputs) * sizeof(float)) + quant_block(layer_padded(out.outputs) * sizeof(float));
+  quant_scratch_floats = bytes / sizeof(float);
+}
+
+//the scratch space holds the int16 inputs of each first layer, the int32 first layer sums, the int16
+//activations, the int32 hidden sums, and the float hidden and output layers
+float KatyushaNet::evaluate_quantized(const int * pos_features, KatyushaScratch& scratch,
+                                      Analyze::SubnetCache * const * cache, unsigned gen) const
+{
+  assert(quantized());
+  char * p = (char*)scratch.floats(quant_scratch_floats);
+  Analyze::SubnetCache * usable[SUBNET_NB];
+  usable_caches(cache, usable);
+
+  int16_t * first_layer_in = (int16_t*)p;
   int in_off = 0;
   for (size_t i = 0; i < initial_layers.size(); i++)
   {
-    memcpy(first_layer_out+out_off, initial_layers[i].layer->activate(fvec+in_off), sizeof(float) * initial_layers[i].layer->outputs);
-    out_off += initial_layers[i].layer->outputs;
-    in_off += initial_layers[i].layer->inputs;
+    const Int16Layer * q = initial_layers[i].qlayer;
+    for (int j = 0; j < q->stride; j++)
+      first_layer_in[j] = int16_t(j < q->inputs ? pos_features[in_off+j] : 0);
+    in_off += q->inputs;
+    first_layer_in += quant_block(q->stride * sizeof(int16_t)) / sizeof(int16_t);
+  }
+
+  int32_t * sums = (int32_t*)first_layer_in;
+  int16_t * acts = (int16_t*)((char*)sums + quant_block(layer1.inputs * sizeof(int32_t)));
+  int32_t * hidden_sums = (int32_t*)((char*)acts + quant_block(qlayer1.stride * sizeof(int16_t)));
+  float * hidden = (float*)((char*)hidden_sums + quant_block(layer1.outputs * sizeof(int32_t)));
+  float * result = (float*)((char*)hidden + quant_block(layer_padded(layer1.outputs) * sizeof(float)));
+
+  int out_off = 0;
+  first_layer_in = (int16_t*)p;
+  for (size_t i = 0; i < initial_layers.size(); i++)
+  {
+    const Int16Layer * q = initial_layers[i].qlayer;
+    if (usable[i] && usable[i]->generation == gen)
+      memcpy(sums + out_off, usable[i]->sums, q->outputs*sizeof(int32_t));
+    else
+    {
+      q->activate(first_layer_in, sums + out_off);
+      if (usable[i])
+      {
+        memcpy(usable[i]->sums, sums + out_off, q->outputs*sizeof(int32_t));
+        usable[i]->generation = gen;
+      }
+    }
+    out_off += q->outputs;
+    first_layer_in += quant_block(q->stride * sizeof(int16_t)) / sizeof(int16_t);
+  }
+
+  //relu, clipped to QUANT_ACT_MAX
+  for (int k = 0; k < qlayer1.stride; k++)
+  {
+    const int a = k < layer1.inputs ? int(sums[k] * act_mult[k] + 0.5f) : 0;
+    acts[k] = int16_t(a < 0 ? 0 : a > QUANT_ACT_MAX ? QUANT_ACT_MAX : a);
+  }
+
+  qlayer1.activate(acts, hidden_sums);
+  for (int i = 0; i < layer1.outputs; i++)
+    hidden[i] = hidden_sums[i] > 0 ? hidden_sums[i] / qlayer1.row_scale[i] : 0;
+
+  out.activate(hidden, result);
+  return result[0];
+}
+
+
+//the scratch space holds each first layer's input on its own aligned block, followed by
+//the concatenated first layer outputs, the hidden layer and the output layer
+float * KatyushaNet::first_layers(const int * pos_features, KatyushaScratch& scratch) const
+{
+  float * fvec = scratch.floats(scratch_floats);
+  float * first_layer_in = fvec;
+  int in_off = 0;
+  for (size_t i = 0; i < initial_layers.size(); i++)
+  {
+    const int inputs = initial_layers[i].layer->inputs;
+    for (int j = 0; j < inputs; j++)
+    {
+      first_layer_in[j] = (float)pos_features[in_off+j];
+    }
+    in_off += inputs;
+    first_layer_in += layer_padded(inputs);
   }
   assert(in_off == TOTAL_FEATURES);
+
+  float * first_layer_out = first_layer_in;
+
+  int out_off = 0;
+  first_layer_in = fvec;
+  for (size_t i = 0; i < initial_layers.size(); i++)
+  {
+    initial_layers[i].layer->activate(first_layer_in, first_layer_out+out_off);
+    out_off += initial_layers[i].layer->outputs;
+    first_layer_in += layer_padded(initial_layers[i].layer->inputs);
+  }
   assert(out_off == layer1.inputs);
+  return first_layer_out;
+}
+
+//where evaluate() puts the first layer activations in the scratch space
+float * KatyushaNet::first_layer_output(KatyushaScratch& scratch) const
+{
+  return scratch.floats(scratch_floats) + (scratch_floats - layer_padded(layer1.inputs)
+         - layer_padded(layer1.outputs) - layer_padded(out.outputs));
+}
+
+//the hidden and output layers, which follow first_layer_out in the scratch space
+float KatyushaNet::finish(float * first_layer_out) const
+{
+  if (fixed)
+    return fixed->finish(first_layer_out);
+
+  float * hidden = first_layer_out + layer_padded(layer1.inputs);
+  float * result = hidden + layer_padded(layer1.outputs);
+  layer1.activate(first_layer_out, hidden);
+  out.activate(hidden, result);
+  return result[0];
+}
+
+float KatyushaNet::evaluate(const int * pos_features, KatyushaScratch& scratch) const
+{
+  if (fixed)
+    return fixed->evaluate(pos_features);
+
+  return finish(first_layers(pos_features, scratch));
+}
+
+//the first layer pre-activations are the biases plus the weight columns of the nonzero features,
+//same scratch layout as evaluate() with the first layer inputs not used
+float KatyushaNet::evaluate_sparse(const Analyze::SparseFeatures& sf, KatyushaScratch& scratch,
+                                   Analyze::SubnetCache * const * cache, unsigned gen) const
+{
+  Analyze::SubnetCache * usable[SUBNET_NB];
+  bool known[SUBNET_NB];
+  usable_caches(cache, usable);
+  for (int i = 0; i < SUBNET_NB; i++)
+    known[i] = usable[i] && usable[i]->generation == gen;
+
+  //the features are in order, so those of each subnet follow each other
+  float * first_layer_out = first_layer_output(scratch);
+  int begin = 0, end = 0, out_off = 0;
+  for (int i = 0; i < SUBNET_NB; i++)
+  {
+    const int outputs = initial_layers[i].layer->outputs;
+    float * a = first_layer_out + out_off;
+    while (end < sf.count && column_subnet[sf.index[end]] == i)
+      end++;
+
+    if (known[i])
+      memcpy(a, usable[i]->outputs, outputs*sizeof(float));
+    else
+    {
+      LayerKernels::sparse_gemv_relu(columns + out_off, layer1.inputs, &first_biases[out_off],
+                                     sf.index + begin, sf.value + begin, end - begin, outputs, a);
+      if (usable[i])
+      {
+        memcpy(usable[i]->outputs, a, outputs*sizeof(float));
+        usable[i]->generation = gen;
+      }
+    }
+    begin = end;
+    out_off += outputs;
+  }
+  return finish(first_layer_out);
+}
+
+void KatyushaNet::usable_caches(Analyze::SubnetCache * const * cache, Analyze::SubnetCache ** usable) const
+{
+  assert(initial_layers.size() == SUBNET_NB);
+  for (int i = 0; i < SUBNET_NB; i++)
+    usable[i] = cache && initial_layers[i].layer->outputs <= Analyze::MAX_CACHED_OUTPUTS ? cache[i] : 0;
+}
+
+namespace {
+
+//add the gradients of the weights and biases of l, for its input in and the deltas of its pre-activations, to g.
+//The deltas of its inputs go to in_delta unless that is null.
+void layer_gradient(const Layer& l, const float * in, const float * delta, LayerGradient& g, float * in_delta)
+{
+  if (in_delta)
+    memset(in_delta, 0, l.inputs*sizeof(float));
+  for (int o = 0; o < l.outputs; o++)
+  {
+    const float d = delta[o];
+    //most relu units are off, they pass nothing back
+    if (d == 0)
+      continue;
+    g.biases[o] += d;
+    LayerKernels::axpy(d, in, &g.weights[size_t(o) * l.stride], l.inputs);
+    if (in_delta)
+      LayerKernels::axpy(d, l._weights + size_t(o) * l.stride, in_delta, l.inputs);
+  }
+}
+
+}
+
+void KatyushaGradient::clear()
+{
+  for (LayerGradient& l : layers)
+  {
+    std::fill(l.weights.begin(), l.weights.end(), 0.0f);
+    std::fill(l.biases.begin(), l.biases.end(), 0.0f);
+  }
+  samples = 0;
+}
+
+void KatyushaGradient::add(const KatyushaGradient& g)
+{
+  assert(g.layers.size() == layers.size());
+  for (size_t i = 0; i < layers.size(); i++)
+  {
+    for (size_t k = 0; k < layers[i].weights.size(); k++)
+      layers[i].weights[k] += g.layers[i].weights[k];
+    for (size_t k = 0; k < layers[i].biases.size(); k++)
+      layers[i].biases[k] += g.layers[i].biases[k];
+  }
+  samples += g.samples;
+}
+
+vector<const Layer*> KatyushaNet::layers() const
+{
+  vector<const Layer*> l;
+  for (size_t i = 0; i < initial_layers.size(); i++)
+    l.push_back(initial_layers[i].layer);
+  l.push_back(&layer1);
+  l.push_back(&out);
+  return l;
+}
+
+size_t KatyushaNet::train_scratch_floats() const
+{
+  return scratch_floats + layer_padded(layer1.inputs) + layer_padded(layer1.outputs) + layer_padded(out.outputs);
+}
+
+void KatyushaNet::init_gradient(KatyushaGradient& g) const
+{
+  vector<const Layer*> l = layers();
+  g.layers.resize(l.size());
+  for (size_t i = 0; i < l.size(); i++)
+  {
+    g.layers[i].weights.assign(size_t(l[i]->outputs) * l[i]->stride, 0.0f);
+    g.layers[i].biases.assign(l[i]->outputs, 0.0f);
+  }
+  g.samples = 0;
+}
+
+//the scratch layout of evaluate() without FixedNet, which keeps no activations
+float KatyushaNet::forward(const int * pos_features, KatyushaScratch& scratch) const
+{
+  scratch.floats(train_scratch_floats());
+  float * first_layer_out = first_layers(pos_features, scratch);
+  float * hidden = first_layer_out + layer_padded(layer1.inputs);
+  float * result = hidden + layer_padded(layer1.outputs);
+  layer1.activate(first_layer_out, hidden);
+  out.activate(hidden, result);
+  return result[0];
+}
+
+//the deltas of the first layer outputs, the hidden layer and the output layer follow the activations
+void KatyushaNet::backward(float dloss, KatyushaScratch& scratch, KatyushaGradient& g) const
+{
+  assert(out.outputs == 1 && g.layers.size() == initial_layers.size() + 2);
+  float * first_layer_in = scratch.floats(train_scratch_floats());
+  float * first_layer_out = first_layer_output(scratch);
+  float * hidden = first_layer_out + layer_padded(layer1.inputs);
+  float * result = hidden + layer_padded(layer1.outputs);
+  float * first_delta = result + layer_padded(out.outputs);
+  float * hidden_delta = first_delta + layer_padded(layer1.inputs);
+  float * out_delta = hidden_delta + layer_padded(layer1.outputs);
+
+  //tanh' = 1 - tanh^2, relu' = 1 where the unit is on
+  out_delta[0] = dloss * (1 - result[0] * result[0]);
+  layer_gradient(out, hidden, out_delta, g.layers[initial_layers.size() + 1], hidden_delta);
+  for (int i = 0; i < layer1.outputs; i++)
+    hidden_delta[i] = hidden[i] > 0 ? hidden_delta[i] : 0;
+  layer_gradient(layer1, first_layer_out, hidden_delta, g.layers[initial_layers.size()], first_delta);
+  for (int i = 0; i < layer1.inputs; i++)
+    first_delta[i] = first_layer_out[i] > 0 ? first_delta[i] : 0;
+
+  int out_off = 0;
+  for (size_t i = 0; i < initial_layers.size(); i++)
+  {
+    const Layer& l = *initial_layers[i].layer;
+    layer_gradient(l, first_layer_in, first_delta + out_off, g.layers[i], 0);
+    out_off += l.outputs;
+    first_layer_in += layer_padded(l.inputs);
+  }
+  g.samples++;
+}
+
+vector<Layer*> KatyushaNet::layers()
+{
+  vector<Layer*> l;
+  for (size_t i = 0; i < initial_layers.size(); i++)
+    l.push_back(initial_layers[i].layer);
+  l.push_back(&layer1);
+  l.push_back(&out);
+  return l;
+}
+
+void KatyushaNet::adjust(const KatyushaGradient& delta)
+{
+  vector<Layer*> l = layers();
+  assert(delta.layers.size() == l.size());
+  for (size_t i = 0; i < l.size(); i++)
+  {
+    for (int o = 0; o < l[i]->outputs; o++)
+    {
+      l[i]->_biases[o] -= delta.layers[i].biases[o];
+      //the padding of the rows stays zero
+      LayerKernels::axpy(-1.0f, &delta.layers[i].weights[size_t(o) * l[i]->stride],
+                         l[i]->_weights + size_t(o) * l[i]->stride, l[i]->inputs);
+    }
+  }
+  prepare();
+}
+
+//Glorot uniform weights, scaled by the fan in and fan out of each layer as Keras initializes Dense layers
+void KatyushaNet::randomize(uint64_t seed)
+{
+  PRNG rng(seed);
+  vector<Layer*> l = layers();
+  for (size_t i = 0; i < l.size(); i++)
+  {
+    const double limit = std::sqrt(6.0 / (l[i]->inputs + l[i]->outputs));
+    for (int o = 0; o < l[i]->outputs; o++)
+    {
+      l[i]->_biases[o] = 0;
+      for (int k = 0; k < l[i]->inputs; k++)
+      {
+        double u = (rng.rand<uint64_t>() >> 11) * (1.0 / 9007199254740992.0); // [0, 1) from 53 bits
+        l[i]->_weights[size_t(o) * l[i]->stride + k] = float((2 * u - 1) * limit);
+      }
+    }
+  }
+  prepare();
+}
+
+vector<string> KatyushaNet::layer_names() const
+{
+  vector<string> names;
+  for (size_t i = 0; i < initial_layers.size(); i++)
+    names.push_back(initial_layers[i].name);
+  names.push_back("layer1");
+  names.push_back("outlayer");
+  return names;
+}
+
+//cnpy reports no errors of its own, so the temporary file is checked to be writable first, and to hold all the arrays,
+//which cnpy stores uncompressed, once they are written
+bool KatyushaNet::save(string archive_name) const
+{
+  vector<const Layer*> l = layers();
+  vector<string> names = layer_names();
+  const string tmp = archive_name + ".tmp" + to_string(getpid());
+  FILE * f = fopen(tmp.c_str(), "wb");
+  if (!f)
+    return false;
+  fclose(f);
+
+  size_t bytes = 0;
+  try
+  {
+    for (size_t i = 0; i < l.size(); i++)
+    {
+      //the archive has the weights rotated, one row of outputs per input
+      vector<float> rotated(size_t(l[i]->inputs) * l[i]->outputs);
+      for (int o = 0; o < l[i]->outputs; o++)
+        for (int k = 0; k < l[i]->inputs; k++)
+          rotated[size_t(k) * l[i]->outputs + o] = l[i]->_weights[size_t(o) * l[i]->stride + k];
+      const unsigned int wshape[] = { unsigned(l[i]->inputs), unsigned(l[i]->outputs) };
+      const unsigned int bshape[] = { unsigned(l[i]->outputs) };
+      cnpy::npz_save(tmp, names[i] + "_weights", rotated.data(), wshape, 2, i ? "a" : "w");
+      cnpy::npz_save(tmp, names[i] + "_biases", l[i]->_biases, bshape, 1, "a");
+      bytes += (rotated.size() + size_t(l[i]->outputs)) * sizeof(float);
+    }
+  }
+  catch (const std::exception&)
+  {
+    bytes = SIZE_MAX;
+  }
+
+  struct stat st;
+  if (stat(tmp.c_str(), &st) || size_t(st.st_size) < bytes || rename(tmp.c_str(), archive_name.c_str()))
+  {
+    unlink(tmp.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool KatyushaNet::save_native(string file_name) const
+{
+  return write_native(native_image(), file_name, true, false);
+}
+
+uint32_t KatyushaNet::native_checksum() const
+{
+  if (mapped)
+    return ((const KatyushaNetFile::Header*)mapped.get())->checksum;
+  vector<char> image = native_image();
+  return ((const KatyushaNetFile::Header*)image.data())->checksum;
+}
+
+//a file found at file_name is only used if it is the native file of these weights. One of another network, left by
+//an earlier run, is replaced, and a file that is not a native weight file is left alone. A few tries, in case other
+//processes replace it at the same time.
+bool KatyushaNet::share(string file_name, bool huge_pages) const
+{
+  using namespace KatyushaNetFile;
+
+  const vector<char> image = native_image();
+  const Header& h = *(const Header*)image.data();
+  for (int tries = 0; tries < 3; tries++)
+  {
+    ifstream file(file_name, ios::binary);
+    if (file.is_open())
+    {
+      Header found;
+      //a file shorter than a header, or without the magic, is not a native weight file
+      if (!file.read((char*)&found, sizeof(found)) || memcmp(found.magic, Magic, sizeof(Magic)))
+        return false;
+      if (found.version == h.version && found.bytes == h.bytes && found.checksum == h.checksum)
+        return true;
+      file.close();
+      if (unlink(file_name.c_str()) && errno != ENOENT)
+        return false;
+    }
+    if (write_native(image, file_name, false, huge_pages))
+      return true;
+  }
+  return false;
+}
+
+//the native weight file of the layers, see KatyushaNetFile.h
+vector<char> KatyushaNet::native_image() const
+{
+  using namespace KatyushaNetFile;
+
+  vector<const Layer*> l = layers();
+  vector<string> names = layer_names();
+  vector<LayerRecord> records(l.size());
+  uint64_t bytes = sizeof(Header) + l.size() * sizeof(LayerRecord);
+  for (size_t i = 0; i < l.size(); i++)
+  {
+    LayerRecord& r = records[i];
+    memset(&r, 0, sizeof(r));
+    strncpy(r.name, names[i].c_str(), sizeof(r.name) - 1);
+    r.inputs = l[i]->inputs;
+    r.outputs = l[i]->outputs;
+    r.stride = l[i]->stride;
+    r.activation = l[i]->activation_type();
+    r.weights = (bytes + Align - 1) / Align * Align;
+    r.biases = (r.weights + uint64_t(r.stride) * r.outputs * sizeof(float) + Align - 1) / Align * Align;
+    bytes = r.biases + layer_padded(r.outputs) * sizeof(float);
+  }
+  Header h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, Magic, sizeof(Magic));
+  h.version = Version;
+  h.layers = uint32_t(l.size());
+  h.features = TOTAL_FEATURES;
+  h.columns = (bytes + Align - 1) / Align * Align;
+  const size_t column_bytes = size_t(TOTAL_FEATURES) * layer1.inputs * sizeof(float);
+  h.bytes = h.columns + column_bytes;
+
+  //zeroed, so are the gaps between the arrays and the padding of the rows
+  vector<char> image(h.bytes, 0);
+  char * file = image.data();
+  memcpy(file + sizeof(Header), records.data(), l.size() * sizeof(LayerRecord));
+  for (size_t i = 0; i < l.size(); i++)
+  {
+    memcpy(file + records[i].weights, l[i]->_weights, size_t(l[i]->stride) * l[i]->outputs * sizeof(float));
+    memcpy(file + records[i].biases, l[i]->_biases, l[i]->outputs * sizeof(float));
+  }
+  memcpy(file + h.columns, columns, column_bytes);
+  h.checksum = checksum(file + sizeof(Header), h.bytes - sizeof(Header));
+  memcpy(file, &h, sizeof(h));
+  return image;
+}
+
+//fill a temporary file with image through a shared mapping, so hugetlbfs files can be written too, then move it to
+//file_name, or link it there if replace is false, which fails if another process got there first
+bool KatyushaNet::write_native(const vector<char>& image, string file_name, bool replace, bool huge_pages) const
+{
+  const string tmp = file_name + ".tmp" + to_string(getpid());
+  int fd = ::open(tmp.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+  if (fd < 0)
+    return false;
+  //hugetlbfs only takes whole huge pages, its block size
+  struct stat st;
+  size_t file_bytes = image.size();
+  if (!fstat(fd, &st) && st.st_blksize > 0)
+    file_bytes = (image.size() + st.st_blksize - 1) / st.st_blksize * st.st_blksize;
+  void * map = ftruncate(fd, off_t(file_bytes)) ? MAP_FAILED
+             : mmap(0, file_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (map == MAP_FAILED)
+  {
+    unlink(tmp.c_str());
+    return false;
+  }
+#ifdef MADV_HUGEPAGE
+  if (huge_pages)
+    madvise(map, file_bytes, MADV_HUGEPAGE);
+#else
+  (void)huge_pages;
+#endif
 
-  return out.activate(layer1.activate(first_layer_out))[0];
+  memcpy(map, image.data(), image.size());
+  bool ok = !msync(map, file_bytes, MS_SYNC);
+  munmap(map, file_bytes);
+  if (replace)
+    ok = ok && !rename(tmp.c_str(), file_name.c_str());
+  else
+    ok = ok && !link(tmp.c_str(), file_name.c_str());
+  unlink(tmp.c_str());
+  return ok;
 }
 
 KatyushaNet::~KatyushaNet()
@@ -64,5 +973,7 @@ KatyushaNet::~KatyushaNet()
   for (size_t i = 0; i < initial_layers.size(); i++)
   {
     delete initial_layers[i].layer;
+    delete initial_layers[i].qlayer;
   }
+  unmap();
 }
@@ -5,27 +5,49 @@
 #include <string>
 #include "cnpy.h"
 #include <map>
+#include <memory>
 #include <vector>
 #include "reluLayer.h"
 #include "tanhLayer.h"
-
-//SIDE TO MOVE, 4 CASTLE RIGHTS, 2*5 material counts
-#define GLOBAL_FEATURES 15
-//computed
-#define PIECE_FEATURES 164
-//two board maps of 64 squares
-#define SQUARE_FEATURES 128
-//8 files, 2 colors, num of pawns of given color on given file
-#define PAWN_FEATURES 16
-#define TOTAL_FEATURES (GLOBAL_FEATURES + PIECE_FEATURES + SQUARE_FEATURES + PAWN_FEATURES)
+#include "QuantizedLayer.h"
+#include "FixedNet.h"
+#include "KatyushaScratch.h"
+#include "KatyushaFeatures.h"
 
 using namespace std;
 
 
+//the topology of network_arch.py, evaluated by the unrolled FixedNet when a loaded archive has it
+typedef FixedNet<50, 1,
+                 FixedLayer<GLOBAL_FEATURES, 20, ACT_RELU>,
+                 FixedLayer<PIECE_FEATURES, 32, ACT_RELU>,
+                 FixedLayer<SQUARE_FEATURES, 64, ACT_RELU>,
+                 FixedLayer<PAWN_FEATURES, 20, ACT_RELU> > KatyushaFixedNet;
+
+//the first layer subnets, in the order of their features
+enum Subnet { GLOBAL_NET, PIECE_NET, SQUARE_NET, PAWN_NET, SUBNET_NB };
+
+//sums of the loss gradients of the weights and biases of each layer of a KatyushaNet over some samples, in the
+//padded row layout of the layers: the first layer subnets in order, then layer1 and the output layer
+struct LayerGradient {
+  vector<float> weights;
+  vector<float> biases;
+};
+
+struct KatyushaGradient {
+  vector<LayerGradient> layers;
+  int samples;
+
+  KatyushaGradient() : samples(0) {}
+  void clear();
+  void add(const KatyushaGradient& g);
+};
+
 struct firstLayer {
   string name;
   reluLayer * layer;
   int inputs;
+  Int16Layer * qlayer;
 };
 
 
@@ -61,14 +83,154 @@ public:
     for (size_t i = 0; i < initial_layers.size(); i++)
     {
       initial_layers[i].layer = new reluLayer();
+      initial_layers[i].qlayer = new Int16Layer();
     }
+    scratch_floats = 0;
+    quant_scratch_floats = 0;
+    fixed = 0;
+    columns = 0;
+    accumulator_size = 0;
+    weights_version = 0;
+    mapped_bytes = 0;
+    mapped_columns = 0;
   }
-  //load the weights of the model from an npz archive
-  void load(string archive_name);
-  float evaluate(int * pos_features);
-  void load_layer(string layer_name, Layer* layer, cnpy::npz_t& archive);
+  //load the weights of the model from an npz archive or a native weight file, false if it does not hold a network
+  //of this topology. A native file is mapped shared and its arrays used in place, read only, so processes that
+  //load the same file share one copy of the weights. huge_pages asks the kernel to back the mapping with them.
+  bool load(string archive_name, bool huge_pages = false);
+  //write the weights to a native weight file, see KatyushaNetFile.h
+  bool save_native(string file_name) const;
+  //write a native weight file to file_name for other processes to map, unless the one of these weights is already
+  //there, by its checksum. It is filled under a temporary name and linked in whole, so a process that finds it
+  //never reads a partial file, and of processes racing to create it one wins. Also works on hugetlbfs. False if it
+  //neither was nor could be created, or if file_name is some other file.
+  bool share(string file_name, bool huge_pages = false) const;
+  //the checksum of the native weight file of these weights, the one they were mapped from if they are mapped
+  uint32_t native_checksum() const;
+  //a copy of the weights of net, which has to be quantized again if it is used quantized
+  void assign(const KatyushaNet& net);
+  //the weights of net, in the same mapping if they are mapped from a file, which stays mapped while either
+  //network uses it, and copied like assign() otherwise
+  void same_weights(const KatyushaNet& net);
+  //all activations are written to scratch, so any number of threads can evaluate the same network
+  //as long as each passes its own scratch space
+  float evaluate(const int * pos_features, KatyushaScratch& scratch) const;
+  //the same from the nonzero features only, the first layer reads just their weight columns
+  //cache, if not null, has a SubnetCache or null for each subnet. The outputs of a subnet are read from
+  //its cache if that has generation gen, otherwise they are computed and stored there with generation gen.
+  float evaluate_sparse(const Analyze::SparseFeatures& sf, KatyushaScratch& scratch,
+                        Analyze::SubnetCache * const * cache = 0, unsigned gen = 0) const;
+  //evaluate n positions, the features of position p at pos_features + p*TOTAL_FEATURES, its evaluation to out[p]
+  //each layer runs over a block of positions at a time, so its weights are read once per block
+  void evaluate_batch(const int * pos_features, size_t n, float * out, KatyushaScratch& scratch) const;
+  bool load_layer(string layer_name, Layer* layer, cnpy::npz_t& archive);
+
+  //Incremental evaluation. The first layers are linear in the features before the relu, so their
+  //pre-activations are a sum of weight columns, one per feature scaled by its value. The part due to the
+  //board features is kept per ply and updated with the changes a move made, the part due to the attack
+  //features is kept per thread in the scratch space and updated with the features that differ from the
+  //last position evaluated.
+
+  //true if the loaded archive has the compiled topology, the float evaluations then go through FixedNet
+  bool fixed_topology() const { return fixed != 0; }
+
+  //false if the first layer is too wide for an accumulator, evaluate from scratch then
+  bool incremental() const { return accumulator_size > 0; }
+  //changes every time weights are loaded, accumulators computed with other weights are stale
+  unsigned version() const { return weights_version; }
+  //board feature pre-activations (biases included) from scratch
+  void refresh(const int8_t * board_features, float * acc) const;
+  //acc = prev plus the columns of the changed board features
+  void update(const float * prev, float * acc, const Analyze::FeatureChange * changes, int count) const;
+  //evaluate from the board accumulator of the position and its full feature vector
+  float evaluate(const float * board_acc, const int * pos_features, KatyushaScratch& scratch) const;
+
+  //Quantized inference: int16 first layer weights over the integer features with int32 sums, int16 hidden layer
+  //weights over int16 activations, the output layer stays in floats. The weight scales come from the loaded
+  //weights, the activation scales from the largest first layer activations over the sample feature vectors.
+  void quantize(const vector<vector<int> >& samples);
+  bool quantized() const { return quant_scratch_floats > 0; }
+  //the subnet caches hold int32 sums here, do not share a generation with the float evaluation
+  float evaluate_quantized(const int * pos_features, KatyushaScratch& scratch,
+                           Analyze::SubnetCache * const * cache = 0, unsigned gen = 0) const;
+
+  //Training. forward() evaluates through the runtime layers and keeps every activation in the scratch space,
+  //backward() then adds the gradients of the loss for that evaluation to g, given the derivative of the loss
+  //with respect to the output. The network is only read, so threads can train on it with their own scratch
+  //spaces and gradients while no one changes the weights.
+  float forward(const int * pos_features, KatyushaScratch& scratch) const;
+  void backward(float dloss, KatyushaScratch& scratch, KatyushaGradient& g) const;
+  //size g for the loaded layers, with all gradients 0
+  void init_gradient(KatyushaGradient& g) const;
+  //subtract the changes of a KatyushaOptimizer step from the weights and biases. The derived state is rebuilt and
+  //the version changes, but a quantized network has to be quantized again.
+  void adjust(const KatyushaGradient& delta);
+  //new weights for the loaded layers, for training from scratch
+  void randomize(uint64_t seed);
+  //write the weights to an npz archive in the layout load() reads. It is written to a temporary file that then
+  //replaces archive_name, so a crash never leaves a torn archive behind. Returns false if it could not be written.
+  bool save(string archive_name) const;
 
   ~KatyushaNet();
+  //the layers are owned, networks are copied with assign()
+  KatyushaNet(const KatyushaNet&) = delete;
+  KatyushaNet& operator=(const KatyushaNet&) = delete;
+
+private:
+  //size of the activation arrays evaluate() lays out in the scratch space
+  size_t scratch_floats;
+  //the same for evaluate_quantized(), 0 until quantize() is called
+  size_t quant_scratch_floats;
+
+  //write the first layer activations for pos_features to the scratch space and return them
+  float * first_layers(const int * pos_features, KatyushaScratch& scratch) const;
+  float * first_layer_output(KatyushaScratch& scratch) const;
+  //usable[i] = cache[i] if the outputs of subnet i fit a SubnetCache, else null
+  void usable_caches(Analyze::SubnetCache * const * cache, Analyze::SubnetCache ** usable) const;
+  float finish(float * first_layer_out) const;
+  void load_fixed();
+  //size the scratch space and lay out everything derived from the weights of the layers
+  void prepare();
+  bool load_native(string file_name, bool huge_pages);
+  vector<char> native_image() const;
+  bool write_native(const vector<char>& image, string file_name, bool replace, bool huge_pages) const;
+  bool valid() const;
+  void unmap();
+  //the npz names of the layers of layers()
+  vector<string> layer_names() const;
+  //the layers in the order of a KatyushaGradient
+  vector<const Layer*> layers() const;
+  vector<Layer*> layers();
+  //scratch space forward() and backward() lay out, the activations of evaluate() and the deltas after them
+  size_t train_scratch_floats() const;
+
+  void add_column(float * acc, int feature, int value) const;
+
+  //first layer weights by feature: TOTAL_FEATURES columns of layer1.inputs floats, feature f only
+  //feeds the column_len[f] outputs of its own subnet column_subnet[f], starting at column_off[f]
+  //columns points into the mapped file when it holds them, column_mem otherwise
+  const float * columns;
+  vector<float> column_mem;
+  vector<int> column_off, column_len, column_subnet;
+  //concatenated first layer biases
+  vector<float> first_biases;
+  //the features Katyusha_attack_features computes
+  vector<int> attack_features;
+  int accumulator_size;
+
+  //the loaded weights in the compiled topology, null if they do not fit it
+  KatyushaFixedNet * fixed;
+  KatyushaFixedNet fixed_net;
+
+  Int16Layer qlayer1;
+  //converts the int32 sums of the quantized first layers to the int16 inputs of qlayer1
+  vector<float> act_mult;
+  unsigned weights_version;
+  //the native weight file the layers use, if they were loaded from one
+  std::shared_ptr<char> mapped;
+  size_t mapped_bytes;
+  //the column table of the mapped file
+  const float * mapped_columns;
 };
 
 #endif
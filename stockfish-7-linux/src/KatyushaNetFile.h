@@ -0,0 +1,42 @@
+#ifndef KatyushaNetFile_h
+#define KatyushaNetFile_h
+#include <cstdint>
+
+//The native weight file of a KatyushaNet: the layers laid out as they are evaluated, each weight row padded to
+//LAYER_ALIGN floats, so the file is mapped and its arrays used in place instead of being parsed and transposed.
+//A Header, then one LayerRecord per layer in the order of KatyushaNet::layers(), then the arrays, each starting
+//at a multiple of Align bytes, and last the first layer weights by feature that the accumulators read. All numbers
+//are little endian. checksum is the crc32 of the bytes after the header up to bytes, the file may be longer when
+//it is padded to whole huge pages. KatyushaNet::load() tells the format from the magic, convert_weights writes it
+//from an npz archive and Katyusha_SharedWeights creates it for processes to share.
+namespace KatyushaNetFile {
+
+const char Magic[8] = { 'K', 'A', 'T', 'Y', 'N', 'E', 'T', '\x1a' };
+const uint32_t Version = 2;
+const uint64_t Align = 64;
+
+struct Header {
+  char magic[8];
+  uint32_t version;
+  uint32_t layers;
+  uint64_t bytes;     //size of the contents
+  uint32_t checksum;
+  uint32_t features;  //rows of the column table, TOTAL_FEATURES of the build that wrote it
+  uint64_t columns;   //offset of the column table, features rows of the inputs of layer1 floats
+};
+
+struct LayerRecord {
+  char name[16];      //the npz name, "global" ... "outlayer", zero padded
+  uint32_t inputs;
+  uint32_t outputs;
+  uint32_t stride;    //floats per weight row, layer_padded(inputs) of the build that wrote it
+  uint32_t activation;
+  uint64_t weights;   //offsets in the file of outputs rows of stride floats,
+  uint64_t biases;    //and of layer_padded(outputs) floats
+};
+
+static_assert(sizeof(Header) == 40 && sizeof(LayerRecord) == 48, "KatyushaNetFile records must not be padded");
+
+}
+
+#endif
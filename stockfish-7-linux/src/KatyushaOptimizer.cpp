@@ -0,0 +1,80 @@
+#include <cassert>
+#include <cmath>
+#include "KatyushaOptimizer.h"
+
+namespace {
+
+const float Beta1 = 0.9f, Beta2 = 0.999f;
+const float Epsilon = 1e-8f;
+
+//state sized like g with all entries 0
+void init_state(const KatyushaGradient& g, KatyushaGradient& state)
+{
+  state.layers.resize(g.layers.size());
+  for (size_t i = 0; i < g.layers.size(); i++)
+  {
+    state.layers[i].weights.assign(g.layers[i].weights.size(), 0.0f);
+    state.layers[i].biases.assign(g.layers[i].biases.size(), 0.0f);
+  }
+  state.samples = 0;
+}
+
+}
+
+bool KatyushaOptimizer::parse(const std::string& name, Method& m)
+{
+  if (name == "sgd")          m = SGD;
+  else if (name == "adagrad") m = ADAGRAD;
+  else if (name == "adam")    m = ADAM;
+  else return false;
+  return true;
+}
+
+//the entries padding the weight rows have zero gradients, so their changes are zero with every method
+void KatyushaOptimizer::step(const KatyushaGradient& g, KatyushaGradient& delta)
+{
+  if (delta.layers.size() != g.layers.size())
+    init_state(g, delta);
+  if (method != SGD && first.layers.size() != g.layers.size())
+  {
+    init_state(g, first);
+    init_state(g, second);
+    steps = 0;
+  }
+
+  const float scale = g.samples ? 1.0f / g.samples : 0.0f;
+  steps++;
+  //Adam's bias correction of the moving averages folded into the learning rate
+  const float adamRate = rate * std::sqrt(1 - std::pow(Beta2, float(steps))) / (1 - std::pow(Beta1, float(steps)));
+
+  for (size_t i = 0; i < g.layers.size(); i++)
+    for (int b = 0; b < 2; b++)
+    {
+      const vector<float>& grad = b ? g.layers[i].biases : g.layers[i].weights;
+      vector<float>& d = b ? delta.layers[i].biases : delta.layers[i].weights;
+      assert(grad.size() == d.size());
+      float * m = method == SGD ? 0 : (b ? first.layers[i].biases : first.layers[i].weights).data();
+      float * v = method == SGD ? 0 : (b ? second.layers[i].biases : second.layers[i].weights).data();
+
+      for (size_t k = 0; k < grad.size(); k++)
+      {
+        const float gk = grad[k] * scale;
+        switch (method)
+        {
+        case SGD:
+          d[k] = rate * gk;
+          break;
+        case ADAGRAD:
+          m[k] += gk * gk;
+          d[k] = rate * gk / (std::sqrt(m[k]) + Epsilon);
+          break;
+        case ADAM:
+          m[k] = Beta1 * m[k] + (1 - Beta1) * gk;
+          v[k] = Beta2 * v[k] + (1 - Beta2) * gk * gk;
+          d[k] = adamRate * m[k] / (std::sqrt(v[k]) + Epsilon);
+          break;
+        }
+      }
+    }
+  delta.samples = g.samples;
+}
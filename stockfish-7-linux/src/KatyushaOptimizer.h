@@ -0,0 +1,33 @@
+#ifndef KatyushaOptimizer_h
+#define KatyushaOptimizer_h
+#include <string>
+#include "KatyushaNet.h"
+
+//turns the gradients summed by KatyushaNet::backward() into the changes KatyushaNet::adjust() makes to the weights,
+//by plain gradient descent, Adagrad or Adam. The per weight state of Adagrad and Adam is kept in the layout of
+//the gradients, and sized by the first step.
+class KatyushaOptimizer
+{
+public:
+  enum Method { SGD, ADAGRAD, ADAM };
+
+  Method method;
+  float rate;
+
+  KatyushaOptimizer(Method m = SGD, float learning_rate = 0) : method(m), rate(learning_rate ? learning_rate : default_rate(m)), steps(0) {}
+
+  //the method called name ("sgd", "adagrad" or "adam"), false if there is none
+  static bool parse(const std::string& name, Method& m);
+  //the learning rates Keras defaults to
+  static float default_rate(Method m) { return m == ADAM ? 0.001f : 0.01f; }
+
+  //the change of each weight and bias to delta, for the mean of the gradients summed in g
+  void step(const KatyushaGradient& g, KatyushaGradient& delta);
+
+private:
+  //sum of squared gradients for Adagrad, moving averages of the gradients and their squares for Adam
+  KatyushaGradient first, second;
+  int steps;
+};
+
+#endif
@@ -0,0 +1,77 @@
+#ifndef KatyushaScratch_h
+#define KatyushaScratch_h
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include "Layer.h"
+#include "KatyushaFeatures.h"
+
+//SIDE TO MOVE, 4 CASTLE RIGHTS, 2*5 material counts
+#define GLOBAL_FEATURES 15
+//computed
+#define PIECE_FEATURES 164
+//two board maps of 64 squares
+#define SQUARE_FEATURES 128
+//8 files, 2 colors, num of pawns of given color on given file
+#define PAWN_FEATURES 16
+#define TOTAL_FEATURES (GLOBAL_FEATURES + PIECE_FEATURES + SQUARE_FEATURES + PAWN_FEATURES)
+
+//Everything one evaluation of a KatyushaNet writes to: the feature vector and the activations of every layer.
+//Each search thread owns one (Thread::netScratch), so the network weights are only ever read during search.
+class KatyushaScratch
+{
+public:
+  int features[TOTAL_FEATURES];
+  //the nonzero ones, for the sparse first layer
+  Analyze::SparseFeatures sparse;
+
+  //the attack features of the last position evaluated incrementally, and their share of the first layer pre-activations
+  //consecutive evaluations of a search are close, so only the features that differ get added in
+  //the square maps are relative to the side to move, so there is one of each per side to move
+  int lastFeatures[COLOR_NB][TOTAL_FEATURES];
+  float attackAccumulator[COLOR_NB][Analyze::MAX_ACCUMULATOR];
+  //version of the weights attackAccumulator was computed with, 0 if none
+  unsigned accumulatorVersion[COLOR_NB];
+  //number of updates since attackAccumulator was last computed from scratch
+  int accumulatorUpdates[COLOR_NB];
+
+  //first layer pre-activations due to the board features of the positions this thread evaluates, one slot per
+  //StateInfo::accumulatorPly modulo AccumulatorSlots. A slot belongs to the StateInfo that last filled it,
+  //its accumulator is valid if the StateInfo owns the slot and has the version of the weights.
+  static const int AccumulatorSlots = 64;
+  float boardAccumulator[AccumulatorSlots][Analyze::MAX_ACCUMULATOR];
+  const void * accumulatorOwner[AccumulatorSlots];
+
+  KatyushaScratch() : accumulatorVersion(), accumulatorUpdates(), accumulatorOwner(), mem(0), data(0), capacity(0) {}
+  ~KatyushaScratch() { free(mem); }
+
+  //return an array of at least n floats aligned like the layer weights
+  //the contents are not preserved when the array has to grow
+  float * floats(size_t n)
+  {
+    if (n > capacity)
+    {
+      const size_t AlignBytes = LAYER_ALIGN * sizeof(float);
+      free(mem);
+      mem = calloc(n * sizeof(float) + AlignBytes - 1, 1);
+      if (!mem)
+      {
+        std::cerr << "Failed to allocate network scratch space." << std::endl;
+        exit(EXIT_FAILURE);
+      }
+      data = (float*)((uintptr_t(mem) + AlignBytes - 1) & ~(AlignBytes - 1));
+      capacity = n;
+    }
+    return data;
+  }
+
+  KatyushaScratch(const KatyushaScratch&) = delete;
+  KatyushaScratch& operator=(const KatyushaScratch&) = delete;
+
+private:
+  void * mem;
+  float * data;
+  size_t capacity;
+};
+
+#endif
@@ -0,0 +1,302 @@
+/*
+  Stockfish, a UCI chess playing engine derived from Glaurung 2.1
+  Copyright (C) 2004-2008 Tord Romstad (Glaurung author)
+  Copyright (C) 2008-2015 Marco Costalba, Joona Kiiski, Tord Romstad
+  Copyright (C) 2015-2016 Marco Costalba, Joona Kiiski, Gary Linscott, Tord Romstad
+
+  Stockfish is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Stockfish is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+#include "analyze.h"
+#include "KatyushaEngine.h"
+#include "KatyushaOptimizer.h"
+#include "KatyushaTrainer.h"
+#include "NpyWriter.h"
+#include "PackedPosition.h"
+
+using namespace std;
+
+namespace {
+
+  // Pawns per unit of network output, SCORE_SCALE of network_arch.py
+  const float ScoreScale = 50;
+
+  // Samples are shuffled in blocks of this many consecutive ones, so the
+  // mapped training set is read in runs rather than one record at a time.
+  const size_t BlockSamples = 64;
+
+  // Validation samples scored per pass of the workers
+  const size_t ValidationChunk = 1 << 16;
+
+  struct TrainParams {
+    int epochs = 50;
+    size_t batch = 256;
+    KatyushaOptimizer::Method optimizer = KatyushaOptimizer::ADAGRAD;
+    float rate = 0;           // 0 for the default of the optimizer
+    bool mse = false;         // Squared error instead of the absolute error of network_arch.py
+    float validation = 0.25f; // The fraction of the set held out at its end, as Keras' validation_split
+    string weights;           // The weights to start from, the weightsfile if empty
+    bool randomize = false;   // Start from random weights of the same topology instead
+    uint64_t seed = 0;
+  };
+
+
+  /// TrainingSet reads the samples of a training set as they are needed, from
+  /// a file of packed positions or from the prefix_x.npy and prefix_y.npy
+  /// arrays of gen_training_set and unpack_training_set. Both are mapped.
+
+  class TrainingSet {
+
+  public:
+    bool open(const string& name) {
+      return    packed.open(name)
+             || (   x.open(name + "_x.npy", "'<f4'", sizeof(float), Analyze::NB_FEATURES)
+                 && y.open(name + "_y.npy", "'<f4'", sizeof(float), 0)
+                 && x.rows() == y.rows());
+    }
+
+    size_t size() const { return packed.size() ? packed.size() : x.rows(); }
+
+    // The features of sample i and its evaluation in units of the network
+    // output, clamped to the range of tanh. False if it has no evaluation.
+    bool sample(size_t i, int* features, float& target) const {
+
+      float pawns;
+      if (packed.size())
+      {
+          if (packed[i].eval == VALUE_NONE)
+              return false;
+
+          Analyze::Katyusha_packed_rep(packed[i], features);
+          pawns = float(packed[i].eval) / PawnValueEg;
+      }
+      else
+      {
+          const float* f = (const float*)x.row(i);
+          for (int k = 0; k < Analyze::NB_FEATURES; ++k)
+              features[k] = int(f[k]);
+          pawns = *(const float*)y.row(i);
+      }
+      target = std::max(-1.0f, std::min(1.0f, pawns / ScoreScale));
+      return true;
+    }
+
+  private:
+    PackedPositionFile packed;
+    NpyReader x, y;
+  };
+
+
+  // Worker k of n goes through the samples idx[k], idx[k + n], ... and adds up
+  // the losses of the network on them. If g is not null, the gradients of the
+  // losses are added to it as well.
+  void train_worker(const TrainingSet& data, const KatyushaNet& net, const vector<size_t>& idx,
+                    size_t k, size_t n, bool mse, KatyushaScratch& scratch, KatyushaGradient* g,
+                    double& loss, size_t& samples) {
+
+    int features[Analyze::NB_FEATURES];
+    float target;
+
+    for (size_t j = k; j < idx.size(); j += n)
+    {
+        if (!data.sample(idx[j], features, target))
+            continue;
+
+        float e = net.forward(features, scratch) - target;
+        loss += mse ? double(e) * e : std::abs(e);
+        ++samples;
+
+        // The derivative of e^2 / 2 or of |e|
+        if (g)
+            net.backward(mse ? e : float((e > 0) - (e < 0)), scratch, *g);
+    }
+  }
+
+
+  // One pass of the workers over idx, the gradients are summed in grads[0] if
+  // grads is not null. Returns the number of samples with an evaluation.
+  size_t run_workers(const TrainingSet& data, const KatyushaNet& net, const vector<size_t>& idx, bool mse,
+                     vector<KatyushaScratch>& scratch, vector<KatyushaGradient>* grads, double& loss) {
+
+    size_t n = scratch.size();
+    vector<double> losses(n, 0.0);
+    vector<size_t> samples(n, 0);
+    vector<std::thread> workers;
+
+    for (size_t k = 0; k < n; ++k)
+    {
+        if (grads)
+            (*grads)[k].clear();
+        workers.emplace_back(train_worker, std::cref(data), std::cref(net), std::cref(idx), k, n, mse,
+                             std::ref(scratch[k]), grads ? &(*grads)[k] : nullptr,
+                             std::ref(losses[k]), std::ref(samples[k]));
+    }
+
+    size_t total = 0;
+    for (size_t k = 0; k < n; ++k)
+    {
+        workers[k].join();
+        loss += losses[k];
+        total += samples[k];
+        if (grads && k)
+            (*grads)[0].add((*grads)[k]);
+    }
+    return total;
+  }
+
+
+  // The mean loss in centipawns, the square root of it for squared errors
+  double loss_cp(double loss, size_t samples, bool mse) {
+
+    double mean = loss / std::max(samples, size_t(1));
+    return (mse ? std::sqrt(mean) : mean) * ScoreScale * 100;
+  }
+
+} // namespace
+
+
+/// KatyushaTrainer::train() trains a network on the training set named by the
+/// first argument and saves its weights to the npz archive named by the second
+/// after every epoch, in the layout KatyushaNet::load() reads. The settings
+/// follow as name value pairs: epochs, batch, optimizer (sgd, adagrad or adam),
+/// rate, loss (mae or mse), validation, weights, init (random) and seed. The
+/// defaults are the ones of bootstrap_eval.py.
+///
+/// The training set is read through memory maps, one minibatch at a time. The
+/// samples of a minibatch are split between Threads workers, which add up the
+/// gradients of their samples on their own, and the optimizer takes a step
+/// with the sum once all of them are done.
+
+void KatyushaTrainer::train(std::istringstream& is) {
+
+  string infile, outfile, token;
+  TrainParams p;
+
+  if (!(is >> infile) || !(is >> outfile))
+  {
+      sync_cout << "Missing training set or weights file" << sync_endl;
+      return;
+  }
+
+  while (is >> token)
+  {
+      string value;
+      if (!(is >> value))
+          break;
+
+      int batch = int(p.batch);
+
+      if      (token == "epochs")     parse(value, p.epochs);
+      else if (token == "batch")      parse(value, batch), p.batch = size_t(std::max(batch, 1));
+      else if (token == "rate")       parse(value, p.rate);
+      else if (token == "loss")       p.mse = value == "mse";
+      else if (token == "validation") parse(value, p.validation), p.validation = std::min(std::max(p.validation, 0.0f), 1.0f);
+      else if (token == "weights")    p.weights = value;
+      else if (token == "init")       p.randomize = value == "random";
+      else if (token == "seed")       parse(value, p.seed);
+      else if (token == "optimizer" && !KatyushaOptimizer::parse(value, p.optimizer))
+      {
+          sync_cout << "Unknown optimizer " << value << sync_endl;
+          return;
+      }
+  }
+
+  TrainingSet data;
+  if (!data.open(infile))
+  {
+      sync_cout << infile << " is neither packed positions nor the prefix of _x.npy and _y.npy" << sync_endl;
+      return;
+  }
+
+  // A native weight file is mapped read only, so train on a copy of it
+  KatyushaNet initial, net;
+  string weights = p.weights.empty() ? KatyushaEngine::getWeightsfile() : p.weights;
+  if (!initial.load(weights))
+  {
+      sync_cout << weights << " does not hold a network to start from" << sync_endl;
+      return;
+  }
+  net.assign(initial);
+  if (p.randomize)
+      net.randomize(p.seed ? p.seed : now());
+
+  const size_t trainEnd = data.size() - size_t(data.size() * p.validation);
+  const size_t n = Threads.size();
+  vector<KatyushaScratch> scratch(n);
+  vector<KatyushaGradient> grads(n);
+  for (KatyushaGradient& g : grads)
+      net.init_gradient(g);
+
+  KatyushaGradient delta;
+  KatyushaOptimizer optimizer(p.optimizer, p.rate);
+  PRNG rng(p.seed ? p.seed : now());
+  vector<size_t> blocks((trainEnd + BlockSamples - 1) / BlockSamples), idx;
+
+  sync_cout << "Training on " << trainEnd << " samples, validating on " << data.size() - trainEnd
+            << ", learning rate " << optimizer.rate << sync_endl;
+
+  for (int epoch = 1; epoch <= p.epochs; ++epoch)
+  {
+      TimePoint start = now();
+      double trainLoss = 0, validLoss = 0;
+      size_t trainSamples = 0, validSamples = 0;
+
+      for (size_t i = 0; i < blocks.size(); ++i)
+          blocks[i] = i;
+      for (size_t i = blocks.size(); i > 1; --i)
+          std::swap(blocks[i - 1], blocks[rng.rand<uint64_t>() % i]);
+
+      // Each minibatch is made of whole blocks, at least batch samples of them
+      for (size_t b = 0; b < blocks.size(); )
+      {
+          idx.clear();
+          for ( ; idx.size() < p.batch && b < blocks.size(); ++b)
+              for (size_t s = blocks[b] * BlockSamples; s < std::min((blocks[b] + 1) * BlockSamples, trainEnd); ++s)
+                  idx.push_back(s);
+
+          if (run_workers(data, net, idx, p.mse, scratch, &grads, trainLoss))
+          {
+              trainSamples += size_t(grads[0].samples);
+              optimizer.step(grads[0], delta);
+              net.adjust(delta);
+          }
+      }
+
+      for (size_t first = trainEnd; first < data.size(); first += ValidationChunk)
+      {
+          idx.clear();
+          for (size_t s = first; s < std::min(first + ValidationChunk, data.size()); ++s)
+              idx.push_back(s);
+          validSamples += run_workers(data, net, idx, p.mse, scratch, nullptr, validLoss);
+      }
+
+      const char* loss = p.mse ? "rms error " : "mean error ";
+      sync_cout << "Epoch " << epoch << ": training " << loss << loss_cp(trainLoss, trainSamples, p.mse)
+                << " cp, validation " << loss << loss_cp(validLoss, validSamples, p.mse) << " cp, "
+                << 1000 * (trainSamples + validSamples) / (now() - start + 1) << " samples/s" << sync_endl;
+
+      if (!net.save(outfile))
+      {
+          sync_cout << "Failed to write the weights to " << outfile << sync_endl;
+          return;
+      }
+  }
+}
@@ -0,0 +1,49 @@
+/*
+  Stockfish, a UCI chess playing engine derived from Glaurung 2.1
+  Copyright (C) 2004-2008 Tord Romstad (Glaurung author)
+  Copyright (C) 2008-2015 Marco Costalba, Joona Kiiski, Tord Romstad
+  Copyright (C) 2015-2016 Marco Costalba, Joona Kiiski, Gary Linscott, Tord Romstad
+
+  Stockfish is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Stockfish is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef KATYUSHATRAINER_H_INCLUDED
+#define KATYUSHATRAINER_H_INCLUDED
+
+#include <sstream>
+#include <string>
+
+/// KatyushaTrainer fits the weights of a KatyushaNet to the evaluations of a
+/// training set, the native replacement of bootstrap_eval.py.
+
+namespace KatyushaTrainer {
+
+void train(std::istringstream& is);
+
+/// parse() reads the value of a setting of a training command into v, which
+/// keeps its default if the value is not a T
+
+template<typename T>
+void parse(const std::string& value, T& v) {
+
+  std::istringstream ss(value);
+  T t;
+  if (ss >> t)
+      v = t;
+}
+
+}
+
+#endif // #ifndef KATYUSHATRAINER_H_INCLUDED
@@ -1,41 +1,53 @@
 #include "Layer.h"
+#include "LayerKernels.h"
+#include <cstdint>
 #include <iostream>
 using namespace std;
+using namespace LayerKernels;
+
+namespace {
+
+const size_t AlignBytes = LAYER_ALIGN * sizeof(float);
+
+}
 
 Layer::~Layer()
 {
-  if (_weights) free(_weights);
+  release();
+}
+
+void Layer::release()
+{
+  free(mem);
+  mem = 0;
   _weights = 0;
-  if (_biases) free(_biases);
   _biases = 0;
-  if (output_arr) free(output_arr);
-  output_arr = 0;
 }
 
 float Layer::activation_func(float out)
 {
-//  cout << "calling parent activation " << endl;
-  return out;
+  return epilogue(out, activation);
 }
 
 
-//return a pointer to the array of activations
-//this pointer is only good untill the next time someone tries to activate the network
-//so copy the data if needed elsewhere
-float * Layer::activate(float * input_arr)
+void Layer::activate(const float * input_arr, float * output_arr) const
 {
-  for (int i = 0; i < outputs; i++)
+  switch (activation)
   {
-    output_arr[i] = _biases[i];
-    int off = inputs*i;
-    for (int j = 0; j < inputs; j++)
-    {
-      output_arr[i] += _weights[off+j]*input_arr[j];
-    }
+  case ACT_RELU: gemv<ACT_RELU>(_weights, _biases, outputs, inputs, stride, input_arr, output_arr); break;
+  case ACT_TANH: gemv<ACT_TANH>(_weights, _biases, outputs, inputs, stride, input_arr, output_arr); break;
+  default:       gemv<ACT_LINEAR>(_weights, _biases, outputs, inputs, stride, input_arr, output_arr); break;
+  }
+}
 
-    output_arr[i] = activation_func(output_arr[i]);
+void Layer::activate_batch(const float * input_arr, int in_stride, float * output_arr, int out_stride, int n) const
+{
+  switch (activation)
+  {
+  case ACT_RELU: gemm<ACT_RELU>(_weights, _biases, outputs, inputs, stride, input_arr, in_stride, output_arr, out_stride, n); break;
+  case ACT_TANH: gemm<ACT_TANH>(_weights, _biases, outputs, inputs, stride, input_arr, in_stride, output_arr, out_stride, n); break;
+  default:       gemm<ACT_LINEAR>(_weights, _biases, outputs, inputs, stride, input_arr, in_stride, output_arr, out_stride, n); break;
   }
-  return output_arr;
 }
 
 void Layer::printRotatedWeights()
@@ -46,7 +58,7 @@ void Layer::printRotatedWeights()
     cout << "[" << endl;
     for (int i = 0; i < outputs; i++)
     {
-      cout << _weights[i*inputs + j] << " ,";
+      cout << _weights[i*stride + j] << " ,";
     }
     cout << "]" << endl;
 
@@ -54,26 +66,60 @@ void Layer::printRotatedWeights()
   cout << "]" << endl;
 }
 
+//weights and biases share one zeroed allocation, each array starting on an AlignBytes boundary
+//calling this again on a loaded layer frees the old buffers first
 void Layer::init_unitialized(int layer_inputs, int layer_outputs)
 {
+  release();
   outputs = layer_outputs;
   inputs = layer_inputs;
-  output_arr = (float*)malloc(sizeof(float)*layer_outputs);
-  _biases = (float*)malloc(sizeof(float)*layer_outputs);
-  _weights = (float*)malloc(sizeof(float)*layer_outputs*layer_inputs);
+  stride = layer_padded(layer_inputs);
+  size_t nfloats = size_t(stride)*layer_outputs + layer_padded(layer_outputs);
+  mem = calloc(nfloats*sizeof(float) + AlignBytes - 1, 1);
+  if (!mem)
+  {
+    cerr << "Failed to allocate a " << layer_inputs << "x" << layer_outputs << " layer." << endl;
+    exit(EXIT_FAILURE);
+  }
+  _weights = (float*)((uintptr_t(mem) + AlignBytes - 1) & ~(AlignBytes - 1));
+  _biases = _weights + size_t(stride)*layer_outputs;
 }
 
 Layer::Layer(int layer_inputs, int layer_outputs, float ** weights, float * biases)
 {
+  mem = 0;
+  activation = ACT_LINEAR;
   init_unitialized(layer_inputs, layer_outputs);
   setParams(weights, biases);
 }
 
 Layer::Layer(int layer_inputs, int layer_outputs, float * weights, float * biases)
 {
+  mem = 0;
+  activation = ACT_LINEAR;
   init_unitialized(layer_inputs, layer_outputs);
   setBiases(biases);
-  memcpy(_weights, weights, layer_inputs*layer_outputs*sizeof(float));
+  for (int i = 0; i < outputs; i++)
+  {
+    memcpy(_weights+i*stride, weights+i*inputs, inputs*sizeof(float));
+  }
+}
+
+void Layer::copyParams(const Layer& l)
+{
+  init_unitialized(l.inputs, l.outputs);
+  memcpy(_weights, l._weights, size_t(stride)*outputs*sizeof(float));
+  setBiases(l._biases);
+}
+
+void Layer::useParams(int layer_inputs, int layer_outputs, float * weights, float * biases)
+{
+  release();
+  inputs = layer_inputs;
+  outputs = layer_outputs;
+  stride = layer_padded(layer_inputs);
+  _weights = weights;
+  _biases = biases;
 }
 
 void Layer::setBiases(float * biases)
@@ -88,7 +134,7 @@ void Layer::weightsFromRotated(float * rotWeights)
   {
     for (int j = 0; j < inputs; j++)
     {
-      _weights[inputs*i + j] = rotWeights[outputs*j + i];
+      _weights[stride*i + j] = rotWeights[outputs*j + i];
     }
   }
 }
@@ -98,6 +144,6 @@ void Layer::setParams(float ** weights, float * biases)
   setBiases(biases);
   for (int i = 0; i < outputs; i++)
   {
-    memcpy(_weights+i*inputs, weights[i], inputs*sizeof(float));
+    memcpy(_weights+i*stride, weights[i], inputs*sizeof(float));
   }
 }
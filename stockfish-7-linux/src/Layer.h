@@ -3,32 +3,54 @@
 #include "string.h"
 #include "stdlib.h"
 
+//weight rows are padded to a multiple of this many floats and aligned to LAYER_ALIGN*sizeof(float) bytes,
+//so one row is a whole number of AVX2 registers
+#define LAYER_ALIGN 8
+
+//n rounded up to a whole number of LAYER_ALIGN blocks
+inline int layer_padded(int n) { return (n + LAYER_ALIGN - 1) / LAYER_ALIGN * LAYER_ALIGN; }
+
+//the nonlinearity applied in the epilogue of activate()
+enum Activation { ACT_LINEAR, ACT_RELU, ACT_TANH };
+
 class Layer
 {
 public:
   int inputs;
   int outputs;
+  //length of one row of _weights, inputs rounded up to a multiple of LAYER_ALIGN
+  int stride;
   float * _biases;
+  //outputs rows of stride floats, the padding at the end of each row is zero
   float * _weights;
-  ~Layer();
+  virtual ~Layer();
 
   Layer()
   {
-    output_arr = 0;
     _biases = 0;
     _weights  = 0;
+    mem = 0;
+    inputs = outputs = stride = 0;
+    activation = ACT_LINEAR;
   }
 
-  //return a pointer to the array of activations
-  //this pointer is only good until the next time someone tries to activate the network
-  //so copy the data if needed elsewhere
-  float * activate(float * input_arr);
+  //write the outputs activations for input_arr to output_arr
+  //the layer itself is not modified, so several threads can activate it at once with their own output arrays
+  void activate(const float * input_arr, float * output_arr) const;
+  //activate for n inputs at once, input p at input_arr + p*in_stride and its outputs at output_arr + p*out_stride
+  void activate_batch(const float * input_arr, int in_stride, float * output_arr, int out_stride, int n) const;
   //weights should be inputs cols, outputs rows
   Layer(int layer_inputs, int layer_outputs, float ** weights, float * biases);
   //This contructor assumes weights is stored contingously in row-major order
   Layer(int layer_inputs, int layer_outputs, float * weights, float * biases);
   void init_unitialized(int layer_inputs, int layer_outputs);
 
+  //the shape, weights and biases of l, the activation stays this layer's
+  void copyParams(const Layer& l);
+  //use weights and biases in the layout of the allocated ones that live elsewhere, in a mapped weight file.
+  //They are not freed by the layer and must outlive its use of them.
+  void useParams(int layer_inputs, int layer_outputs, float * weights, float * biases);
+  Activation activation_type() const { return activation; }
   void setBiases(float * biases);
   void setParams(float ** weights, float * biases);
   void weightsFromRotated(float * rotWeights);
@@ -36,9 +58,13 @@ public:
 
   virtual float activation_func(float out);
 
+protected:
+  Activation activation;
+
 private:
-  // this is so that we don't have to malloc space to store the output array each time
-  float * output_arr;
+  void release();
+  //one aligned block holding the weights and biases
+  void * mem;
 };
 
 #endif
@@ -0,0 +1,242 @@
+#ifndef LayerKernels_h
+#define LayerKernels_h
+#include <cmath>
+#include <cstdint>
+#include "Layer.h"
+#if defined(USE_AVX2)
+#include <immintrin.h>
+#elif defined(USE_SSE)
+#include <xmmintrin.h>
+#endif
+
+//the dense layer kernels shared by the runtime Layer and the compile time FixedNet
+namespace LayerKernels {
+
+//sum plus the dot product of the first n entries of a weight row with an input vector
+inline float dot(const float * w, const float * x, int n, float sum = 0)
+{
+  for (int j = 0; j < n; j++) sum += w[j]*x[j];
+  return sum;
+}
+
+inline float epilogue(float out, Activation act)
+{
+  return act == ACT_RELU ? (out > 0 ? out : 0) : act == ACT_TANH ? std::tanh(out) : out;
+}
+
+#if defined(USE_AVX2)
+
+//sum each of the four accumulators horizontally, lane i of the result is the sum of ai
+inline __m128 hsum4(__m256 a0, __m256 a1, __m256 a2, __m256 a3)
+{
+  __m256 s = _mm256_hadd_ps(_mm256_hadd_ps(a0, a1), _mm256_hadd_ps(a2, a3));
+  return _mm_add_ps(_mm256_castps256_ps128(s), _mm256_extractf128_ps(s, 1));
+}
+
+inline float hsum(__m256 a)
+{
+  __m128 s = _mm_add_ps(_mm256_castps256_ps128(a), _mm256_extractf128_ps(a, 1));
+  s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+  s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+  return _mm_cvtss_f32(s);
+}
+
+const int Width = 8;
+typedef __m256 vec;
+inline vec vzero() { return _mm256_setzero_ps(); }
+inline vec vload(const float * p) { return _mm256_load_ps(p); }
+inline vec vloadu(const float * p) { return _mm256_loadu_ps(p); }
+inline vec vmadd(vec a, vec b, vec c) { return _mm256_fmadd_ps(a, b, c); }
+inline vec vset1(float x) { return _mm256_set1_ps(x); }
+inline vec vrelu(vec a) { return _mm256_max_ps(a, _mm256_setzero_ps()); }
+inline void vstoreu(float * p, vec a) { _mm256_storeu_ps(p, a); }
+
+#elif defined(USE_SSE)
+
+inline __m128 hsum4(__m128 a0, __m128 a1, __m128 a2, __m128 a3)
+{
+  _MM_TRANSPOSE4_PS(a0, a1, a2, a3);
+  return _mm_add_ps(_mm_add_ps(a0, a1), _mm_add_ps(a2, a3));
+}
+
+inline float hsum(__m128 s)
+{
+  s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+  s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+  return _mm_cvtss_f32(s);
+}
+
+const int Width = 4;
+typedef __m128 vec;
+inline vec vzero() { return _mm_setzero_ps(); }
+inline vec vload(const float * p) { return _mm_load_ps(p); }
+inline vec vloadu(const float * p) { return _mm_loadu_ps(p); }
+inline vec vmadd(vec a, vec b, vec c) { return _mm_add_ps(_mm_mul_ps(a, b), c); }
+inline vec vset1(float x) { return _mm_set1_ps(x); }
+inline vec vrelu(vec a) { return _mm_max_ps(a, _mm_setzero_ps()); }
+inline void vstoreu(float * p, vec a) { _mm_storeu_ps(p, a); }
+
+#endif
+
+//out = act(W*in + b), four rows at a time so that every input load is shared by four rows
+//with constant sizes and activation, as in FixedNet, the compiler specializes the whole kernel
+template<Activation act>
+inline void gemv(const float * W, const float * b, int rows, int cols, int stride,
+                 const float * in, float * out)
+{
+  int i = 0;
+#if defined(USE_AVX2) || defined(USE_SSE)
+  const int body = cols / Width * Width;
+
+  for (; i + 4 <= rows; i += 4)
+  {
+    const float * w0 = W + size_t(i)*stride;
+    const float * w1 = w0 + stride;
+    const float * w2 = w1 + stride;
+    const float * w3 = w2 + stride;
+    vec a0 = vzero(), a1 = vzero(), a2 = vzero(), a3 = vzero();
+    for (int j = 0; j < body; j += Width)
+    {
+      vec x = vloadu(in + j);
+      a0 = vmadd(vload(w0 + j), x, a0);
+      a1 = vmadd(vload(w1 + j), x, a1);
+      a2 = vmadd(vload(w2 + j), x, a2);
+      a3 = vmadd(vload(w3 + j), x, a3);
+    }
+    __m128 r = _mm_add_ps(hsum4(a0, a1, a2, a3), _mm_loadu_ps(b + i));
+    if (body < cols)
+      r = _mm_add_ps(r, _mm_setr_ps(dot(w0 + body, in + body, cols - body),
+                                    dot(w1 + body, in + body, cols - body),
+                                    dot(w2 + body, in + body, cols - body),
+                                    dot(w3 + body, in + body, cols - body)));
+    if (act == ACT_RELU) r = _mm_max_ps(r, _mm_setzero_ps());
+    _mm_storeu_ps(out + i, r);
+  }
+
+  for (; i < rows; i++)
+  {
+    const float * w = W + size_t(i)*stride;
+    vec a = vzero();
+    for (int j = 0; j < body; j += Width)
+      a = vmadd(vload(w + j), vloadu(in + j), a);
+    float r = b[i] + hsum(a) + dot(w + body, in + body, cols - body);
+    out[i] = act == ACT_RELU ? (r > 0 ? r : 0) : r;
+  }
+
+  if (act == ACT_TANH)
+    for (int k = 0; k < rows; k++) out[k] = std::tanh(out[k]);
+#else
+  for (; i < rows; i++)
+    out[i] = epilogue(dot(W + size_t(i)*stride, in, cols, b[i]), act);
+#endif
+}
+
+//y += a*x over the first n entries, the update of the training gradients
+inline void axpy(float a, const float * x, float * y, int n)
+{
+  int j = 0;
+#if defined(USE_AVX2) || defined(USE_SSE)
+  const vec av = vset1(a);
+  for (; j + Width <= n; j += Width)
+    vstoreu(y + j, vmadd(av, vloadu(x + j), vloadu(y + j)));
+#endif
+  for (; j < n; j++)
+    y[j] += a * x[j];
+}
+
+//out = relu(b + sum of val[i] times column idx[i] of C) for a sparse input of n entries, column f at
+//C + f*stride. Four vectors of outputs are summed in registers over all the entries before they are stored.
+inline void sparse_gemv_relu(const float * C, int stride, const float * b, const uint16_t * idx, const int16_t * val,
+                             int n, int rows, float * out)
+{
+  int k = 0;
+#if defined(USE_AVX2) || defined(USE_SSE)
+  for (; k + 4*Width <= rows; k += 4*Width)
+  {
+    vec a0 = vloadu(b + k), a1 = vloadu(b + k + Width), a2 = vloadu(b + k + 2*Width), a3 = vloadu(b + k + 3*Width);
+    for (int i = 0; i < n; i++)
+    {
+      const float * c = C + size_t(idx[i])*stride + k;
+      const vec v = vset1((float)val[i]);
+      a0 = vmadd(v, vloadu(c), a0);
+      a1 = vmadd(v, vloadu(c + Width), a1);
+      a2 = vmadd(v, vloadu(c + 2*Width), a2);
+      a3 = vmadd(v, vloadu(c + 3*Width), a3);
+    }
+    vstoreu(out + k, vrelu(a0));
+    vstoreu(out + k + Width, vrelu(a1));
+    vstoreu(out + k + 2*Width, vrelu(a2));
+    vstoreu(out + k + 3*Width, vrelu(a3));
+  }
+
+  for (; k + Width <= rows; k += Width)
+  {
+    vec a = vloadu(b + k);
+    for (int i = 0; i < n; i++)
+      a = vmadd(vset1((float)val[i]), vloadu(C + size_t(idx[i])*stride + k), a);
+    vstoreu(out + k, vrelu(a));
+  }
+#endif
+  for (; k < rows; k++)
+  {
+    float r = b[k];
+    for (int i = 0; i < n; i++)
+      r += val[i] * C[size_t(idx[i])*stride + k];
+    out[k] = r > 0 ? r : 0;
+  }
+}
+
+//out = act(W*in + b) for n inputs, input p at in + p*in_stride and its output at out + p*out_stride.
+//Each weight row is loaded once for four inputs, and stays in L1 while it goes through all n.
+template<Activation act>
+inline void gemm(const float * W, const float * b, int rows, int cols, int stride,
+                 const float * in, int in_stride, float * out, int out_stride, int n)
+{
+#if defined(USE_AVX2) || defined(USE_SSE)
+  const int body = cols / Width * Width;
+
+  for (int i = 0; i < rows; i++)
+  {
+    const float * w = W + size_t(i)*stride;
+    int p = 0;
+    for (; p + 4 <= n; p += 4)
+    {
+      const float * x0 = in + size_t(p)*in_stride;
+      const float * x1 = x0 + in_stride;
+      const float * x2 = x1 + in_stride;
+      const float * x3 = x2 + in_stride;
+      vec a0 = vzero(), a1 = vzero(), a2 = vzero(), a3 = vzero();
+      for (int j = 0; j < body; j += Width)
+      {
+        vec wv = vload(w + j);
+        a0 = vmadd(wv, vloadu(x0 + j), a0);
+        a1 = vmadd(wv, vloadu(x1 + j), a1);
+        a2 = vmadd(wv, vloadu(x2 + j), a2);
+        a3 = vmadd(wv, vloadu(x3 + j), a3);
+      }
+      float r[4];
+      _mm_storeu_ps(r, _mm_add_ps(hsum4(a0, a1, a2, a3), _mm_set1_ps(b[i])));
+      const float * x[4] = { x0, x1, x2, x3 };
+      for (int k = 0; k < 4; k++)
+        out[size_t(p+k)*out_stride + i] = epilogue(r[k] + dot(w + body, x[k] + body, cols - body), act);
+    }
+
+    for (; p < n; p++)
+    {
+      const float * x = in + size_t(p)*in_stride;
+      vec a = vzero();
+      for (int j = 0; j < body; j += Width)
+        a = vmadd(vload(w + j), vloadu(x + j), a);
+      out[size_t(p)*out_stride + i] = epilogue(b[i] + hsum(a) + dot(w + body, x + body, cols - body), act);
+    }
+  }
+#else
+  for (int i = 0; i < rows; i++)
+    for (int p = 0; p < n; p++)
+      out[size_t(p)*out_stride + i] = epilogue(dot(W + size_t(i)*stride, in + size_t(p)*in_stride, cols, b[i]), act);
+#endif
+}
+
+}
+
+#endif
@@ -0,0 +1,200 @@
+/*
+  Stockfish, a UCI chess playing engine derived from Glaurung 2.1
+  Copyright (C) 2004-2008 Tord Romstad (Glaurung author)
+  Copyright (C) 2008-2015 Marco Costalba, Joona Kiiski, Tord Romstad
+  Copyright (C) 2015-2016 Marco Costalba, Joona Kiiski, Gary Linscott, Tord Romstad
+
+  Stockfish is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Stockfish is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>     // For open
+#include <sys/mman.h>  // For mmap, munmap
+#include <sys/stat.h>
+#include <unistd.h>    // For fsync, ftruncate
+
+#include "NpyWriter.h"
+
+
+/// NpyWriter::open() creates the file at path for rows of columns items of the
+/// given dtype and size, or a vector of items if columns is 0. The dtype is a
+/// Python literal like "'<f4'". With resumeRows the file is an earlier output
+/// instead: it is cut back to its first resumeRows rows, which must have been
+/// checkpointed, and the new rows are appended after them.
+
+bool NpyWriter::open(const std::string& path, const char* dtype, size_t size, size_t columns, size_t resumeRows) {
+
+  close();
+  descr = dtype;
+  itemSize = size;
+  cols = columns;
+  count = 0;
+  file = fopen(path.c_str(), resumeRows ? "r+b" : "w+b");
+
+  if (!file)
+      return false;
+
+  if (resumeRows)
+  {
+      long end = HeaderSize + long(resumeRows * row_bytes());
+
+      if (   fseek(file, 0, SEEK_END)
+          || ftell(file) < end
+          || fflush(file)
+          || ftruncate(fileno(file), end)
+          || fseek(file, end, SEEK_SET))
+      {
+          fclose(file);
+          file = nullptr;
+          return false;
+      }
+      count = resumeRows;
+  }
+
+  return write_header() && !fseek(file, 0, SEEK_END);
+}
+
+
+/// NpyWriter::append() writes rows rows of the row size given to open()
+
+bool NpyWriter::append(const void* data, size_t rows) {
+
+  if (!file || fwrite(data, row_bytes(), rows, file) != rows)
+      return false;
+
+  count += rows;
+  return true;
+}
+
+
+/// NpyWriter::checkpoint() records the rows appended so far in the header and
+/// waits until they are on disk.
+
+bool NpyWriter::checkpoint() {
+
+  return    file
+         && write_header()
+         && !fseek(file, 0, SEEK_END)
+         && !fflush(file)
+         && !fsync(fileno(file));
+}
+
+
+/// NpyWriter::close() checkpoints the file and closes it
+
+bool NpyWriter::close() {
+
+  if (!file)
+      return true;
+
+  bool ok = checkpoint();
+  ok = !fclose(file) && ok;
+  file = nullptr;
+  return ok;
+}
+
+
+/// NpyWriter::write_header() writes a version 1.0 .npy header for the current
+/// number of rows, padded with spaces to HeaderSize bytes.
+
+bool NpyWriter::write_header() {
+
+  char header[HeaderSize];
+  char dict[HeaderSize];
+  int len = cols ? snprintf(dict, sizeof(dict), "{'descr': %s, 'fortran_order': False, 'shape': (%zu, %zu), }", descr, count, cols)
+                 : snprintf(dict, sizeof(dict), "{'descr': %s, 'fortran_order': False, 'shape': (%zu,), }", descr, count);
+
+  const int DictSize = HeaderSize - 10;
+
+  if (len < 0 || len >= DictSize)
+      return false;
+
+  std::memcpy(header, "\x93NUMPY\x01\x00", 8);
+  header[8] = char(DictSize & 0xFF);
+  header[9] = char(DictSize >> 8);
+  std::memset(header + 10, ' ', DictSize);
+  std::memcpy(header + 10, dict, len);
+  header[HeaderSize - 1] = '\n';
+
+  return !fseek(file, 0, SEEK_SET) && fwrite(header, 1, HeaderSize, file) == HeaderSize;
+}
+
+
+/// NpyReader::open() maps the array at path, with the dtype and size of
+/// NpyWriter::open(). Returns false if it is not a version 1.0 .npy file of
+/// rows of columns items of that dtype, or a vector of them if columns is 0.
+
+bool NpyReader::open(const std::string& path, const char* dtype, size_t size, size_t columns) {
+
+  close();
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+      return false;
+
+  struct stat st;
+  if (fstat(fd, &st) || st.st_size < 10)
+  {
+      ::close(fd);
+      return false;
+  }
+
+  bytes = size_t(st.st_size);
+  mem = mmap(nullptr, bytes, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (mem == MAP_FAILED)
+  {
+      mem = nullptr;
+      return false;
+  }
+
+  const char* p = (const char*)mem;
+  size_t headerSize = 10 + size_t((unsigned char)p[8] | ((unsigned char)p[9] << 8));
+  std::string dict(p + 10, std::min(headerSize, bytes) - 10);
+  std::string shape = columns ? ", " + std::to_string(columns) + ")" : ",)";
+  size_t s = dict.find("'shape': (");
+
+  if (   std::memcmp(p, "\x93NUMPY\x01", 7)
+      || headerSize > bytes
+      || dict.find(std::string("'descr': ") + dtype) == std::string::npos
+      || dict.find("'fortran_order': False") == std::string::npos
+      || s == std::string::npos
+      || dict.find(shape, s) != dict.find(')', s) + 1 - shape.size())
+  {
+      close();
+      return false;
+  }
+
+  data = p + headerSize;
+  itemSize = size;
+  cols = columns;
+  count = std::min(size_t(strtoull(dict.c_str() + s + 10, nullptr, 10)),
+                   (bytes - headerSize) / (itemSize * (cols ? cols : 1)));
+  return true;
+}
+
+
+/// NpyReader::close() unmaps the array
+
+void NpyReader::close() {
+
+  if (mem)
+      munmap(mem, bytes);
+
+  mem = nullptr;
+  data = nullptr;
+  count = 0;
+}
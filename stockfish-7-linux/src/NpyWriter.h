@@ -0,0 +1,91 @@
+/*
+  Stockfish, a UCI chess playing engine derived from Glaurung 2.1
+  Copyright (C) 2004-2008 Tord Romstad (Glaurung author)
+  Copyright (C) 2008-2015 Marco Costalba, Joona Kiiski, Tord Romstad
+  Copyright (C) 2015-2016 Marco Costalba, Joona Kiiski, Gary Linscott, Tord Romstad
+
+  Stockfish is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Stockfish is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef NPYWRITER_H_INCLUDED
+#define NPYWRITER_H_INCLUDED
+
+#include <cstdio>
+#include <string>
+
+/// NpyWriter appends rows to a .npy file, for arrays too large to be kept in
+/// memory until they are complete. The header has a fixed size and is
+/// rewritten with the number of rows at every checkpoint, so after a crash the
+/// file is a valid array of the rows written up to the last checkpoint, and
+/// open() can resume appending from there.
+
+class NpyWriter {
+
+  static const int HeaderSize = 256;
+
+public:
+  NpyWriter() : file(nullptr), descr(nullptr), itemSize(0), cols(0), count(0) {}
+  ~NpyWriter() { close(); }
+  NpyWriter(const NpyWriter&) = delete;
+  NpyWriter& operator=(const NpyWriter&) = delete;
+
+  bool open(const std::string& path, const char* dtype, size_t size, size_t columns, size_t resumeRows = 0);
+  bool append(const void* data, size_t rows);
+  bool checkpoint();
+  bool close();
+
+  size_t rows() const { return count; }
+
+private:
+  bool write_header();
+
+  size_t row_bytes() const { return itemSize * (cols ? cols : 1); }
+
+  FILE* file;
+  const char* descr;  // The numpy dtype of the items, as a Python literal
+  size_t itemSize;
+  size_t cols;        // Items per row, 0 for a vector of items
+  size_t count;
+};
+
+
+/// NpyReader maps a .npy file into memory, so arrays larger than memory are
+/// read from the page cache as they are used. Only C ordered arrays of one
+/// dtype with the given number of columns are accepted.
+
+class NpyReader {
+
+public:
+  NpyReader() : mem(nullptr), bytes(0), data(nullptr), itemSize(0), cols(0), count(0) {}
+  ~NpyReader() { close(); }
+  NpyReader(const NpyReader&) = delete;
+  NpyReader& operator=(const NpyReader&) = delete;
+
+  bool open(const std::string& path, const char* dtype, size_t size, size_t columns);
+  void close();
+
+  size_t rows() const { return count; }
+  const void* row(size_t i) const { return data + i * itemSize * (cols ? cols : 1); }
+
+private:
+  void* mem;
+  size_t bytes;
+  const char* data;
+  size_t itemSize;
+  size_t cols;        // Items per row, 0 for a vector of items
+  size_t count;
+};
+
+#endif // #ifndef NPYWRITER_H_INCLUDED
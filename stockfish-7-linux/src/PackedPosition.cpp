@@ -0,0 +1,176 @@
+/*
+  Stockfish, a UCI chess playing engine derived from Glaurung 2.1
+  Copyright (C) 2004-2008 Tord Romstad (Glaurung author)
+  Copyright (C) 2008-2015 Marco Costalba, Joona Kiiski, Tord Romstad
+  Copyright (C) 2015-2016 Marco Costalba, Joona Kiiski, Gary Linscott, Tord Romstad
+
+  Stockfish is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Stockfish is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <fcntl.h>     // For open
+#include <sys/mman.h>  // For mmap, munmap
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bitboard.h"
+#include "bitcount.h"
+#include "PackedPosition.h"
+#include "uci.h"
+
+namespace {
+
+  const std::string PieceToChar(" PNBRQK  pnbrqk");
+
+}
+
+const char* const PackedPosition::Descr =
+  "[('occupied', '<u8'), ('pieces', 'u1', (16,)), ('flags', 'u1'), ('ep_square', 'u1'), "
+  "('eval', '<i2'), ('ply', '<u2'), ('result', 'i1'), ('rule50', 'u1')]";
+
+
+/// PackedPosition::pack() stores pos, with its evaluation v and the result r
+/// of its game. Castling rights are stored for standard chess only.
+
+void PackedPosition::pack(const Position& pos, Value v, int r) {
+
+  assert(popcount<Full>(pos.pieces()) <= 32);
+
+  std::memset(this, 0, sizeof(PackedPosition));
+  occupied = pos.pieces();
+
+  int n = 0;
+  for (Bitboard b = occupied; b; ++n)
+  {
+      Square s = pop_lsb(&b);
+      pieces[n / 2] |= uint8_t(pos.piece_on(s) << (4 * (n & 1)));
+  }
+
+  flags = uint8_t(pos.side_to_move() | (pos.can_castle(ANY_CASTLING) << 1));
+  epSquare = uint8_t(pos.ep_square());
+  eval = int16_t(v);
+  ply = uint16_t(pos.game_ply());
+  result = int8_t(r);
+  rule50 = uint8_t(pos.rule50_count());
+}
+
+
+/// PackedPosition::fen() returns the FEN of the packed position, so it can be
+/// set up with Position::set().
+
+std::string PackedPosition::fen() const {
+
+  Piece board[SQUARE_NB] = {};
+  int n = 0;
+  for (Bitboard b = occupied; b; ++n)
+      board[pop_lsb(&b)] = Piece((pieces[n / 2] >> (4 * (n & 1))) & 0xF);
+
+  std::string fen;
+  for (Rank r = RANK_8; r >= RANK_1; --r)
+  {
+      for (File f = FILE_A; f <= FILE_H; ++f)
+      {
+          int empty = 0;
+          for ( ; f <= FILE_H && !board[make_square(f, r)]; ++f)
+              ++empty;
+
+          if (empty)
+              fen += char('0' + empty);
+
+          if (f <= FILE_H)
+              fen += PieceToChar[board[make_square(f, r)]];
+      }
+
+      if (r > RANK_1)
+          fen += '/';
+  }
+
+  fen += (flags & 1) ? " b " : " w ";
+
+  if (!(flags >> 1))
+      fen += '-';
+  else
+  {
+      if (flags & (WHITE_OO  << 1)) fen += 'K';
+      if (flags & (WHITE_OOO << 1)) fen += 'Q';
+      if (flags & (BLACK_OO  << 1)) fen += 'k';
+      if (flags & (BLACK_OOO << 1)) fen += 'q';
+  }
+
+  fen += epSquare == SQ_NONE ? std::string(" -") : " " + UCI::square(Square(epSquare));
+  fen += " " + std::to_string(rule50) + " " + std::to_string(1 + ply / 2);
+  return fen;
+}
+
+
+/// PackedPositionFile::open() maps the training set at path, a .npy file of
+/// PackedPosition records. Returns false if it is not one.
+
+bool PackedPositionFile::open(const std::string& path) {
+
+  close();
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+      return false;
+
+  struct stat st;
+  if (fstat(fd, &st) || st.st_size < 10)
+  {
+      ::close(fd);
+      return false;
+  }
+
+  bytes = size_t(st.st_size);
+  mem = mmap(nullptr, bytes, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (mem == MAP_FAILED)
+  {
+      mem = nullptr;
+      return false;
+  }
+
+  // A version 1.0 header whose dtype is PackedPosition::Descr
+  const char* p = (const char*)mem;
+  size_t headerSize = 10 + size_t((unsigned char)p[8] | ((unsigned char)p[9] << 8));
+  std::string dict(p + 10, std::min(headerSize, bytes) - 10);
+
+  if (   std::memcmp(p, "\x93NUMPY\x01", 7)
+      || headerSize > bytes
+      || dict.find(std::string("'descr': ") + PackedPosition::Descr) == std::string::npos)
+  {
+      close();
+      return false;
+  }
+
+  records = (const PackedPosition*)(p + headerSize);
+  count = (bytes - headerSize) / sizeof(PackedPosition);
+  madvise(mem, bytes, MADV_SEQUENTIAL);
+  return true;
+}
+
+
+/// PackedPositionFile::close() unmaps the training set
+
+void PackedPositionFile::close() {
+
+  if (mem)
+      munmap(mem, bytes);
+
+  mem = nullptr;
+  records = nullptr;
+  bytes = count = 0;
+}
@@ -0,0 +1,80 @@
+/*
+  Stockfish, a UCI chess playing engine derived from Glaurung 2.1
+  Copyright (C) 2004-2008 Tord Romstad (Glaurung author)
+  Copyright (C) 2008-2015 Marco Costalba, Joona Kiiski, Tord Romstad
+  Copyright (C) 2015-2016 Marco Costalba, Joona Kiiski, Gary Linscott, Tord Romstad
+
+  Stockfish is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Stockfish is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef PACKEDPOSITION_H_INCLUDED
+#define PACKEDPOSITION_H_INCLUDED
+
+#include <cstdint>
+#include <string>
+
+#include "position.h"
+
+/// PackedPosition is a training position in 32 bytes: the occupied squares, the
+/// pieces on them in square order at four bits each, the rest of the FEN, and
+/// the evaluation, game result and ply of the sample. A training set of them is
+/// a .npy file of the structured dtype Descr, so numpy can map it as well.
+
+struct PackedPosition {
+
+  static const int8_t ResultUnknown = 2;
+  static const char* const Descr;
+
+  void pack(const Position& pos, Value v, int r);
+  std::string fen() const;
+
+  uint64_t occupied;
+  uint8_t pieces[16];  // Two per byte, the first one in the low bits
+  uint8_t flags;       // Side to move in bit 0, castling rights in bits 1-4
+  uint8_t epSquare;    // SQ_NONE if there is none
+  int16_t eval;        // White's point of view, VALUE_NONE if not evaluated
+  uint16_t ply;
+  int8_t result;       // For White: 1 win, 0 draw, -1 loss, or ResultUnknown
+  uint8_t rule50;
+};
+
+static_assert(sizeof(PackedPosition) == 32, "PackedPosition size incorrect");
+
+
+/// PackedPositionFile maps a training set of packed positions into memory, so
+/// the records are read from the page cache as they are used.
+
+class PackedPositionFile {
+
+public:
+  PackedPositionFile() : mem(nullptr), bytes(0), records(nullptr), count(0) {}
+  ~PackedPositionFile() { close(); }
+  PackedPositionFile(const PackedPositionFile&) = delete;
+  PackedPositionFile& operator=(const PackedPositionFile&) = delete;
+
+  bool open(const std::string& path);
+  void close();
+
+  size_t size() const { return count; }
+  const PackedPosition& operator[](size_t i) const { return records[i]; }
+
+private:
+  void* mem;
+  size_t bytes;
+  const PackedPosition* records;
+  size_t count;
+};
+
+#endif // #ifndef PACKEDPOSITION_H_INCLUDED
@@ -0,0 +1,160 @@
+#include "QuantizedLayer.h"
+#include <cmath>
+#include <iostream>
+#include <limits>
+#if defined(USE_AVX2)
+#include <immintrin.h>
+#elif defined(USE_SSE) && defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+using namespace std;
+
+namespace {
+
+const size_t AlignBytes = QUANT_ALIGN;
+
+//the largest weight magnitude of each type. int8 stays at 127 so that two u8 x s8 products
+//of maddubs (at most 2*127*127) never saturate its int16 sums
+template<typename T> int max_weight();
+template<> int max_weight<int16_t>() { return 32767; }
+template<> int max_weight<int8_t>() { return 127; }
+
+#if defined(USE_AVX2)
+
+inline int32_t hsum(__m256i a)
+{
+  __m128i s = _mm_add_epi32(_mm256_castsi256_si128(a), _mm256_extracti128_si256(a, 1));
+  s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0x4E));
+  s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0xB1));
+  return _mm_cvtsi128_si32(s);
+}
+
+//int32 sums of pairs of products, 8 lanes
+inline __m256i madd(const int16_t * w, const int16_t * x)
+{
+  return _mm256_madd_epi16(_mm256_load_si256((const __m256i*)w), _mm256_load_si256((const __m256i*)x));
+}
+
+//u8 x s8 products summed in pairs to int16 by maddubs, then in pairs again to int32
+inline __m256i madd(const int8_t * w, const uint8_t * x)
+{
+  __m256i p = _mm256_maddubs_epi16(_mm256_load_si256((const __m256i*)x), _mm256_load_si256((const __m256i*)w));
+  return _mm256_madd_epi16(p, _mm256_set1_epi16(1));
+}
+
+template<typename T, typename In>
+inline int32_t dot(const T * w, const In * x, int n)
+{
+  const int Width = 32 / sizeof(T);
+  __m256i a = _mm256_setzero_si256();
+  for (int j = 0; j < n; j += Width)
+    a = _mm256_add_epi32(a, madd(w + j, x + j));
+  return hsum(a);
+}
+
+#elif defined(USE_SSE) && defined(__SSE2__)
+
+inline int32_t hsum(__m128i s)
+{
+  s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0x4E));
+  s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0xB1));
+  return _mm_cvtsi128_si32(s);
+}
+
+inline __m128i madd(const int16_t * w, const int16_t * x)
+{
+  return _mm_madd_epi16(_mm_load_si128((const __m128i*)w), _mm_load_si128((const __m128i*)x));
+}
+
+//SSE2 has no maddubs, widen both to int16 and use madd. The weights are sign extended by
+//duplicating each byte and shifting arithmetically.
+inline __m128i madd(const int8_t * w, const uint8_t * x)
+{
+  const __m128i zero = _mm_setzero_si128();
+  __m128i xv = _mm_load_si128((const __m128i*)x);
+  __m128i wv = _mm_load_si128((const __m128i*)w);
+  __m128i lo = _mm_madd_epi16(_mm_srai_epi16(_mm_unpacklo_epi8(wv, wv), 8), _mm_unpacklo_epi8(xv, zero));
+  __m128i hi = _mm_madd_epi16(_mm_srai_epi16(_mm_unpackhi_epi8(wv, wv), 8), _mm_unpackhi_epi8(xv, zero));
+  return _mm_add_epi32(lo, hi);
+}
+
+template<typename T, typename In>
+inline int32_t dot(const T * w, const In * x, int n)
+{
+  const int Width = 16 / sizeof(T);
+  __m128i a = _mm_setzero_si128();
+  for (int j = 0; j < n; j += Width)
+    a = _mm_add_epi32(a, madd(w + j, x + j));
+  return hsum(a);
+}
+
+#else
+
+template<typename T, typename In>
+inline int32_t dot(const T * w, const In * x, int n)
+{
+  int32_t sum = 0;
+  for (int j = 0; j < n; j++) sum += int32_t(w[j]) * int32_t(x[j]);
+  return sum;
+}
+
+#endif
+
+}
+
+template<typename T>
+void QuantizedLayer<T>::quantize(const Layer& layer, const float * input_scale, int max_input)
+{
+  free(mem);
+  inputs = layer.inputs;
+  outputs = layer.outputs;
+  stride = (inputs + QUANT_ALIGN - 1) / QUANT_ALIGN * QUANT_ALIGN;
+
+  //weights, then biases and row scales, each on an AlignBytes boundary
+  size_t wbytes = (size_t(stride) * outputs * sizeof(T) + AlignBytes - 1) / AlignBytes * AlignBytes;
+  mem = calloc(wbytes + outputs * (sizeof(int32_t) + sizeof(float)) + AlignBytes - 1, 1);
+  if (!mem)
+  {
+    cerr << "Failed to allocate a quantized " << inputs << "x" << outputs << " layer." << endl;
+    exit(EXIT_FAILURE);
+  }
+  _weights = (T*)((uintptr_t(mem) + AlignBytes - 1) & ~(AlignBytes - 1));
+  _biases = (int32_t*)((char*)_weights + wbytes);
+  row_scale = (float*)(_biases + outputs);
+
+  const int Max = max_weight<T>();
+  for (int i = 0; i < outputs; i++)
+  {
+    const float * w = layer._weights + size_t(i) * layer.stride;
+    float largest = 0, total = 0;
+    for (int j = 0; j < inputs; j++)
+    {
+      largest = max(largest, fabs(w[j] * (input_scale ? 1 / input_scale[j] : 1)));
+      total += fabs(w[j] * (input_scale ? 1 / input_scale[j] : 1));
+    }
+
+    //a row of zeros keeps scale 1, the bias is then rounded to an integer
+    float scale = largest > 0 ? Max / largest : 1;
+    //the largest sum of the row over inputs of up to max_input, leaving the other half of int32 to the bias
+    if (max_input && total * max_input * scale > float(1 << 30))
+      scale = float(1 << 30) / (total * max_input);
+    //the bias is an int32, keep it in range
+    if (fabs(layer._biases[i]) * scale > float(numeric_limits<int32_t>::max() / 2))
+      scale = float(numeric_limits<int32_t>::max() / 2) / fabs(layer._biases[i]);
+
+    row_scale[i] = scale;
+    _biases[i] = int32_t(lround(layer._biases[i] * scale));
+    for (int j = 0; j < inputs; j++)
+      _weights[size_t(i) * stride + j] = T(lround(w[j] * (input_scale ? 1 / input_scale[j] : 1) * scale));
+  }
+}
+
+template<typename T>
+void QuantizedLayer<T>::activate(const input_t * input_arr, int32_t * output_arr) const
+{
+  for (int i = 0; i < outputs; i++)
+    output_arr[i] = _biases[i] + dot(_weights + size_t(i) * stride, input_arr, stride);
+}
+
+template class QuantizedLayer<int16_t>;
+template class QuantizedLayer<int8_t>;
@@ -0,0 +1,54 @@
+#ifndef QuantizedLayer_h
+#define QuantizedLayer_h
+#include <cstdint>
+#include "Layer.h"
+
+//rows of quantized weights are padded to a multiple of this many entries, one AVX2 register of int8
+#define QUANT_ALIGN 32
+//the largest quantized activation a hidden layer takes as int16 input, 12 bits
+#define QUANT_ACT_MAX 4095
+
+//the inputs a layer of T weights multiplies: int16 features for int16 weights,
+//uint8 activations for int8 weights (the unsigned x signed byte products of maddubs)
+template<typename T> struct QuantizedInput { typedef int16_t type; };
+template<> struct QuantizedInput<int8_t> { typedef uint8_t type; };
+
+//A Layer with integer weights and int32 sums. Each row i is scaled on its own by row_scale[i],
+//so the real pre-activation of output i is output[i] / row_scale[i].
+//No nonlinearity is applied, the caller converts the sums to whatever the next layer takes.
+template<typename T>
+class QuantizedLayer
+{
+public:
+  typedef typename QuantizedInput<T>::type input_t;
+
+  int inputs;
+  int outputs;
+  //inputs rounded up to a multiple of QUANT_ALIGN
+  int stride;
+  //outputs rows of stride weights, zero padded
+  T * _weights;
+  int32_t * _biases;
+  float * row_scale;
+
+  QuantizedLayer() : inputs(0), outputs(0), stride(0), _weights(0), _biases(0), row_scale(0), mem(0) {}
+  ~QuantizedLayer() { free(mem); }
+
+  //quantize the weights of layer for inputs that are input_scale[j] times the real ones (1 if input_scale is null)
+  //every row gets the largest scale that keeps its weights in range of T, and if max_input is given, the sum
+  //of the weights times inputs of up to max_input within 2^30
+  void quantize(const Layer& layer, const float * input_scale, int max_input = 0);
+  //output_arr[i] = row i of the weights times input_arr plus the bias, input_arr must be padded to stride with zeros
+  void activate(const input_t * input_arr, int32_t * output_arr) const;
+
+  QuantizedLayer(const QuantizedLayer&) = delete;
+  QuantizedLayer& operator=(const QuantizedLayer&) = delete;
+
+private:
+  void * mem;
+};
+
+typedef QuantizedLayer<int16_t> Int16Layer;
+typedef QuantizedLayer<int8_t> Int8Layer;
+
+#endif
@@ -18,11 +18,26 @@
   along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <cmath>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <unistd.h>  // For fsync
+
 #include "analyze.h"
 #include "movegen.h"
-#include "cnpy.h"
 #include "time.h"
 #include "KatyushaEngine.h"
+#include "KatyushaOptimizer.h"
+#include "KatyushaTrainer.h"
+#include "NpyWriter.h"
+#include "PackedPosition.h"
+#include "GameReader.h"
+#include "DedupTable.h"
+#if defined(USE_AVX2)
+#include <immintrin.h>
+#endif
 
 using namespace std;
 
@@ -30,56 +45,153 @@ namespace {
 
 const char* StartFEN = "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1";
 
-Search::StateStackPtr SetupStates;
-
 double to_cp(Value v) { return double(v) / PawnValueEg; }
 
-double centipawn_evaluate(Position& pos)
+//the untraced evaluation, tracing writes to globals and positions are evaluated on several threads
+Value white_evaluate(const Position& pos)
 {
-  Value v = Eval::evaluate<true>(pos);
-  v = pos.side_to_move() == WHITE ? v : -v; // White's point of view
-  return to_cp(v); //convert to centipawns
+  Value v = Eval::evaluate<false>(pos);
+  return pos.side_to_move() == WHITE ? v : -v; // White's point of view
 }
 
-double evaluate_fen(string fen)
+//the games to read, as set by the Katyusha_MinElo and Katyusha_Results options
+GameReader::Filter game_filter()
 {
-  Position pos(fen, false, Threads.main());
-  return centipawn_evaluate(pos);
+  GameReader::Filter f;
+  f.minElo = Options["Katyusha_MinElo"];
+  f.results = GameReader::parse_results(Options["Katyusha_Results"]);
+  return f;
 }
 
-string analyze_game(string& moves)
+//how training positions are labeled, by the Katyusha_LabelDepth and Katyusha_LabelNodes options: with a search to
+//depth plies or of nodes nodes, or if both are 0 with the static evaluation
+struct LabelLimits {
+  Depth depth;
+  int64_t nodes;
+
+  bool search() const { return depth || nodes; }
+};
+
+LabelLimits label_limits()
 {
-   SetupStates = Search::StateStackPtr(new std::stack<StateInfo>);
+  LabelLimits l;
+  l.depth = Depth(int(Options["Katyusha_LabelDepth"]) * ONE_PLY);
+  l.nodes = Options["Katyusha_LabelNodes"];
+  return l;
+}
 
-    istringstream is(moves);
+//the label of pos from White's point of view, the threads searching must be set up by Search::start_labeling()
+Value white_label(Position& pos, const LabelLimits& limits)
+{
+  if (!limits.search())
+    return white_evaluate(pos);
+  Value v = Search::label(pos, limits.depth, limits.nodes);
+  return pos.side_to_move() == WHITE ? v : -v;
+}
+
+//label the positions of fens with searches on all the search threads, set up by Search::start_labeling().
+//Worker k labels every nth position from the kth on.
+void label_fens(const vector<string>& fens, vector<double>& evals, const LabelLimits& limits)
+{
+  size_t n = Threads.size();
+  vector<std::thread> workers;
+  evals.resize(fens.size());
+  for (size_t k = 0; k < n; k++)
+    workers.emplace_back([&, k]() {
+      for (size_t i = k; i < fens.size(); i += n)
+      {
+        Position pos(fens[i], false, Threads[k]);
+        evals[i] = to_cp(white_label(pos, limits));
+      }
+    });
+  for (std::thread& w : workers)
+    w.join();
+}
 
+//print the labeling throughput
+void report_labels(int labels, TimePoint elapsed)
+{
+  cout << "Labeled " << labels << " positions in " << elapsed / 1000.0 << " s, "
+       << 1000 * labels / (elapsed + 1) << " labels/s" << endl;
+}
+
+double centipawn_evaluate(Position& pos)
+{
+  return to_cp(white_evaluate(pos)); //convert to centipawns
+}
+
+//Positions to be scored by centipawn_evaluate, in evals once run() is called. When Katyusha is active the
+//features are queued and the float network scores them all in one batch. Positions Eval::evaluate would not
+//give the float network (Katyusha inactive or quantized, or a specialized endgame evaluator it uses) are
+//evaluated through it straight away, so the scores are the engine's own.
+struct EvalBatch {
+  vector<int> features;
+  vector<Color> sides;
+  vector<size_t> slots;
+  vector<double> evals;
+
+  void add(Position& pos)
+  {
+    if (   !KatyushaEngine::engine_active() || KatyushaEngine::use_quantized()
+        || (KatyushaEngine::use_endgames() && Material::probe(pos)->specialized_eval_exists()))
+    {
+      evals.push_back(centipawn_evaluate(pos));
+      return;
+    }
+    features.resize(features.size() + Analyze::NB_FEATURES);
+    Analyze::Katyusha_pos_rep(pos, &features[features.size() - Analyze::NB_FEATURES]);
+    sides.push_back(pos.side_to_move());
+    slots.push_back(evals.size());
+    evals.push_back(0);
+  }
+
+  //score the queued positions, with the tempo bonus Eval::evaluate gives the side to move
+  void run()
+  {
+    vector<Value> v(sides.size());
+    KatyushaEngine::evaluate_batch(features.data(), sides.size(), v.data());
+    for (size_t i = 0; i < sides.size(); i++)
+      evals[slots[i]] = to_cp(v[i] + (sides[i] == WHITE ? Eval::Tempo : -Eval::Tempo));
+    features.clear();
+    sides.clear();
+    slots.clear();
+  }
+};
+
+string analyze_game(const GameReader::Game& g)
+{
+    std::stack<StateInfo> states;
     std::stringstream ss;
-    string token;
+    const char* p = g.begin;
+    MoveToken t;
     Move m;
-    Position pos(StartFEN, false, Threads.main());
-    ss << centipawn_evaluate(pos);
+    Position pos;
+    if (!GameReader::setup(g, pos, Threads.main()))
+        return "";
+    EvalBatch batch;
+    batch.add(pos);
 
     // Parse move list
-    while (is >> token && (m = UCI::to_move(pos, token)) != MOVE_NONE)
+    while (GameReader::next_move(p, g.end, t) && (m = GameReader::to_move(pos, t)) != MOVE_NONE)
     {
-        SetupStates->push(StateInfo());
-        pos.do_move(m, SetupStates->top(), pos.gives_check(m, CheckInfo(pos)));
-        ss << "," << centipawn_evaluate(pos);
+        states.push(StateInfo());
+        pos.do_move(m, states.top(), pos.gives_check(m, CheckInfo(pos)));
+        batch.add(pos);
     }
+
+    batch.run();
+    ss << batch.evals[0];
+    for (size_t i = 1; i < batch.evals.size(); i++)
+        ss << "," << batch.evals[i];
     return ss.str();
 }
 
 
-void output_game_evals(ostream& out, string& mov_str)
-{
- out << analyze_game(mov_str) << "\n";
-}
-
-void save_pos_features(Position& pos, float * dest)
+//games that do not start from a legal position are skipped
+void output_game_evals(ostream& out, const GameReader::Game& g)
 {
-  int featurevec[Analyze::NB_FEATURES];
-  Analyze::Katyusha_pos_rep(pos, featurevec);
-  for (int i = 0; i < Analyze::NB_FEATURES; i++) dest[i] = (float)featurevec[i];
+ string evals = analyze_game(g);
+ if (!evals.empty()) out << evals << "\n";
 }
 
 void output_feature_pos(ofstream& out, Position& pos, int * featurevec)
@@ -91,23 +203,21 @@ void output_feature_pos(ofstream& out, Position& pos, int * featurevec)
 }
 
 //we pass in a featurevec so that we don't have to reallocate memory over and over again
-void output_feature_game(ofstream& out, string mov_str, int * featurevec)
+void output_feature_game(ofstream& out, const GameReader::Game& g, int * featurevec)
 {
-//  cout << mov_str << endl;
-  SetupStates = Search::StateStackPtr(new std::stack<StateInfo>);
-
-   istringstream is(mov_str);
-
-   string token;
+   std::stack<StateInfo> states;
+   const char* p = g.begin;
+   MoveToken t;
    Move m;
-   Position pos(StartFEN, false, Threads.main());
+   Position pos;
+   if (!GameReader::setup(g, pos, Threads.main())) return;
    output_feature_pos(out, pos, featurevec);
 
    // Parse move list
-   while (is >> token && (m = UCI::to_move(pos, token)) != MOVE_NONE)
+   while (GameReader::next_move(p, g.end, t) && (m = GameReader::to_move(pos, t)) != MOVE_NONE)
    {
-       SetupStates->push(StateInfo());
-       pos.do_move(m, SetupStates->top(), pos.gives_check(m, CheckInfo(pos)));
+       states.push(StateInfo());
+       pos.do_move(m, states.top(), pos.gives_check(m, CheckInfo(pos)));
        output_feature_pos(out, pos, featurevec);
    }
    out << endl;
@@ -129,265 +239,867 @@ void Analyze::evaluate_game_list(istringstream& is)
 void Analyze::evaluate_game_list(string infile, string ofile)
 {
   process_game_list(infile, ofile, output_game_evals);
-  return;
-  fstream f;
-  f.open(infile);
-  string line;
+}
+
+//call game_func on each game of infile, with the output file
+void Analyze::process_game_list(string infile, string ofile, void(*game_func)(ostream&, const GameReader::Game&))
+{
+  GameFile games;
+  if (!games.open(infile))
+  {
+    cout << "Failed to open " << infile << endl;
+    return;
+  }
   ofstream out;
   out.open(ofile);
 
-  string mov_str;
-  while (getline(f, line))
+  GameReader reader(games);
+  GameReader::Game g;
+  reader.filter = game_filter();
+  while (reader.next(g))
+    game_func(out, g);
+
+  out.close();
+}
+
+
+#define MAX_RAND_MOVES 3
+#define MAX_PUNISHMENT_MOVES 3
+
+namespace {
+
+//set pos to a training position drawn from the game g: a random ply of the game, followed by
+//a random capture or by a few random moves and their punishment. Returns false for an empty game,
+//or one that does not start from a legal position.
+bool sample_game(Position& pos, const GameReader::Game& g, Thread* th, PRNG& rng, std::stack<StateInfo>& states)
+{
+  int nmoves = GameReader::count_moves(g);
+  if (!nmoves || !GameReader::setup(g, pos, th)) return false;
+  int mnum = rng.rand<unsigned>() % nmoves;
+
+  const char* p = g.begin;
+  MoveToken t;
+  Move m;
+  for (int k = 0; k < mnum && GameReader::next_move(p, g.end, t); k++)
   {
-    if (line.length())
-    {
-      mov_str += line;
-      mov_str += " "; //so there will be a space between moves
-    }
-    else
+    if ((m = GameReader::to_move(pos, t)) != MOVE_NONE)
     {
-      output_game_evals(out, mov_str);
-      mov_str = "";
+      states.push(StateInfo());
+      pos.do_move(m, states.top(), pos.gives_check(m, CheckInfo(pos)));
     }
+    // if we encountered an invalid move, break out
+    else break;
   }
 
-  if (mov_str.length())
+  if (rng.rand<unsigned>() % 2)
+    Analyze::random_capture(pos, rng, states);
+  else
   {
-    output_game_evals(out, mov_str);
+    int moves = rng.rand<unsigned>() % MAX_RAND_MOVES;
+    Analyze::random_moves(pos, rng, states, moves, rng.rand<unsigned>() % MAX_PUNISHMENT_MOVES);
   }
+  return true;
+}
 
-  f.close();
-  out.close();
+//A game a shard sampled a position from in the current round, copied out of the reader's buffer. Sampling
+//it again with the PRNG of the game gives the same position, so only its key and phase bucket are kept.
+struct TrainingCandidate {
+  string text;      //the game from its tags to its end
+  size_t moves;     //where its moves begin in text
+  size_t offset;
+  int result;
+  Key key;
+  int bucket;
+
+  TrainingCandidate(const GameReader::Game& g, Key k, int b)
+    : text(g.tags, g.end), moves(size_t(g.begin - g.tags)), offset(g.offset), result(g.result), key(k), bucket(b) {}
+
+  GameReader::Game game() const
+  {
+    GameReader::Game g;
+    g.tags = text.data();
+    g.begin = g.tags + moves;
+    g.end = g.tags + text.size();
+    g.offset = offset;
+    g.result = result;
+    return g;
+  }
+};
+
+//The games of one byte range of the game file, and the training positions sampled from them.
+//Ranges start right after a blank line, so each game belongs to exactly one shard.
+struct TrainingShard {
+  size_t begin, end;
+  size_t offset;    //where to look for the next game to sample, with shuffled games its index in order
+  vector<size_t> order;   //with shuffled games, the offsets of the games of the range in sampling order
+  std::unique_ptr<GameReader> reader; //without, reads on from offset in every round, so a streamed file is only inflated once
+  vector<int> phaseCount; //positions written so far per phase bucket
+  int quota;        //positions the shard contributes in total
+  int count;        //positions written so far
+  int chunk;        //positions stored in the current round
+  vector<TrainingCandidate> candidates; //positions sampled in the current round, then the ones that are kept
+
+  bool exhausted(bool shuffle) const { return offset >= (shuffle ? order.size() : end); }
+};
+
+//Once a shard has run out of games, the positions the set still needs are split evenly over the shards that
+//have games left. The quotas only depend on the counts at the start of a round, so a resumed run gets the same.
+void share_quotas(vector<TrainingShard>& shards, bool shuffle, int npositions)
+{
+  int need = npositions, live = 0;
+  for (const TrainingShard& shard : shards)
+  {
+    need -= shard.count;
+    live += !shard.exhausted(shuffle);
+  }
+  if (!live || live == int(shards.size()))
+    return;
 
+  need = std::max(need, 0);
+  int i = 0;
+  for (TrainingShard& shard : shards)
+    if (!shard.exhausted(shuffle))
+      shard.quota = shard.count + need / live + (i++ < need % live);
 }
 
-void Analyze::process_game_list(string infile, string ofile, void(*game_func)(ostream&, string&))
+//each game has its own PRNG, so its position does not depend on which shard or round samples it
+uint64_t game_seed(uint64_t seed, size_t gameStart)
 {
-  fstream f;
-  f.open(infile);
-  string line;
-  ofstream out;
-  out.open(ofile);
+  return seed ^ (0x9E3779B97F4A7C15ULL * uint64_t(gameStart + 1));
+}
+
+//How gen_training_set picks its positions, set by the Katyusha_MaxRepeats, Katyusha_ShuffleGames and
+//Katyusha_PhaseBuckets options, or by the checkpoint when resuming.
+//maxRepeats: how many times a position, by its Zobrist key, may be in the set, 0 for any number of times.
+//The positions of a round are counted in shard order, so the set only depends on the seed and the shards.
+//shuffle: each shard samples its games in a random order instead of from its start, so a set drawn from part
+//of the games is spread uniformly over all of them.
+//buckets: the game phase is split into this many buckets, and each gets an equal share of a shard's quota.
+struct TrainingSampler {
+  int maxRepeats;
+  bool shuffle;
+  int buckets;
+  DedupTable seen;
+
+  //the phase bucket of pos, 0 for the endgame
+  int bucket(const Position& pos) const
+  {
+    return buckets > 1 ? Material::probe(pos)->game_phase() * buckets / (PHASE_MIDGAME + 1) : 0;
+  }
+
+  //the share of phase bucket b of the given quota
+  int bucket_quota(int quota, int b) const
+  {
+    return quota / buckets + (b < quota % buckets);
+  }
+};
+
+//set the order of the games of a shard, a random permutation that only depends on the seed and the range
+void shuffle_games(const GameFile& games, TrainingShard& shard, uint64_t seed)
+{
+  GameReader reader(games, shard.begin, shard.end);
+  GameReader::Game g;
+  reader.filter = game_filter();
+  shard.order.clear();
+  while (reader.next(g))
+    shard.order.push_back(g.offset);
+
+  PRNG rng(game_seed(~seed, shard.begin));
+  for (size_t i = shard.order.size(); i > 1; i--)
+    std::swap(shard.order[i - 1], shard.order[rng.rand<uint64_t>() % i]);
+}
+
+//a .npy name is a file of packed positions, other names are written as they are or are prefixes
+bool is_npy(const string& name)
+{
+  return name.size() > 4 && name.compare(name.size() - 4, 4, ".npy") == 0;
+}
 
-  string mov_str;
-  while (getline(f, line))
+//Positions each shard samples per round. The rounds are written out in shard order, so memory use is
+//bounded by the chunks of one round.
+const int ChunkPositions = 4096;
+
+//minimum time between two checkpoints, in milliseconds. Saving the positions seen of a large set takes a while,
+//so checkpoints are further apart when they take more than 1/CheckpointShare of the time.
+const TimePoint CheckpointInterval = 60 * 1000;
+const int CheckpointShare = 20;
+
+//The output of gen_training_set, and the chunks of the current round. For a prefix the features and
+//evaluations go to prefix_x.npy and prefix_y.npy. For a name ending in .npy the positions are packed into
+//it instead, and expanded to features when read. name.ckpt records how far each shard got at the last
+//checkpoint, for resuming after a crash.
+struct TrainingOutput {
+  string name;
+  bool packed;
+  NpyWriter x, y;
+  vector<float> features, evals;
+  vector<PackedPosition> records;
+
+  bool open(size_t rows, int nshards)
   {
-    if (line.length())
+    packed = is_npy(name);
+    if (packed)
     {
-      mov_str += line;
-      mov_str += " "; //so there will be a space between moves
+      records.resize(size_t(nshards) * ChunkPositions);
+      return x.open(name, PackedPosition::Descr, sizeof(PackedPosition), 0, rows);
     }
+    features.resize(size_t(nshards) * ChunkPositions * Analyze::NB_FEATURES);
+    evals.resize(size_t(nshards) * ChunkPositions);
+    return   x.open(name + "_x.npy", "'<f4'", sizeof(float), Analyze::NB_FEATURES, rows)
+          && y.open(name + "_y.npy", "'<f4'", sizeof(float), 0, rows);
+  }
+
+  //store sample i of the chunk of shard k, with the result of its game
+  static_assert(GameReader::RESULT_UNKNOWN == PackedPosition::ResultUnknown, "Game results are packed as they are");
+  void store(int k, int i, const Position& pos, Value v, int result)
+  {
+    size_t n = size_t(k) * ChunkPositions + i;
+    if (packed)
+      records[n].pack(pos, v, result);
     else
     {
-      game_func(out, mov_str);
-      mov_str = "";
+      Analyze::Katyusha_pos_rep(pos, &features[n * Analyze::NB_FEATURES]);
+      evals[n] = float(to_cp(v));
     }
   }
 
-  if (mov_str.length())
+  //append the first count samples of the chunk of shard k
+  bool append(int k, int count)
   {
-    game_func(out, mov_str);
+    size_t n = size_t(k) * ChunkPositions;
+    if (packed)
+      return x.append(&records[n], count);
+    return x.append(&features[n * Analyze::NB_FEATURES], count) && y.append(&evals[n], count);
   }
 
-  f.close();
-  out.close();
+  //flush the arrays and the positions seen to disk, then replace the checkpoint file. The positions seen and the
+  //checkpoint file are written to a .tmp file, which is on disk before it replaces the last one. If the checkpoint
+  //file is not replaced, the positions of one round too many count as seen when resuming.
+  bool checkpoint(uint64_t seed, int npositions, const vector<TrainingShard>& shards, const TrainingSampler& sampler)
+  {
+    if (!x.checkpoint() || (!packed && !y.checkpoint()))
+      return false;
+    string seen = name + ".keys";
+    if (   sampler.maxRepeats
+        && (!sampler.seen.save(seen + ".tmp") || rename((seen + ".tmp").c_str(), seen.c_str())))
+      return false;
+    std::ostringstream out;
+    out << "seed " << seed << "\nnpositions " << npositions << "\nshards " << shards.size()
+        << "\nsampler " << sampler.maxRepeats << " " << sampler.shuffle << " " << sampler.buckets << "\n";
+    for (const TrainingShard& shard : shards)
+    {
+      out << shard.offset << " " << shard.count;
+      for (int c : shard.phaseCount)
+        out << " " << c;
+      out << "\n";
+    }
+    string tmp = name + ".ckpt.tmp", text = out.str();
+    FILE* f = fopen(tmp.c_str(), "wb");
+    if (!f)
+      return false;
+    bool ok = fwrite(text.data(), 1, text.size(), f) == text.size() && !fflush(f) && !fsync(fileno(f));
+    return !fclose(f) && ok && !rename(tmp.c_str(), (name + ".ckpt").c_str());
+  }
+
+  //read the last checkpoint into the shards, which must have been set up for the same number of shards,
+  //and the sampler. The positions seen are read by restore_seen() once the table is sized.
+  bool restore(uint64_t& seed, int& npositions, vector<TrainingShard>& shards, TrainingSampler& sampler)
+  {
+    ifstream in(name + ".ckpt");
+    string key;
+    size_t n = 0;
+    if (   !(in >> key >> seed >> key >> npositions >> key >> n) || n != shards.size()
+        || !(in >> key >> sampler.maxRepeats >> sampler.shuffle >> sampler.buckets) || sampler.buckets < 1)
+      return false;
+    for (TrainingShard& shard : shards)
+    {
+      shard.phaseCount.resize(sampler.buckets);
+      if (!(in >> shard.offset >> shard.count))
+        return false;
+      for (int& c : shard.phaseCount)
+        if (!(in >> c))
+          return false;
+    }
+    return true;
+  }
+
+  bool restore_seen(TrainingSampler& sampler) { return !sampler.maxRepeats || sampler.seen.load(name + ".keys"); }
 
+  bool close() { return x.close() && y.close(); }
+};
+
+//sample one position per game of shard k, from its next game on, until limit positions are candidates for its
+//chunk of the output. Each worker has its own position and states, and Katyusha is inactive, so the
+//evaluation only touches the worker thread's tables. Positions of phase buckets the candidates already fill
+//are skipped, the positions the set has enough of are dropped by keep_candidates() once all shards are done.
+void sample_shard(const GameFile& games, TrainingShard& shard, Thread* th, uint64_t seed, int limit,
+                  const TrainingSampler& sampler)
+{
+  GameReader::Game g;
+  vector<int> pending(shard.phaseCount);
+  shard.candidates.clear();
+  if (!sampler.shuffle && !shard.reader)
+  {
+    shard.reader.reset(new GameReader(games, shard.offset, shard.end));
+    shard.reader->filter = game_filter();
+  }
+
+  while (int(shard.candidates.size()) < limit)
+  {
+    if (sampler.shuffle)
+    {
+      if (shard.offset >= shard.order.size())
+        return;
+      GameReader at(games, shard.order[shard.offset++]);
+      at.next(g);
+    }
+    else if (!shard.reader->next(g))
+    {
+      shard.offset = shard.end;
+      return;
+    }
+
+    std::stack<StateInfo> states;
+    Position pos;
+    PRNG rng(game_seed(seed, g.offset));
+    if (!sample_game(pos, g, th, rng, states))
+      continue;
+
+    int b = sampler.bucket(pos);
+    if (pending[b] >= sampler.bucket_quota(shard.quota, b))
+      continue;
+
+    pending[b]++;
+    shard.candidates.emplace_back(g, pos.key(), b);
+  }
+  if (!sampler.shuffle)
+    shard.offset = shard.reader->offset();
 }
 
+//drop the candidates of full phase buckets and the positions the set already has enough of, one shard after
+//the other, so which shard keeps a repeated position does not depend on the timing of the workers
+void keep_candidates(vector<TrainingShard>& shards, TrainingSampler& sampler)
+{
+  for (TrainingShard& shard : shards)
+  {
+    vector<TrainingCandidate>& cs = shard.candidates;
+    size_t n = 0;
+    for (size_t i = 0; i < cs.size(); i++)
+      if (   shard.phaseCount[cs[i].bucket] < sampler.bucket_quota(shard.quota, cs[i].bucket)
+          && (!sampler.maxRepeats || sampler.seen.take(cs[i].key, sampler.maxRepeats)))
+      {
+        shard.phaseCount[cs[i].bucket]++;
+        if (n != i)
+          cs[n] = std::move(cs[i]);
+        n++;
+      }
+    cs.erase(cs.begin() + n, cs.end());
+  }
+}
 
-#define MAX_RAND_MOVES 3
-#define MAX_PUNISHMENT_MOVES 3
+//sample the kept positions of shard k again and store them, with their labels, in its chunk of the output.
+//A label search only uses the worker thread's slice of the TT.
+void label_shard(TrainingShard& shard, int k, Thread* th, uint64_t seed, TrainingOutput& output, std::atomic<int>& done)
+{
+  LabelLimits labels = label_limits();
+  shard.chunk = 0;
+  for (const TrainingCandidate& c : shard.candidates)
+  {
+    GameReader::Game g = c.game();
+    std::stack<StateInfo> states;
+    Position pos;
+    PRNG rng(game_seed(seed, g.offset));
+    sample_game(pos, g, th, rng, states);
+    assert(pos.key() == c.key);
+
+    output.store(k, shard.chunk++, pos, white_label(pos, labels), g.result);
+    if (++done % 10000 == 0) sync_cout << "Processing Position " << done << sync_endl;
+  }
+}
 
+}
 
+//Sample npositions positions from the games of infile and write their FENs to ofile, one per line. If ofile
+//ends in .npy the positions are packed into it instead, without an evaluation.
 void Analyze::gen_training_positions(string infile, string ofile, int npositions)
 {
   cout << "infile " << infile << " ofile " << ofile << "npos " << npositions << endl;
-  fstream f;
+  GameFile games;
   ofstream out;
-  f.open(infile);
-  out.open(ofile);
-  string line;
-  string mov_str;
+  NpyWriter records;
+  if (!games.open(infile))
+  {
+    cout << "Failed to open " << infile << endl;
+    return;
+  }
+  if (is_npy(ofile))
+    records.open(ofile, PackedPosition::Descr, sizeof(PackedPosition), 0);
+  else
+    out.open(ofile);
 
   //enable Stockfish
   KatyushaEngine::deactivate();
 
-  srand(time(NULL));
+  PRNG rng(time(NULL));
 
   int curPos = 0;
+  GameReader reader(games);
+  GameReader::Game g;
+  reader.filter = game_filter();
 
-  while (getline(f, line))
+  while (curPos < npositions && reader.next(g))
   {
-    if (line.length())
+    if (curPos%10000 == 0) cout << "Processing Position " << curPos << endl;
+    std::stack<StateInfo> states;
+    Position pos;
+    if (!sample_game(pos, g, Threads.main(), rng, states)) continue;
+    if (is_npy(ofile))
     {
-      mov_str += line;
-      mov_str += " "; //so there will be a space between moves
+      PackedPosition pp;
+      pp.pack(pos, VALUE_NONE, g.result);
+      records.append(&pp, 1);
     }
     else
-    {
-      if (curPos%10000 == 0) cout << "Processing Position " << curPos << endl;
-      Position pos(StartFEN, false, Threads.main());
-      Move m;
-      string token;
-      vector<string> move_strs;
-
-      istringstream is(mov_str);
-      while (is >> token)
-      {
-        move_strs.push_back(token);
-      }
+      out << pos.fen() << endl;
+    ++curPos;
+  }
+  out.close();
+  records.close();
+  cout << "Processed total " << curPos << " positions." << endl;
+}
 
-      int nmoves = move_strs.size();
-      if (!nmoves) continue;
-      int mnum = rand() % nmoves;
+//Sample npositions training positions, one per game, from the games of infile, and save their features and
+//Stockfish evaluations to prefix_x.npy and prefix_y.npy, or the packed positions to prefix if it ends in .npy.
+//The file is split into one shard per search thread, and each shard samples its share of the positions on
+//its own thread, a chunk per round. The chunks of a round are appended in shard order, so the output only
+//depends on the seed and the number of threads. Positions are labeled as set by Katyusha_LabelDepth and
+//Katyusha_LabelNodes, search labels also depend on the counter move history the threads share. They are
+//picked as set by the TrainingSampler options, which of the shards keeps a repeated position depends on
+//which gets to it first.
+//A shard that runs out of games leaves the rest of its share to the others. With resume, the seed, number of positions and
+//sampler come from the checkpoint file and the output is continued from its last checkpoint.
+//The games of a gzipped file are streamed, which they cannot be in a random order.
+void Analyze::gen_training_set(string infile, string prefix, int npositions, uint64_t seed, bool resume)
+{
+  //enable Stockfish
+  KatyushaEngine::deactivate();
 
-//      cout << analyze_game(mov_str) << endl;
-      SetupStates = Search::StateStackPtr(new std::stack<StateInfo>);
-      for (int k = 0; k < mnum; k++)
-      {
-        if ((m = UCI::to_move(pos, move_strs[k])) != MOVE_NONE)
-        {
-          SetupStates->push(StateInfo());
-          pos.do_move(m, SetupStates->top(), pos.gives_check(m, CheckInfo(pos)));
-        }
-        // if we encountered an invalid move, break out
-        else break;
-      }
+  GameFile games;
+  if (!games.open(infile))
+  {
+    cout << "Failed to open " << infile << endl;
+    return;
+  }
 
-      if (rand()%2) {
-        random_capture(pos);
-        out << pos.fen() << endl;
-      }
-      else {
-        random_moves(pos, rand()%MAX_RAND_MOVES, rand()%MAX_PUNISHMENT_MOVES);
-        out << pos.fen() << endl;
-      }
-      if (++curPos >= npositions) break;
+  int nshards = Threads.size();
+  TrainingSampler sampler;
+  sampler.maxRepeats = Options["Katyusha_MaxRepeats"];
+  sampler.shuffle = Options["Katyusha_ShuffleGames"];
+  sampler.buckets = Options["Katyusha_PhaseBuckets"];
+
+  vector<TrainingShard> shards(nshards);
+  for (int k = 0; k < nshards; k++)
+  {
+    shards[k].count = 0;
+    shards[k].phaseCount.assign(sampler.buckets, 0);
+  }
 
-      mov_str = "";
+  TrainingOutput output;
+  output.name = prefix;
+  if (resume && !output.restore(seed, npositions, shards, sampler))
+  {
+    cout << "No checkpoint of " << nshards << " shards for " << prefix << ", set Threads to the value it was made with" << endl;
+    return;
+  }
+  if (sampler.shuffle && games.streamed())
+  {
+    cout << "Katyusha_ShuffleGames reads the games in a random order, which needs " << infile << " uncompressed" << endl;
+    return;
+  }
+
+  //a streamed file is read through once to split it
+  vector<size_t> bounds = games.split(nshards);
+  for (int k = 0; k < nshards; k++)
+  {
+    shards[k].begin = bounds[k];
+    shards[k].end = bounds[k + 1];
+    if (!resume)
+      shards[k].offset = sampler.shuffle ? 0 : bounds[k];
+  }
+  cout << "infile " << infile << " prefix " << prefix << " npos " << npositions << " seed " << seed << endl;
+
+  int curPos = 0;
+  for (int k = 0; k < nshards; k++)
+  {
+    shards[k].quota = npositions / nshards + (k < npositions % nshards);
+    curPos += shards[k].count;
+    if (sampler.shuffle)
+      shuffle_games(games, shards[k], seed);
+  }
+
+  if (sampler.maxRepeats)
+    sampler.seen.resize(npositions);
+  if (resume && !output.restore_seen(sampler))
+  {
+    cout << "Failed to read the positions seen of " << prefix << endl;
+    return;
+  }
+
+  if (!output.open(curPos, nshards) || !output.checkpoint(seed, npositions, shards, sampler))
+  {
+    cout << "Failed to open the output files of " << prefix << endl;
+    return;
+  }
+
+  std::atomic<int> done(curPos);
+  TimePoint start = now(), lastCheckpoint = start, interval = CheckpointInterval;
+  int startPos = curPos;
+  bool ok = true;
+  Search::start_labeling(nshards);
+
+  while (ok)
+  {
+    //the workers use the search threads' pawn and material tables, no search may be running
+    vector<std::thread> workers;
+    share_quotas(shards, sampler.shuffle, npositions);
+    for (int k = 0; k < nshards; k++)
+    {
+      TrainingShard& shard = shards[k];
+      shard.chunk = 0;
+      shard.candidates.clear();
+      if (shard.count < shard.quota && !shard.exhausted(sampler.shuffle))
+        workers.emplace_back(sample_shard, std::cref(games), std::ref(shard), Threads[k], seed,
+                             std::min(ChunkPositions, shard.quota - shard.count), std::cref(sampler));
+    }
+    if (workers.empty())
+      break;
+    for (std::thread& w : workers)
+      w.join();
+
+    keep_candidates(shards, sampler);
+    workers.clear();
+    for (int k = 0; k < nshards; k++)
+      if (!shards[k].candidates.empty())
+        workers.emplace_back(label_shard, std::ref(shards[k]), k, Threads[k], seed, std::ref(output), std::ref(done));
+    for (std::thread& w : workers)
+      w.join();
+
+    for (int k = 0; k < nshards && ok; k++)
+    {
+      ok = output.append(k, shards[k].chunk);
+      shards[k].count += shards[k].chunk;
+      curPos += shards[k].chunk;
+    }
+
+    if (ok && now() - lastCheckpoint >= interval)
+    {
+      TimePoint begin = now();
+      ok = output.checkpoint(seed, npositions, shards, sampler);
+      lastCheckpoint = now();
+      interval = std::max(CheckpointInterval, CheckpointShare * (lastCheckpoint - begin));
+      cout << "Checkpoint at " << curPos << " positions" << endl;
     }
   }
-  f.close();
-  out.close();
-  cout << "Processed total " << curPos << " positions." << endl;
+
+  Search::stop_labeling();
+  report_labels(curPos - startPos, now() - start);
+
+  ok = ok && output.checkpoint(seed, npositions, shards, sampler) && output.close();
+  if (!ok)
+    cout << "Failed to write " << prefix << ", resume from the last checkpoint" << endl;
+  cout << "total " << curPos << " positions out of requested " << npositions << endl;
+  if (ok && curPos < npositions)
+    cout << "The games of " << infile << " ran out " << npositions - curPos << " positions short" << endl;
 }
 
-void Analyze::gen_training_set(string infile, string ofile, int npositions)
+namespace {
+
+//td_train settings, by default the ones of td_learning.py
+struct TDParams {
+  size_t games = 0;       //number of games, 0 for one from each start position
+  size_t batch = 128;     //games per weight update
+  int plies = 12;         //plies of each game
+  Depth depth = Depth(5 * ONE_PLY);
+  int64_t nodes = 0;
+  float lambda = 0.7f;
+  KatyushaOptimizer::Method optimizer = KatyushaOptimizer::ADAGRAD;
+  float rate = 0;         //learning rate, 0 for the default of the optimizer
+  int checkpoint = 10;    //batches between saves of the weights
+  uint64_t seed = 0;
+};
+
+//a search value in the units of the network output, which to_stockfish_value scales to 50 pawns. Mate scores are
+//beyond what tanh can reach and are clamped to its range.
+float to_raw(Value v)
 {
-  cout << "infile " << infile << " ofile " << ofile << "npos " << npositions << endl;
-  fstream f;
-  f.open(infile);
-  string line;
-  string mov_str;
+  return std::max(-1.0f, std::min(1.0f, float(v) / (PawnValueEg * 50)));
+}
 
-  //enable Stockfish
-  KatyushaEngine::deactivate();
+//the features of the positions of one self-play game and their search values, from White's point of view and in
+//the units of the network output. If the game ended within its plies, the value of the final position follows.
+struct TDGame {
+  vector<int> features;
+  vector<float> values;
 
-  srand(time(NULL));
+  size_t positions() const { return features.size() / Analyze::NB_FEATURES; }
+};
 
-  float * training_features = (float*)malloc(sizeof(float)*npositions*(NB_FEATURES));
-  float * training_evals = (float*)malloc(sizeof(float) * npositions);
-  if (!training_features || !training_evals) cout << "Memory alloc error. " << endl;
-  int curPos = 0;
+//play the moves of label searches from fen on to game, the thread must be set up by Search::start_labeling()
+void play_td_game(const string& fen, Thread* th, const TDParams& p, TDGame& game)
+{
+  Position pos(fen, false, th);
+  std::deque<StateInfo> states;
+  game.features.clear();
+  game.values.clear();
 
-  while (getline(f, line))
+  for (int ply = 0; ply < p.plies; ply++)
   {
-    if (line.length())
+    //the side to move is mated, or the game is drawn
+    if (!MoveList<LEGAL>(pos).size())
     {
-      mov_str += line;
-      mov_str += " "; //so there will be a space between moves
+      game.values.push_back(!pos.checkers() ? 0.0f : pos.side_to_move() == WHITE ? -1.0f : 1.0f);
+      return;
     }
-    else
+    if (pos.is_draw())
     {
-      if (curPos%10000 == 0) cout << "Processing Position " << curPos << endl;
-      Position pos(StartFEN, false, Threads.main());
-      Move m;
-      string token;
-      vector<string> move_strs;
-
-      istringstream is(mov_str);
-      while (is >> token)
-      {
-        move_strs.push_back(token);
-      }
+      game.values.push_back(0.0f);
+      return;
+    }
 
-      int nmoves = move_strs.size();
-      if (!nmoves) continue;
-      int mnum = rand() % nmoves;
+    Move m = MOVE_NONE;
+    Value v = Search::label(pos, p.depth, p.nodes, &m);
+    game.features.resize(game.features.size() + Analyze::NB_FEATURES);
+    Analyze::Katyusha_pos_rep(pos, &game.features[game.features.size() - Analyze::NB_FEATURES]);
+    game.values.push_back(to_raw(pos.side_to_move() == WHITE ? v : -v));
 
-//      cout << analyze_game(mov_str) << endl;
-      SetupStates = Search::StateStackPtr(new std::stack<StateInfo>);
-      for (int k = 0; k < mnum; k++)
-      {
-        if ((m = UCI::to_move(pos, move_strs[k])) != MOVE_NONE)
-        {
-          SetupStates->push(StateInfo());
-          pos.do_move(m, SetupStates->top(), pos.gives_check(m, CheckInfo(pos)));
-        }
-        // if we encountered an invalid move, break out
-        else break;
-      }
+    //a search that returned without a move ends the game at this position, as if it were out of plies
+    if (m == MOVE_NONE)
+      return;
 
-//      cout << "moved to move num " << mnum << "total moves " << move_strs.size() << endl;
-
-//      Position& origPos = pos;
-//      cout << pos << "opchecks " << pos.checkers() << endl;
-      if (rand()%2) {
-      random_capture(pos);
-      save_pos_features(pos, training_features+NB_FEATURES*curPos);
-      training_evals[curPos] = (float)centipawn_evaluate(pos);
-  //    cout << "First Evaluation " << pos << "pchecks "<< pos.checkers() << endl;
-    //  if (pos.checkers()) cout << "UhOHp"<<endl;
-//      cout << "Orig Pos" << origPos << endl;
-      }
-      else {
-        random_moves(pos, rand()%MAX_RAND_MOVES, rand()%MAX_PUNISHMENT_MOVES);
-          save_pos_features(pos, training_features+NB_FEATURES*curPos);
-          training_evals[curPos] = (float)centipawn_evaluate(pos);
-      }
-      if (++curPos >= npositions) break;
+    states.emplace_back();
+    pos.do_move(m, states.back(), pos.gives_check(m, CheckInfo(pos)));
+  }
+}
 
+//the TD(lambda) error of each position t of game, sum over j >= t of lambda^(j-t) (v[j+1] - v[j]), in one pass
+//from the end with e[t] = v[t+1] - v[t] + lambda e[t+1]
+void td_errors(const TDGame& game, float lambda, vector<float>& errors)
+{
+  const size_t n = game.positions();
+  errors.resize(n);
+  float e = 0;
+  for (size_t t = n; t-- > 0; )
+  {
+    e = (t + 1 < game.values.size() ? game.values[t + 1] - game.values[t] : 0.0f) + lambda * e;
+    errors[t] = e;
+  }
+}
 
+//play the games first + k, first + k + n, ... before first + count on search thread k, and add the gradients of
+//the loss (y - (y + e))^2 / 2 of their positions to g, where y is the network output and e the TD error. The
+//network is only read, the weights are updated once all workers are done.
+void td_worker(const vector<string>& fens, size_t first, size_t count, size_t k, size_t n, const TDParams& p,
+               KatyushaGradient& g, double& sqerr, int& positions)
+{
+  std::shared_ptr<const KatyushaNet> net = KatyushaEngine::get_network();
+  KatyushaScratch& scratch = Threads[k]->netScratch;
+  TDGame game;
+  vector<float> errors;
 
-      mov_str = "";
+  for (size_t i = first + k; i < first + count; i += n)
+  {
+    play_td_game(fens[i % fens.size()], Threads[k], p, game);
+    td_errors(game, p.lambda, errors);
+    for (size_t t = 0; t < errors.size(); t++)
+    {
+      net->forward(&game.features[t * Analyze::NB_FEATURES], scratch);
+      net->backward(-errors[t], scratch, g);
+      sqerr += double(errors[t]) * errors[t];
     }
+    positions += int(errors.size());
+  }
+}
+
+}
+
+//TD(lambda) training of the network by self-play. The games start from the positions of fenfile, one FEN per line,
+//shuffled, and are played by label searches on all threads. After every batch of games the network takes a step of
+//gradient descent towards the TD(lambda) targets of their positions, and every few batches its weights are saved
+//to outfile, which can be loaded as the weightsfile.
+//The settings follow as name value pairs: games, batch, plies, depth, nodes, lambda, optimizer, rate, checkpoint
+//and seed. The optimizer is sgd, adagrad or adam, Adagrad by default like td_learning.py.
+void Analyze::td_train(std::istringstream& is)
+{
+  string infile, outfile, token;
+  TDParams p;
+  if (!(is >> infile) || !(is >> outfile))
+  {
+    sync_cout << "Missing position file or weights file" << sync_endl;
+    return;
+  }
+  while (is >> token)
+  {
+    string value;
+    if (!(is >> value))
+      break;
+
+    //counts are read as ints, so that a negative one is not wrapped around
+    int games = int(p.games), batch = int(p.batch), depth = p.depth / ONE_PLY;
+    using KatyushaTrainer::parse;
+    if      (token == "games")      parse(value, games), p.games = size_t(std::max(games, 0));
+    else if (token == "batch")      parse(value, batch), p.batch = size_t(std::max(batch, 1));
+    else if (token == "plies")      parse(value, p.plies);
+    else if (token == "depth")      parse(value, depth), p.depth = Depth(depth * ONE_PLY);
+    else if (token == "nodes")      parse(value, p.nodes);
+    else if (token == "lambda")     parse(value, p.lambda);
+    else if (token == "optimizer" && !KatyushaOptimizer::parse(value, p.optimizer))
+    {
+      sync_cout << "Unknown optimizer " << value << sync_endl;
+      return;
+    }
+    else if (token == "rate")       parse(value, p.rate);
+    else if (token == "checkpoint") parse(value, p.checkpoint);
+    else if (token == "seed")       parse(value, p.seed);
+  }
+  if (!KatyushaEngine::get_network())
+  {
+    sync_cout << "No network is loaded" << sync_endl;
+    return;
+  }
+  if (p.depth <= DEPTH_ZERO && p.nodes <= 0)
+    p.depth = Depth(5 * ONE_PLY);
+  p.checkpoint = std::max(p.checkpoint, 1);
+
+  vector<string> fens;
+  ifstream in(infile);
+  string fen;
+  while (getline(in, fen))
+    if (fen.length())
+      fens.push_back(fen);
+  if (fens.empty())
+  {
+    sync_cout << "No positions in " << infile << sync_endl;
+    return;
   }
-  f.close();
 
-  cout << "Writing to outfile" << endl;
+  PRNG rng(p.seed ? p.seed : now());
+  for (size_t i = fens.size() - 1; i > 0; i--)
+    std::swap(fens[i], fens[rng.rand<uint64_t>() % (i + 1)]);
+  const size_t games = p.games ? p.games : fens.size();
+
+  const size_t n = Threads.size();
+  vector<KatyushaGradient> grads(n);
+  KatyushaGradient delta;
+  KatyushaOptimizer optimizer(p.optimizer, p.rate);
+  TimePoint start = now();
+  int positions = 0;
+  bool ok = true;
+  Search::start_labeling(n);
+
+  for (size_t first = 0, b = 1; first < games && ok; first += p.batch, b++)
+  {
+    const size_t count = std::min(p.batch, games - first);
+    vector<double> sqerr(n, 0.0);
+    vector<int> batchPositions(n, 0);
+    vector<std::thread> workers;
+    for (size_t k = 0; k < n; k++)
+    {
+      KatyushaEngine::get_network()->init_gradient(grads[k]);
+      workers.emplace_back(td_worker, std::cref(fens), first, count, k, n, std::cref(p), std::ref(grads[k]),
+                           std::ref(sqerr[k]), std::ref(batchPositions[k]));
+    }
+    for (std::thread& w : workers)
+      w.join();
 
-  //now write to outfile
-  const unsigned int feature_shape[] = {(unsigned int)curPos, (unsigned int)NB_FEATURES};
-  int feature_dims = 2;
-  const unsigned int evals_shape[] = {(unsigned int)curPos};
-  int evals_dims = 1;
+    for (size_t k = 1; k < n; k++)
+    {
+      grads[0].add(grads[k]);
+      sqerr[0] += sqerr[k];
+      batchPositions[0] += batchPositions[k];
+    }
+    optimizer.step(grads[0], delta);
+    KatyushaEngine::update_network(delta);
+    //the transposition table and the histories were filled with the old weights
+    Search::clear();
+    positions += batchPositions[0];
+
+    //one unit of network output is 50 pawns
+    sync_cout << "Batch " << b << ": " << count << " games, " << batchPositions[0] << " positions, rms TD error "
+              << std::sqrt(sqerr[0] / std::max(batchPositions[0], 1)) * 50 * 100 << " cp, "
+              << 1000 * positions / (now() - start + 1) << " positions/s" << sync_endl;
+
+    if (b % p.checkpoint == 0)
+      ok = KatyushaEngine::get_network()->save(outfile);
+  }
 
-  cout << "total " << curPos << "positions out of requested " << npositions << endl;
-  cnpy::npz_save(ofile, "training_x", training_features, feature_shape, feature_dims, "a");
-  cout << "got training x " << endl;
-  cnpy::npz_save(ofile, "training_y", training_evals, evals_shape, evals_dims, "a");
-  cout << "got training y" << endl;
+  Search::stop_labeling();
+  if (!ok || !KatyushaEngine::get_network()->save(outfile))
+    sync_cout << "Failed to write the weights to " << outfile << sync_endl;
+}
+
+//the features of a packed position
+template<typename T>
+void Analyze::Katyusha_packed_rep(const PackedPosition& pp, T * features)
+{
+  Position pos(pp.fen(), false, Threads.main());
+  Katyusha_pos_rep(pos, features);
+}
+
+template void Analyze::Katyusha_packed_rep<int>(const PackedPosition& pp, int * features);
+template void Analyze::Katyusha_packed_rep<float>(const PackedPosition& pp, float * features);
+
+//expand a file of packed positions to the features and evaluations of gen_training_set, in prefix_x.npy
+//and prefix_y.npy. Positions without an evaluation are left out.
+void Analyze::unpack_training_set(string infile, string prefix)
+{
+  PackedPositionFile in;
+  NpyWriter x, y;
+  if (!in.open(infile))
+  {
+    cout << infile << " is not a file of packed positions" << endl;
+    return;
+  }
+  if (   !x.open(prefix + "_x.npy", "'<f4'", sizeof(float), NB_FEATURES)
+      || !y.open(prefix + "_y.npy", "'<f4'", sizeof(float), 0))
+  {
+    cout << "Failed to open the output files of " << prefix << endl;
+    return;
+  }
+
+  vector<float> features(size_t(ChunkPositions) * NB_FEATURES), evals(ChunkPositions);
+  bool ok = true;
+  for (size_t i = 0; i < in.size() && ok; )
+  {
+    int n = 0;
+    for ( ; n < ChunkPositions && i < in.size(); i++)
+      if (in[i].eval != VALUE_NONE)
+      {
+        Katyusha_packed_rep(in[i], &features[size_t(n) * NB_FEATURES]);
+        evals[n++] = float(to_cp(Value(in[i].eval)));
+      }
+    ok = x.append(features.data(), n) && y.append(evals.data(), n);
+  }
+
+  ok = ok && x.close() && y.close();
+  cout << (ok ? "Unpacked " : "Failed after ") << x.rows() << " of " << in.size() << " positions" << endl;
 }
 
 //make moves random moves, followed by punishment_moves of good play
-void Analyze::random_moves(Position& pos, int moves, int punishment_moves)
+//the states of the moves are pushed on states, so they outlive the call
+void Analyze::random_moves(Position& pos, PRNG& rng, std::stack<StateInfo>& states, int moves, int punishment_moves)
 {
-//  SetupStates = Search::StateStackPtr(new std::stack<StateInfo>);
-  //cout << "doing random " << moves << " punishment " << punishment_moves << endl;
-  StateInfo st[moves+punishment_moves];
   for (int i = 0; i < moves; i++)
   {
     size_t nmoves = MoveList<LEGAL>(pos).size();
     if (!nmoves) return; //UH-OH, there are no legal moves
-    int move_num = rand() % nmoves;
+    int move_num = rng.rand<unsigned>() % nmoves;
     int j = 0;
     for (const auto& m : MoveList<LEGAL>(pos))
     {
       if (j == move_num)
       {
-  //      SetupStates->push(StateInfo());
-//        pos.do_move(m, SetupStates->top(), pos.gives_check(m, CheckInfo(pos)));
-        pos.do_move(m, st[i], pos.gives_check(m, CheckInfo(pos)));
+        states.push(StateInfo());
+        pos.do_move(m, states.top(), pos.gives_check(m, CheckInfo(pos)));
         break;
       }
       j++;
@@ -402,22 +1114,22 @@ void Analyze::random_moves(Position& pos, int moves, int punishment_moves)
     Value v = VALUE_DRAW;
     Move bestm = MOVE_NONE;
     Value bestVal = VALUE_MATED_IN_MAX_PLY;
-    //  StateInfo st;
-    //  SetupStates = Search::StateStackPtr(new std::stack<StateInfo>);
-    //StateInfo st[1];
+    StateInfo st;
     for (auto const& m : MoveList<LEGAL>(pos))
     {
-    //  SetupStates->push(StateInfo());
-      pos.do_move(m, st[moves+i], pos.gives_check(m, CheckInfo(pos)));
-      v = Eval::evaluate<true>(pos);
+      pos.do_move(m, st, pos.gives_check(m, CheckInfo(pos)));
+      v = Eval::evaluate<false>(pos);
       if (v > bestVal) {
         bestVal = v;
         bestm = m;
       }
       pos.undo_move(m);
     }
-    //  SetupStates->push(StateInfo());
-    if (bestm != MOVE_NONE) pos.do_move(bestm, st[moves+i], pos.gives_check(bestm, CheckInfo(pos)));
+    if (bestm != MOVE_NONE)
+    {
+      states.push(StateInfo());
+      pos.do_move(bestm, states.top(), pos.gives_check(bestm, CheckInfo(pos)));
+    }
   }
 
 //  play_moves(pos, punishment_moves);
@@ -455,12 +1167,12 @@ void Analyze::play_moves(Position& pos, int moves)
   }
 }
 
-void Analyze::random_capture(Position& pos)
+void Analyze::random_capture(Position& pos, PRNG& rng, std::stack<StateInfo>& states)
 {
 //  cout << " doing random capture " << endl;
   if (pos.checkers())
   {
-    random_moves(pos, 1,0);
+    random_moves(pos, rng, states, 1, 0);
     return;
   }
 
@@ -468,18 +1180,16 @@ void Analyze::random_capture(Position& pos)
   if (captures == 0) goto end_random_capture;
 
   {
-  int cap_num = rand()%captures;
+  int cap_num = rng.rand<unsigned>() % captures;
   int j = 0;
-//  SetupStates = Search::StateStackPtr(new std::stack<StateInfo>);
-  StateInfo st[1];
   for (const auto& m : MoveList<CAPTURES>(pos))
   {
     if (j == cap_num)
     {
       //the cool thing about this is that j will not be incremented, so the next move will be tested for legality
       if (!pos.legal(m, pos.pinned_pieces(pos.side_to_move() ) ) ) continue;
-//      SetupStates->push(StateInfo());
-      pos.do_move(m, st[0], pos.gives_check(m, CheckInfo(pos)));
+      states.push(StateInfo());
+      pos.do_move(m, states.top(), pos.gives_check(m, CheckInfo(pos)));
       return;
     }
     j++;
@@ -488,7 +1198,7 @@ void Analyze::random_capture(Position& pos)
   //if we got here, there were no legal captures, or we chose an illegal capture after the first legal one
   //in this case, just make a random move with random punishment
 end_random_capture:
-  random_moves(pos, 1, rand() % 2);
+  random_moves(pos, rng, states, 1, rng.rand<unsigned>() % 2);
 }
 
 
@@ -504,16 +1214,48 @@ void Analyze::evaluate_pos_list(string infile, string ofile)
   string line;
   ofstream out;
   out.open(ofile);
-  while(getline(f, line))
+
+  //the positions are scored a chunk at a time, by the static evaluation in one batch or by label searches
+  //on all the search threads
+  const size_t Chunk = 1024;
+  LabelLimits limits = label_limits();
+  vector<string> fens;
+  EvalBatch batch;
+  TimePoint start = now();
+  int labeled = 0;
+  if (limits.search())
+    Search::start_labeling(Threads.size());
+  while (true)
   {
-    if (line.length()) {
-      double e = evaluate_fen(line);
-      out << line << '\n' <<  e << '\n';
+    bool more = bool(getline(f, line));
+    if (more && line.length()) {
+      if (!limits.search()) {
+        Position pos(line, false, Threads.main());
+        batch.add(pos);
+      }
+      fens.push_back(line);
     }
+    if (fens.size() == Chunk || (!more && fens.size()))
+    {
+      if (limits.search())
+        label_fens(fens, batch.evals, limits);
+      else
+        batch.run();
+      for (size_t i = 0; i < fens.size(); i++)
+        out << fens[i] << '\n' << batch.evals[i] << '\n';
+      labeled += int(fens.size());
+      fens.clear();
+      batch.evals.clear();
+    }
+    if (!more) break;
   }
   f.close();
   out.close();
-
+  if (limits.search())
+  {
+    Search::stop_labeling();
+    report_labels(labeled, now() - start);
+  }
 }
 
 /*
@@ -535,34 +1277,24 @@ void Analyze::feature_game_list(string infile, string ofile)
 {
   int games_processed = 0;
   int featurevec[NB_FEATURES];
-  fstream f;
-  f.open(infile);
-  string line;
-  ofstream out;
-  out.open(ofile);
-  string mov_str;
-  while (getline(f, line))
+  GameFile games;
+  if (!games.open(infile))
   {
-    if (line.length())
-    {
-      mov_str += line;
-      mov_str += " "; //so there will be a space between moves
-    }
-    else
-    {
-      output_feature_game(out, mov_str, featurevec);
-      mov_str = "";
-      games_processed++;
-    }
-    if (games_processed && games_processed % GAME_CHECKPOINT == 0) cout << "Processed " << games_processed << " games" << endl;
+    cout << "Failed to open " << infile << endl;
+    return;
   }
+  ofstream out;
+  out.open(ofile);
 
-  if (mov_str.length())
+  GameReader reader(games);
+  GameReader::Game g;
+  reader.filter = game_filter();
+  while (reader.next(g))
   {
-    output_feature_game(out, mov_str, featurevec);
+    output_feature_game(out, g, featurevec);
+    if (++games_processed % GAME_CHECKPOINT == 0) cout << "Processed " << games_processed << " games" << endl;
   }
 
-  f.close();
   out.close();
 }
 
@@ -649,383 +1381,249 @@ void Analyze::print_pos_rep(Position& pos)
 }
 
 
-//extract a feature representation from the position pos
+namespace {
 
-//utility function to convert Stockfish's internal feature representation into a feature vector I can use to train Katusha.
-// NOTE: this feature representation is based on that used by Giraffe, with some tweaks.
-//features is the array in which to store the result
-void Analyze::Katyusha_pos_rep(const Position& pos, int * features)
+//union of the attacks of all pieces of type Pt and color c
+template<PieceType Pt>
+Bitboard attacks_by(const Position& pos, Color c)
 {
-  std::memset(features, 0, sizeof(int)*NB_FEATURES);
-
-  //tempo
-  Color side = pos.side_to_move();
-  features[SIDE_TO_MOVE] = side;
-
-  //castling rights
-  features[WCASTLE_OO] = (pos.can_castle(WHITE_OO)) ? 1 : 0;
-  features[WCASTLE_OOO] = pos.can_castle(WHITE_OOO) ? 1 : 0;
-  features[BCASTLE_OO] = pos.can_castle(BLACK_OO) ? 1 : 0;
-  features[BCASTLE_OOO] = pos.can_castle(BLACK_OOO) ? 1 : 0;
-
-  //material configuration
-  features[NUM_WQ] = pos.count<QUEEN>(WHITE);
-  features[NUM_WR] = pos.count<ROOK>(WHITE);
-  features[NUM_WB] = pos.count<BISHOP>(WHITE);
-  features[NUM_WN] = pos.count<KNIGHT>(WHITE);
-  features[NUM_WP] = pos.count<PAWN>(WHITE);
-  features[NUM_BQ] = pos.count<QUEEN>(BLACK);
-  features[NUM_BR] = pos.count<ROOK>(BLACK);
-  features[NUM_BB] = pos.count<BISHOP>(BLACK);
-  features[NUM_BN] = pos.count<KNIGHT>(BLACK);
-  features[NUM_BP] = pos.count<PAWN>(BLACK);
-
-  //piece-centric information
-
-  //king position information
-  Square wk_square = pos.square<KING>(WHITE);
-  features[WK_RANK] = wk_square /8;
-  features[WK_FILE] = wk_square % 8;
-  //pos.attacks_from(wk_square, KING) & attacks();
-
-
-  Square bk_square = pos.square<KING>(BLACK);
-  features[BK_RANK] = bk_square / 8;
-  features[BK_FILE] = bk_square % 8;
-//  features[BK_DANGER_SQUARES] = ;
-
-
-
-  //this consists of coordinates, existence, and mobility
-  //NOTE: the below code is generated using a python script
-  // I am trying to produce reasonably efficient code that is quick to develop and avoids bugs
-  features[WQ1_EXISTS] = (pos.count<QUEEN>(WHITE) >= 1) ? 1 : 0;
-  if (features[WQ1_EXISTS]) {
-    Square piece_sq = pos.squares<QUEEN>(WHITE)[0];
-    features[WQ1_RANK] = piece_sq/8;
-    features[WQ1_FILE] = piece_sq%8;
-    features[WQ1_MIN_DEFENDER] = pos.simple_min_attacker(piece_sq, WHITE);
-    features[WQ1_MIN_ATTACKER] = pos.simple_min_attacker(piece_sq,BLACK);
-    Bitboard piece_attacks = pos.attacks_from<QUEEN>(piece_sq);
-    features[WQ1_SQUARES] = popcount<Max15>(piece_attacks);
-  }
-
-
-  features[WR1_EXISTS] = (pos.count<ROOK>(WHITE) >= 1) ? 1 : 0;
-  if (features[WR1_EXISTS]) {
-    Square piece_sq = pos.squares<ROOK>(WHITE)[0];
-    features[WR1_RANK] = piece_sq/8;
-    features[WR1_FILE] = piece_sq%8;
-    features[WR1_MIN_DEFENDER] = pos.simple_min_attacker(piece_sq,WHITE);
-    features[WR1_MIN_ATTACKER] = pos.simple_min_attacker(piece_sq,BLACK);
-    Bitboard piece_attacks = pos.attacks_from<ROOK>(piece_sq);
-    features[WR1_SQUARES] = popcount<Max15>(piece_attacks);
-  }
-
-  features[WR2_EXISTS] = (pos.count<ROOK>(WHITE) >= 2) ? 1 : 0;
-  if (features[WR2_EXISTS]) {
-    Square piece_sq = pos.squares<ROOK>(WHITE)[1];
-    features[WR2_RANK] = piece_sq/8;
-    features[WR2_FILE] = piece_sq%8;
-    features[WR2_MIN_DEFENDER] = pos.simple_min_attacker(piece_sq,WHITE);
-    features[WR2_MIN_ATTACKER] = pos.simple_min_attacker(piece_sq,BLACK);
-    Bitboard piece_attacks = pos.attacks_from<ROOK>(piece_sq);
-    features[WR2_SQUARES] = popcount<Max15>(piece_attacks);
-  }
-
-
-  features[WB1_EXISTS] = (pos.count<BISHOP>(WHITE) >= 1) ? 1 : 0;
-  if (features[WB1_EXISTS]) {
-    Square piece_sq = pos.squares<BISHOP>(WHITE)[0];
-    features[WB1_RANK] = piece_sq/8;
-    features[WB1_FILE] = piece_sq%8;
-    features[WB1_MIN_DEFENDER] = pos.simple_min_attacker(piece_sq,WHITE);
-    features[WB1_MIN_ATTACKER] = pos.simple_min_attacker(piece_sq,BLACK);
-    Bitboard piece_attacks = pos.attacks_from<BISHOP>(piece_sq);
-    features[WB1_SQUARES] = popcount<Max15>(piece_attacks);
-  }
-
-  features[WB2_EXISTS] = (pos.count<BISHOP>(WHITE) >= 2) ? 1 : 0;
-  if (features[WB2_EXISTS]) {
-    Square piece_sq = pos.squares<BISHOP>(WHITE)[1];
-    features[WB2_RANK] = piece_sq/8;
-    features[WB2_FILE] = piece_sq%8;
-    features[WB2_MIN_DEFENDER] = pos.simple_min_attacker(piece_sq,WHITE);
-    features[WB2_MIN_ATTACKER] = pos.simple_min_attacker(piece_sq,BLACK);
-    Bitboard piece_attacks = pos.attacks_from<BISHOP>(piece_sq);
-    features[WB2_SQUARES] = popcount<Max15>(piece_attacks);
-  }
-
-
-  features[WK1_EXISTS] = (pos.count<KNIGHT>(WHITE) >= 1) ? 1 : 0;
-  if (features[WK1_EXISTS]) {
-    Square piece_sq = pos.squares<KNIGHT>(WHITE)[0];
-    features[WK1_RANK] = piece_sq/8;
-    features[WK1_FILE] = piece_sq%8;
-    features[WK1_MIN_DEFENDER] = pos.simple_min_attacker(piece_sq,WHITE);
-    features[WK1_MIN_ATTACKER] = pos.simple_min_attacker(piece_sq,BLACK);
-  }
-
-  features[WK2_EXISTS] = (pos.count<KNIGHT>(WHITE) >= 2) ? 1 : 0;
-  if (features[WK2_EXISTS]) {
-    Square piece_sq = pos.squares<KNIGHT>(WHITE)[1];
-    features[WK2_RANK] = piece_sq/8;
-    features[WK2_FILE] = piece_sq%8;
-    features[WK2_MIN_DEFENDER] = pos.simple_min_attacker(piece_sq,WHITE);
-    features[WK2_MIN_ATTACKER] = pos.simple_min_attacker(piece_sq,BLACK);
-  }
-
-
-  features[WP1_EXISTS] = (pos.count<PAWN>(WHITE) >= 1) ? 1 : 0;
-  if (features[WP1_EXISTS]) {
-    Square piece_sq = pos.squares<PAWN>(WHITE)[0];
-    features[WP1_RANK] = piece_sq/8;
-    features[WP1_FILE] = piece_sq%8;
-    features[WP1_MIN_DEFENDER] = pos.simple_min_attacker(piece_sq,WHITE);
-    features[WP1_MIN_ATTACKER] = pos.simple_min_attacker(piece_sq,BLACK);
-  }
-
-  features[WP2_EXISTS] = (pos.count<PAWN>(WHITE) >= 2) ? 1 : 0;
-  if (features[WP2_EXISTS]) {
-    Square piece_sq = pos.squares<PAWN>(WHITE)[1];
-    features[WP2_RANK] = piece_sq/8;
-    features[WP2_FILE] = piece_sq%8;
-    features[WP2_MIN_DEFENDER] = pos.simple_min_attacker(piece_sq,WHITE);
-    features[WP2_MIN_ATTACKER] = pos.simple_min_attacker(piece_sq,BLACK);
-  }
-
-  features[WP3_EXISTS] = (pos.count<PAWN>(WHITE) >= 3) ? 1 : 0;
-  if (features[WP3_EXISTS]) {
-    Square piece_sq = pos.squares<PAWN>(WHITE)[2];
-    features[WP3_RANK] = piece_sq/8;
-    features[WP3_FILE] = piece_sq%8;
-    features[WP3_MIN_DEFENDER] = pos.simple_min_attacker(piece_sq,WHITE);
-    features[WP3_MIN_ATTACKER] = pos.simple_min_attacker(piece_sq,BLACK);
-  }
-
-  features[WP4_EXISTS] = (pos.count<PAWN>(WHITE) >= 4) ? 1 : 0;
-  if (features[WP4_EXISTS]) {
-    Square piece_sq = pos.squares<PAWN>(WHITE)[3];
-    features[WP4_RANK] = piece_sq/8;
-    features[WP4_FILE] = piece_sq%8;
-    features[WP4_MIN_DEFENDER] = pos.simple_min_attacker(piece_sq,WHITE);
-    features[WP4_MIN_ATTACKER] = pos.simple_min_attacker(piece_sq,BLACK);
-  }
-
-  features[WP5_EXISTS] = (pos.count<PAWN>(WHITE) >= 5) ? 1 : 0;
-  if (features[WP5_EXISTS]) {
-    Square piece_sq = pos.squares<PAWN>(WHITE)[4];
-    features[WP5_RANK] = piece_sq/8;
-    features[WP5_FILE] = piece_sq%8;
-    features[WP5_MIN_DEFENDER] = pos.simple_min_attacker(piece_sq,WHITE);
-    features[WP5_MIN_ATTACKER] = pos.simple_min_attacker(piece_sq,BLACK);
-  }
-
-  features[WP6_EXISTS] = (pos.count<PAWN>(WHITE) >= 6) ? 1 : 0;
-  if (features[WP6_EXISTS]) {
-    Square piece_sq = pos.squares<PAWN>(WHITE)[5];
-    features[WP6_RANK] = piece_sq/8;
-    features[WP6_FILE] = piece_sq%8;
-    features[WP6_MIN_DEFENDER] = pos.simple_min_attacker(piece_sq,WHITE);
-    features[WP6_MIN_ATTACKER] = pos.simple_min_attacker(piece_sq,BLACK);
-  }
-
-  features[WP7_EXISTS] = (pos.count<PAWN>(WHITE) >= 7) ? 1 : 0;
-  if (features[WP7_EXISTS]) {
-    Square piece_sq = pos.squares<PAWN>(WHITE)[6];
-    features[WP7_RANK] = piece_sq/8;
-    features[WP7_FILE] = piece_sq%8;
-    features[WP7_MIN_DEFENDER] = pos.simple_min_attacker(piece_sq,WHITE);
-    features[WP7_MIN_ATTACKER] = pos.simple_min_attacker(piece_sq,BLACK);
-  }
-
-  features[WP8_EXISTS] = (pos.count<PAWN>(WHITE) >= 8) ? 1 : 0;
-  if (features[WP8_EXISTS]) {
-    Square piece_sq = pos.squares<PAWN>(WHITE)[7];
-    features[WP8_RANK] = piece_sq/8;
-    features[WP8_FILE] = piece_sq%8;
-    features[WP8_MIN_DEFENDER] = pos.simple_min_attacker(piece_sq,WHITE);
-    features[WP8_MIN_ATTACKER] = pos.simple_min_attacker(piece_sq,BLACK);
-  }
-
-
-
-  features[BQ1_EXISTS] = (pos.count<QUEEN>(BLACK) >= 1) ? 1 : 0;
-  if (features[BQ1_EXISTS]) {
-    Square piece_sq = pos.squares<QUEEN>(BLACK)[0];
-    features[BQ1_RANK] = piece_sq/8;
-    features[BQ1_FILE] = piece_sq%8;
-    features[BQ1_MIN_DEFENDER] = pos.simple_min_attacker(piece_sq,BLACK);
-    features[BQ1_MIN_ATTACKER] = pos.simple_min_attacker(piece_sq,WHITE);
-    Bitboard piece_attacks = pos.attacks_from<QUEEN>(piece_sq);
-    features[BQ1_SQUARES] = popcount<Max15>(piece_attacks);
-  }
-
-
-  features[BR1_EXISTS] = (pos.count<ROOK>(BLACK) >= 1) ? 1 : 0;
-  if (features[BR1_EXISTS]) {
-    Square piece_sq = pos.squares<ROOK>(BLACK)[0];
-    features[BR1_RANK] = piece_sq/8;
-    features[BR1_FILE] = piece_sq%8;
-    features[BR1_MIN_DEFENDER] = pos.simple_min_attacker(piece_sq,BLACK);
-    features[BR1_MIN_ATTACKER] = pos.simple_min_attacker(piece_sq,WHITE);
-    Bitboard piece_attacks = pos.attacks_from<ROOK>(piece_sq);
-    features[BR1_SQUARES] = popcount<Max15>(piece_attacks);
-  }
+  Bitboard b = 0;
+  for (const Square* s = pos.squares<Pt>(c); *s != SQ_NONE; ++s)
+    b |= pos.attacks_from<Pt>(*s);
+  return b;
+}
 
-  features[BR2_EXISTS] = (pos.count<ROOK>(BLACK) >= 2) ? 1 : 0;
-  if (features[BR2_EXISTS]) {
-    Square piece_sq = pos.squares<ROOK>(BLACK)[1];
-    features[BR2_RANK] = piece_sq/8;
-    features[BR2_FILE] = piece_sq%8;
-    features[BR2_MIN_DEFENDER] = pos.simple_min_attacker(piece_sq,BLACK);
-    features[BR2_MIN_ATTACKER] = pos.simple_min_attacker(piece_sq,WHITE);
-    Bitboard piece_attacks = pos.attacks_from<ROOK>(piece_sq);
-    features[BR2_SQUARES] = popcount<Max15>(piece_attacks);
+//map[s] = pt for each square s of b, the other entries are left as they are
+inline void expand(Bitboard b, int pt, int * map)
+{
+#if defined(USE_AVX2)
+  //one bit of a byte of b per lane, eight squares at a time
+  const __m256i bits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+  const __m256i value = _mm256_set1_epi32(pt);
+  for (int i = 0; i < 64; i += 8)
+  {
+    const int byte = int((b >> i) & 0xFF);
+    if (!byte)
+      continue;
+    __m256i in = _mm256_and_si256(_mm256_set1_epi32(byte), bits);
+    __m256i mask = _mm256_cmpeq_epi32(in, bits);
+    __m256i * dst = (__m256i*)(map + i);
+    _mm256_storeu_si256(dst, _mm256_blendv_epi8(_mm256_loadu_si256(dst), value, mask));
   }
+#else
+  while (b)
+    map[pop_lsb(&b)] = pt;
+#endif
+}
 
+//the least valuable attacker of color c of every square, the same as Position::simple_min_attacker
+//for each of them. The attacks of each piece type are computed once, then laid over each other from
+//the king down to the pawns, so every square ends up with the least valuable type attacking it.
+void min_attacker_map(const Position& pos, Color c, int * map)
+{
+  std::memset(map, 0, int(SQUARE_NB) * sizeof(int));
+  Bitboard pawns = pos.pieces(c, PAWN);
+  expand(pos.attacks_from<KING>(pos.square<KING>(c)), KING, map);
+  expand(attacks_by<QUEEN>(pos, c), QUEEN, map);
+  expand(attacks_by<ROOK>(pos, c), ROOK, map);
+  expand(attacks_by<BISHOP>(pos, c), BISHOP, map);
+  expand(attacks_by<KNIGHT>(pos, c), KNIGHT, map);
+  expand(c == WHITE ? shift_bb<DELTA_NE>(pawns) | shift_bb<DELTA_NW>(pawns)
+                    : shift_bb<DELTA_SE>(pawns) | shift_bb<DELTA_SW>(pawns), PAWN, map);
+#ifndef NDEBUG
+  for (Square s = SQ_A1; s <= SQ_H8; ++s)
+    assert(map[s] == pos.simple_min_attacker(s, c));
+#endif
+}
 
-  features[BB1_EXISTS] = (pos.count<BISHOP>(BLACK) >= 1) ? 1 : 0;
-  if (features[BB1_EXISTS]) {
-    Square piece_sq = pos.squares<BISHOP>(BLACK)[0];
-    features[BB1_RANK] = piece_sq/8;
-    features[BB1_FILE] = piece_sq%8;
-    features[BB1_MIN_DEFENDER] = pos.simple_min_attacker(piece_sq,BLACK);
-    features[BB1_MIN_ATTACKER] = pos.simple_min_attacker(piece_sq,WHITE);
-    Bitboard piece_attacks = pos.attacks_from<BISHOP>(piece_sq);
-    features[BB1_SQUARES] = popcount<Max15>(piece_attacks);
-  }
-
-  features[BB2_EXISTS] = (pos.count<BISHOP>(BLACK) >= 2) ? 1 : 0;
-  if (features[BB2_EXISTS]) {
-    Square piece_sq = pos.squares<BISHOP>(BLACK)[1];
-    features[BB2_RANK] = piece_sq/8;
-    features[BB2_FILE] = piece_sq%8;
-    features[BB2_MIN_DEFENDER] = pos.simple_min_attacker(piece_sq,BLACK);
-    features[BB2_MIN_ATTACKER] = pos.simple_min_attacker(piece_sq,WHITE);
-    Bitboard piece_attacks = pos.attacks_from<BISHOP>(piece_sq);
-    features[BB2_SQUARES] = popcount<Max15>(piece_attacks);
-  }
+enum FeatureParts { BOARD_FEATURES = 1, ATTACK_FEATURES = 2, ALL_FEATURES = BOARD_FEATURES | ATTACK_FEATURES };
 
+//the features of slot I and the following ones of the pieces of type Pt and color C: existence and
+//coordinates, least valuable defender and attacker, and mobility for sliders. Empty slots get zeros.
+//map[c] is the min_attacker_map of color c.
+template<typename Layout, int Parts, Color C, PieceType Pt, int I = 0, bool Done = (I >= Analyze::SlotCount[Pt])>
+struct SlotFeatures {
+  template<typename T>
+  static void write(const Position& pos, const int map[COLOR_NB][SQUARE_NB], T * features)
+  {
+    const Color stm = pos.side_to_move();
+    const int f = Analyze::SlotBase[Layout::color(stm, C)][Pt] + I * Analyze::SlotSize[Pt];
+    const bool exists = I < pos.count<Pt>(C);
+    const Square s = exists ? pos.squares<Pt>(C)[I] : SQ_A1;
 
-  features[BK1_EXISTS] = (pos.count<KNIGHT>(BLACK) >= 1) ? 1 : 0;
-  if (features[BK1_EXISTS]) {
-    Square piece_sq = pos.squares<KNIGHT>(BLACK)[0];
-    features[BK1_RANK] = piece_sq/8;
-    features[BK1_FILE] = piece_sq%8;
-    features[BK1_MIN_DEFENDER] = pos.simple_min_attacker(piece_sq,BLACK);
-    features[BK1_MIN_ATTACKER] = pos.simple_min_attacker(piece_sq,WHITE);
+    if (Parts & BOARD_FEATURES)
+    {
+      const Square fs = Layout::square(stm, s);
+      features[f + Analyze::SLOT_EXISTS] = exists;
+      features[f + Analyze::SLOT_RANK] = exists ? fs / 8 : 0;
+      features[f + Analyze::SLOT_FILE] = exists ? fs % 8 : 0;
+    }
+    if (Parts & ATTACK_FEATURES)
+    {
+      features[f + Analyze::SLOT_MIN_DEFENDER] = exists ? map[C][s] : 0;
+      features[f + Analyze::SLOT_MIN_ATTACKER] = exists ? map[~C][s] : 0;
+      if (Analyze::SlotSize[Pt] > Analyze::SLOT_SQUARES)
+        features[f + Analyze::SLOT_SQUARES] = exists ? popcount<Max15>(pos.attacks_from<Pt>(s)) : 0;
+    }
+    SlotFeatures<Layout, Parts, C, Pt, I + 1>::write(pos, map, features);
   }
+};
 
-  features[BK2_EXISTS] = (pos.count<KNIGHT>(BLACK) >= 2) ? 1 : 0;
-  if (features[BK2_EXISTS]) {
-    Square piece_sq = pos.squares<KNIGHT>(BLACK)[1];
-    features[BK2_RANK] = piece_sq/8;
-    features[BK2_FILE] = piece_sq%8;
-    features[BK2_MIN_DEFENDER] = pos.simple_min_attacker(piece_sq,BLACK);
-    features[BK2_MIN_ATTACKER] = pos.simple_min_attacker(piece_sq,WHITE);
-  }
+template<typename Layout, int Parts, Color C, PieceType Pt, int I>
+struct SlotFeatures<Layout, Parts, C, Pt, I, true> {
+  template<typename T>
+  static void write(const Position&, const int[COLOR_NB][SQUARE_NB], T *) {}
+};
 
+//the features of the pieces of color C: material, king coordinates, the slots and the pawns per file
+template<typename Layout, int Parts, Color C, typename T>
+void color_features(const Position& pos, const int map[COLOR_NB][SQUARE_NB], T * features)
+{
+  const Color stm = pos.side_to_move();
+  const Color fc = Layout::color(stm, C);
 
-  features[BP1_EXISTS] = (pos.count<PAWN>(BLACK) >= 1) ? 1 : 0;
-  if (features[BP1_EXISTS]) {
-    Square piece_sq = pos.squares<PAWN>(BLACK)[0];
-    features[BP1_RANK] = piece_sq/8;
-    features[BP1_FILE] = piece_sq%8;
-    features[BP1_MIN_DEFENDER] = pos.simple_min_attacker(piece_sq,BLACK);
-    features[BP1_MIN_ATTACKER] = pos.simple_min_attacker(piece_sq,WHITE);
+  if (Parts & BOARD_FEATURES)
+  {
+    features[Analyze::CountFeature[fc][QUEEN]] = pos.count<QUEEN>(C);
+    features[Analyze::CountFeature[fc][ROOK]] = pos.count<ROOK>(C);
+    features[Analyze::CountFeature[fc][BISHOP]] = pos.count<BISHOP>(C);
+    features[Analyze::CountFeature[fc][KNIGHT]] = pos.count<KNIGHT>(C);
+    features[Analyze::CountFeature[fc][PAWN]] = pos.count<PAWN>(C);
+
+    const Square ksq = Layout::square(stm, pos.square<KING>(C));
+    features[fc == WHITE ? Analyze::WK_RANK : Analyze::BK_RANK] = ksq / 8;
+    features[fc == WHITE ? Analyze::WK_FILE : Analyze::BK_FILE] = ksq % 8;
+
+    //flipping the board keeps the files
+    const Bitboard pawns = pos.pieces(C, PAWN);
+    for (File f = FILE_A; f <= FILE_H; ++f)
+      features[Analyze::PawnFileBase[fc] + f] = popcount<Max15>(pawns & file_bb(f));
   }
 
-  features[BP2_EXISTS] = (pos.count<PAWN>(BLACK) >= 2) ? 1 : 0;
-  if (features[BP2_EXISTS]) {
-    Square piece_sq = pos.squares<PAWN>(BLACK)[1];
-    features[BP2_RANK] = piece_sq/8;
-    features[BP2_FILE] = piece_sq%8;
-    features[BP2_MIN_DEFENDER] = pos.simple_min_attacker(piece_sq,BLACK);
-    features[BP2_MIN_ATTACKER] = pos.simple_min_attacker(piece_sq,WHITE);
-  }
+  SlotFeatures<Layout, Parts, C, QUEEN>::write(pos, map, features);
+  SlotFeatures<Layout, Parts, C, ROOK>::write(pos, map, features);
+  SlotFeatures<Layout, Parts, C, BISHOP>::write(pos, map, features);
+  SlotFeatures<Layout, Parts, C, KNIGHT>::write(pos, map, features);
+  SlotFeatures<Layout, Parts, C, PAWN>::write(pos, map, features);
+}
 
-  features[BP3_EXISTS] = (pos.count<PAWN>(BLACK) >= 3) ? 1 : 0;
-  if (features[BP3_EXISTS]) {
-    Square piece_sq = pos.squares<PAWN>(BLACK)[2];
-    features[BP3_RANK] = piece_sq/8;
-    features[BP3_FILE] = piece_sq%8;
-    features[BP3_MIN_DEFENDER] = pos.simple_min_attacker(piece_sq,BLACK);
-    features[BP3_MIN_ATTACKER] = pos.simple_min_attacker(piece_sq,WHITE);
-  }
+//write the given parts of the feature vector of pos in the given layout, the other parts are left as they are
+template<typename Layout, int Parts, typename T>
+void extract_features(const Position& pos, T * features)
+{
+  const Color stm = pos.side_to_move();
+  int map[COLOR_NB][SQUARE_NB];
 
-  features[BP4_EXISTS] = (pos.count<PAWN>(BLACK) >= 4) ? 1 : 0;
-  if (features[BP4_EXISTS]) {
-    Square piece_sq = pos.squares<PAWN>(BLACK)[3];
-    features[BP4_RANK] = piece_sq/8;
-    features[BP4_FILE] = piece_sq%8;
-    features[BP4_MIN_DEFENDER] = pos.simple_min_attacker(piece_sq,BLACK);
-    features[BP4_MIN_ATTACKER] = pos.simple_min_attacker(piece_sq,WHITE);
+  if (Parts & ATTACK_FEATURES)
+  {
+    min_attacker_map(pos, WHITE, map[WHITE]);
+    min_attacker_map(pos, BLACK, map[BLACK]);
   }
 
-  features[BP5_EXISTS] = (pos.count<PAWN>(BLACK) >= 5) ? 1 : 0;
-  if (features[BP5_EXISTS]) {
-    Square piece_sq = pos.squares<PAWN>(BLACK)[4];
-    features[BP5_RANK] = piece_sq/8;
-    features[BP5_FILE] = piece_sq%8;
-    features[BP5_MIN_DEFENDER] = pos.simple_min_attacker(piece_sq,BLACK);
-    features[BP5_MIN_ATTACKER] = pos.simple_min_attacker(piece_sq,WHITE);
+  if (Parts & BOARD_FEATURES)
+  {
+    //tempo and castling rights, the layout maps the colors both ways
+    features[Analyze::SIDE_TO_MOVE] = Layout::color(stm, stm);
+    const Color w = Layout::color(stm, WHITE), b = ~w;
+    features[Analyze::WCASTLE_OO]  = pos.can_castle(w | KING_SIDE) != 0;
+    features[Analyze::WCASTLE_OOO] = pos.can_castle(w | QUEEN_SIDE) != 0;
+    features[Analyze::BCASTLE_OO]  = pos.can_castle(b | KING_SIDE) != 0;
+    features[Analyze::BCASTLE_OOO] = pos.can_castle(b | QUEEN_SIDE) != 0;
   }
 
-  features[BP6_EXISTS] = (pos.count<PAWN>(BLACK) >= 6) ? 1 : 0;
-  if (features[BP6_EXISTS]) {
-    Square piece_sq = pos.squares<PAWN>(BLACK)[5];
-    features[BP6_RANK] = piece_sq/8;
-    features[BP6_FILE] = piece_sq%8;
-    features[BP6_MIN_DEFENDER] = pos.simple_min_attacker(piece_sq,BLACK);
-    features[BP6_MIN_ATTACKER] = pos.simple_min_attacker(piece_sq,WHITE);
-  }
+  color_features<Layout, Parts, WHITE>(pos, map, features);
+  color_features<Layout, Parts, BLACK>(pos, map, features);
 
-  features[BP7_EXISTS] = (pos.count<PAWN>(BLACK) >= 7) ? 1 : 0;
-  if (features[BP7_EXISTS]) {
-    Square piece_sq = pos.squares<PAWN>(BLACK)[6];
-    features[BP7_RANK] = piece_sq/8;
-    features[BP7_FILE] = piece_sq%8;
-    features[BP7_MIN_DEFENDER] = pos.simple_min_attacker(piece_sq,BLACK);
-    features[BP7_MIN_ATTACKER] = pos.simple_min_attacker(piece_sq,WHITE);
-  }
+  //square-centric information: the attack and defend maps
+  if (Parts & ATTACK_FEATURES)
+    for (Square s = SQ_A1; s <= SQ_H8; ++s)
+    {
+      const Square fs = Layout::square(stm, s);
+      features[Analyze::ATTACK_SQUARE_OFF + fs] = map[~stm][s];
+      features[Analyze::DEFEND_SQUARE_OFF + fs] = map[stm][s];
+    }
+}
 
-  features[BP8_EXISTS] = (pos.count<PAWN>(BLACK) >= 8) ? 1 : 0;
-  if (features[BP8_EXISTS]) {
-    Square piece_sq = pos.squares<PAWN>(BLACK)[7];
-    features[BP8_RANK] = piece_sq/8;
-    features[BP8_FILE] = piece_sq%8;
-    features[BP8_MIN_DEFENDER] = pos.simple_min_attacker(piece_sq,BLACK);
-    features[BP8_MIN_ATTACKER] = pos.simple_min_attacker(piece_sq,WHITE);
-  }
+}
 
+//extract a feature representation from the position pos
 
+//utility function to convert Stockfish's internal feature representation into a feature vector I can use to train Katusha.
+// NOTE: this feature representation is based on that used by Giraffe, with some tweaks.
+//features is the array in which to store the result, every feature gets written
+template<typename T>
+void Analyze::Katyusha_pos_rep(const Position& pos, T * features)
+{
+  extract_features<FeatureLayout, ALL_FEATURES>(pos, features);
+}
 
+template void Analyze::Katyusha_pos_rep<int>(const Position& pos, int * features);
+template void Analyze::Katyusha_pos_rep<int16_t>(const Position& pos, int16_t * features);
+template void Analyze::Katyusha_pos_rep<float>(const Position& pos, float * features);
 
+//the nonzero features of the position, in order
+void Analyze::Katyusha_sparse_rep(const Position& pos, SparseFeatures& sf)
+{
+  int16_t features[NB_FEATURES];
+  Katyusha_pos_rep(pos, features);
+  to_sparse(features, sf);
+}
 
-  //square-centric information
-  //attack and defend maps
-  Square sq;
-  for (sq = SQ_A1;  sq <= SQ_H8; ++sq)
-  {
-    features[ATTACK_SQUARE_OFF+sq] = pos.simple_min_attacker(sq, ~side);
-  }
+//time Katyusha_pos_rep on the positions of random games, to compare feature extractors
+void Analyze::bench_features(std::istringstream& is)
+{
+  int passes;
+  if (!(is >> passes)) passes = 200;
 
-  for (sq = SQ_A1;  sq <= SQ_H8; ++sq)
+  PRNG rng(20161017);
+  deque<Position> positions;
+  for (int g = 0; g < 32; g++)
   {
-    features[DEFEND_SQUARE_OFF+sq] = pos.simple_min_attacker(sq, side);
+    Position pos(StartFEN, false, Threads.main());
+    StateInfo st[80];
+    for (int ply = 0; ply < 80; ply++)
+    {
+      MoveList<LEGAL> moves(pos);
+      if (!moves.size())
+        break;
+      Move m = *(moves.begin() + rng.rand<unsigned>() % moves.size());
+      pos.do_move(m, st[ply], pos.gives_check(m, CheckInfo(pos)));
+      positions.emplace_back(pos.fen(), false, Threads.main());
+    }
   }
 
-  //file-based pawn information
-  //for each file, count how many white pawns are on that file, and how many black pawns
-  File pfile;
-  Bitboard wpawns = pos.pieces(WHITE, PAWN);
-  Bitboard bpawns = pos.pieces(BLACK, PAWN);
-  for (pfile = FILE_A; pfile <= FILE_H; ++pfile)
+  //the checksum hashes every feature, so extractors that should agree can be checked against each other
+  int features[NB_FEATURES];
+  uint64_t checksum = 0;
+  for (const Position& pos : positions)
   {
-    features[WHITE_PAWN_FILE+pfile] = popcount<Max15>(wpawns&file_bb(pfile));
-    features[BLACK_PAWN_FILE+pfile] = popcount<Max15>(bpawns&file_bb(pfile));
+    Katyusha_pos_rep(pos, features);
+    for (int i = 0; i < NB_FEATURES; i++)
+      checksum = checksum * 31 + uint64_t(features[i] + 1);
   }
 
+  //summing a feature of each pass keeps the extraction from being optimized away
+  int64_t sink = 0;
+  TimePoint start = now();
+  for (int p = 0; p < passes; p++)
+    for (const Position& pos : positions)
+    {
+      Katyusha_pos_rep(pos, features);
+      sink += features[p % NB_FEATURES];
+    }
+  double elapsed = double(now() - start + 1);
+  double n = double(passes) * positions.size();
+
+  sync_cout << "Positions: " << n
+            << "\nTime (ms): " << elapsed
+            << "\nns/position: " << elapsed * 1e6 / n
+            << "\nChecksum: " << checksum
+            << (sink < 0 ? "\n" : "") << sync_endl;
+}
 
+//fill in the features that depend on attacks, the rest of the vector is left as is
+//together with Position::board_features() this gives the same vector as Katyusha_pos_rep
+void Analyze::Katyusha_attack_features(const Position& pos, int * features)
+{
+  extract_features<FeatureLayout, ATTACK_FEATURES>(pos, features);
 }
@@ -742,11 +742,33 @@ namespace {
     return sf;
   }
 
+
+  // evaluate_network() returns Katyusha's score from the point of view of the
+  // side to move. No classical term is computed: the material entry is probed
+  // only to hand positions with a specialized endgame evaluator over to it, and
+  // only when that is enabled with the Katyusha_Endgames option.
+
+  Value evaluate_network(const Position& pos) {
+
+    if (KatyushaEngine::use_endgames())
+    {
+        Material::Entry* me = Material::probe(pos);
+
+        if (me->specialized_eval_exists())
+            return me->evaluate(pos);
+    }
+
+    Value v = KatyushaEngine::evaluate(pos);
+    return (pos.side_to_move() == WHITE ? v : -v) + Eval::Tempo;
+  }
+
 } // namespace
 
 
 /// evaluate() is the main evaluation function. It returns a static evaluation
-/// of the position from the point of view of the side to move.
+/// of the position from the point of view of the side to move. When Katyusha
+/// is active the search gets the network's score straight away; only a trace
+/// still runs the classical terms, to fill in the table printed by trace().
 
 template<bool DoTrace>
 Value Eval::evaluate(const Position& pos) {
@@ -754,6 +776,9 @@ Value Eval::evaluate(const Position& pos) {
 //  cout << "pos checkers " << pos.checkers() << endl;
   assert(!pos.checkers());
 
+  if (!DoTrace && KatyushaEngine::engine_active())
+      return evaluate_network(pos);
+
   EvalInfo ei;
   Score score, mobility[COLOR_NB] = { SCORE_ZERO, SCORE_ZERO };
 
@@ -849,7 +874,7 @@ Value Eval::evaluate(const Position& pos) {
                       , evaluate_space<BLACK>(pos, ei) * Weights[Space]);
       Trace::add(TOTAL, score);
   }
-  if (KatyushaEngine::engine_active()) v = KatyushaEngine::evaluate(pos);
+  if (DoTrace && KatyushaEngine::engine_active()) v = KatyushaEngine::evaluate(pos);
   return (pos.side_to_move() == WHITE ? v : -v) + Eval::Tempo; // Side to move point of view
 }
 
@@ -70,6 +70,8 @@ typedef Stats<Value, false> HistoryStats;
 typedef Stats<Value,  true> CounterMovesStats;
 typedef Stats<CounterMovesStats> CounterMovesHistoryStats;
 
+extern CounterMovesHistoryStats CounterMovesHistory; // Shared by the search threads
+
 
 /// MovePicker class is used to pick one pseudo legal move at a time from the
 /// current position. The most important method is next_move(), which returns a
@@ -23,8 +23,10 @@
 #include <cstring>   // For std::memset, std::memcmp
 #include <iomanip>
 #include <sstream>
+#include <type_traits>
 
 #include "bitcount.h"
+#include "KatyushaEngine.h"
 #include "misc.h"
 #include "movegen.h"
 #include "position.h"
@@ -171,6 +173,7 @@ Position& Position::operator=(const Position& pos) {
   std::memcpy(this, &pos, sizeof(Position));
   std::memcpy(&startState, st, sizeof(StateInfo));
   st = &startState;
+  st->accumulatorVersion = 0; // The accumulator slot is the copied state's
   nodes = 0;
 
   assert(pos_is_ok());
@@ -310,6 +313,8 @@ void Position::set(const string& fenStr, bool isChess960, Thread* th) {
   chess960 = isChess960;
   thisThread = th;
   set_state(st);
+  compute_features(boardFeatures);
+  katyushaFeatures = KatyushaEngine::engine_active();
 
   assert(pos_is_ok());
 }
@@ -388,6 +393,90 @@ void Position::set_state(StateInfo* si) const {
 }
 
 
+/// Position::write_features() passes the Katyusha board features of the pieces
+/// of color c and type pt to set(feature, value): their number, the existence
+/// and coordinates of each slot and, for pawns, the number of pawns per file.
+
+template<typename Set>
+void Position::write_features(Color c, PieceType pt, Set set) const {
+
+  static_assert(std::is_same<Analyze::FeatureLayout, Analyze::AbsoluteLayout>::value,
+                "The incremental board features are only kept in the absolute layout");
+
+  using namespace Analyze;
+
+  if (pt == KING)
+  {
+      Square ksq = square<KING>(c);
+      set(c == WHITE ? WK_RANK : BK_RANK, ksq / 8);
+      set(c == WHITE ? WK_FILE : BK_FILE, ksq % 8);
+      return;
+  }
+
+  set(CountFeature[c][pt], pieceCount[c][pt]);
+
+  for (int i = 0; i < SlotCount[pt]; ++i)
+  {
+      int f = SlotBase[c][pt] + i * SlotSize[pt];
+      bool exists = i < pieceCount[c][pt];
+      Square s = exists ? pieceList[c][pt][i] : SQ_A1;
+
+      set(f + SLOT_EXISTS, exists);
+      set(f + SLOT_RANK, s / 8);
+      set(f + SLOT_FILE, s % 8);
+  }
+
+  if (pt == PAWN)
+      for (File f = FILE_A; f <= FILE_H; ++f)
+          set(PawnFileBase[c] + f, popcount<Max15>(pieces(c, PAWN) & file_bb(f)));
+}
+
+
+/// Position::compute_features() computes the Katyusha board features from
+/// scratch. The features that depend on attacks are left to zero.
+
+void Position::compute_features(int8_t* features) const {
+
+  using namespace Analyze;
+
+  std::memset(features, 0, NB_FEATURES);
+  auto set = [&](int f, int v) { features[f] = int8_t(v); };
+
+  set(SIDE_TO_MOVE, sideToMove);
+  set(WCASTLE_OO,  can_castle(WHITE_OO)  != 0);
+  set(WCASTLE_OOO, can_castle(WHITE_OOO) != 0);
+  set(BCASTLE_OO,  can_castle(BLACK_OO)  != 0);
+  set(BCASTLE_OOO, can_castle(BLACK_OOO) != 0);
+
+  for (Color c = WHITE; c <= BLACK; ++c)
+      for (PieceType pt = PAWN; pt <= KING; ++pt)
+          write_features(c, pt, set);
+}
+
+
+/// Position::set_feature() changes a board feature and records the change in
+/// the current StateInfo. update_features() does it for all the features of
+/// one piece list, only the values that actually changed get recorded.
+
+void Position::set_feature(int f, int v) {
+
+  if (boardFeatures[f] != v)
+  {
+      assert(st->featureChanges < Analyze::MAX_FEATURE_CHANGES);
+
+      Analyze::FeatureChange& fc = st->changedFeatures[st->featureChanges++];
+      fc.index = uint16_t(f);
+      fc.from = boardFeatures[f];
+      fc.to = boardFeatures[f] = int8_t(v);
+  }
+}
+
+void Position::update_features(Color c, PieceType pt) {
+
+  write_features(c, pt, [this](int f, int v) { set_feature(f, v); });
+}
+
+
 /// Position::fen() returns a FEN representation of the position. In case of
 /// Chess960 the Shredder-FEN notation is used. This is mainly a debugging function.
 
@@ -703,6 +792,7 @@ void Position::do_move(Move m, StateInfo& newSt, bool givesCheck) {
   std::memcpy(&newSt, st, offsetof(StateInfo, key));
   newSt.previous = st;
   st = &newSt;
+  ++st->accumulatorPly;
 
   // Increment ply counters. In particular, rule50 will be reset to zero later on
   // in case of a capture or a pawn move.
@@ -760,6 +850,7 @@ void Position::do_move(Move m, StateInfo& newSt, bool givesCheck) {
           st->nonPawnMaterial[them] -= PieceValue[MG][captured];
 
       // Update board and piece lists
+      st->capturedIndex = index[capsq];
       remove_piece(them, captured, capsq);
 
       // Update material hash key and prefetch access to materialTable
@@ -814,6 +905,7 @@ void Position::do_move(Move m, StateInfo& newSt, bool givesCheck) {
           assert(relative_rank(us, to) == RANK_8);
           assert(promotion >= KNIGHT && promotion <= QUEEN);
 
+          st->ownIndex = index[to];
           remove_piece(us, PAWN, to);
           put_piece(us, promotion, to);
 
@@ -850,6 +942,33 @@ void Position::do_move(Move m, StateInfo& newSt, bool givesCheck) {
   // Calculate checkers bitboard (if move gives check)
   st->checkersBB = givesCheck ? attackers_to(square<KING>(them)) & pieces(us) : 0;
 
+  // Update Katyusha's board features for the piece lists touched by the move
+  st->accumulatorVersion = 0;
+  st->featureChanges = 0;
+  if (katyushaFeatures)
+  {
+      set_feature(Analyze::SIDE_TO_MOVE, them);
+
+      if (st->castlingRights != st->previous->castlingRights)
+      {
+          set_feature(Analyze::WCASTLE_OO,  can_castle(WHITE_OO)  != 0);
+          set_feature(Analyze::WCASTLE_OOO, can_castle(WHITE_OOO) != 0);
+          set_feature(Analyze::BCASTLE_OO,  can_castle(BLACK_OO)  != 0);
+          set_feature(Analyze::BCASTLE_OOO, can_castle(BLACK_OOO) != 0);
+      }
+
+      update_features(us, pt);
+
+      if (type_of(m) == CASTLING)
+          update_features(us, ROOK);
+
+      if (type_of(m) == PROMOTION)
+          update_features(us, promotion_type(m));
+
+      if (captured)
+          update_features(them, captured);
+  }
+
   sideToMove = ~sideToMove;
 
   assert(pos_is_ok());
@@ -880,7 +999,7 @@ void Position::undo_move(Move m) {
       assert(pt >= KNIGHT && pt <= QUEEN);
 
       remove_piece(us, pt, to);
-      put_piece(us, PAWN, to);
+      put_piece(us, PAWN, to, st->ownIndex);
       pt = PAWN;
   }
 
@@ -908,10 +1027,14 @@ void Position::undo_move(Move m) {
               assert(st->capturedType == PAWN);
           }
 
-          put_piece(~us, st->capturedType, capsq); // Restore the captured piece
+          put_piece(~us, st->capturedType, capsq, st->capturedIndex); // Restore the captured piece
       }
   }
 
+  // Restore the board features changed by the move
+  for (int i = st->featureChanges - 1; i >= 0; --i)
+      boardFeatures[st->changedFeatures[i].index] = st->changedFeatures[i].from;
+
   // Finally point our state pointer back to the previous state
   st = st->previous;
   --gamePly;
@@ -931,11 +1054,16 @@ void Position::do_castling(Color us, Square from, Square& to, Square& rfrom, Squ
   to = relative_square(us, kingSide ? SQ_G1 : SQ_C1);
 
   // Remove both pieces first since squares could overlap in Chess960
+  if (Do)
+      st->ownIndex = index[rfrom];
   remove_piece(us, KING, Do ? from : to);
   remove_piece(us, ROOK, Do ? rfrom : rto);
   board[Do ? from : to] = board[Do ? rfrom : rto] = NO_PIECE; // Since remove_piece doesn't do it for us
   put_piece(us, KING, Do ? to : from);
-  put_piece(us, ROOK, Do ? rto : rfrom);
+  if (Do)
+      put_piece(us, ROOK, rto);
+  else
+      put_piece(us, ROOK, rfrom, st->ownIndex);
 }
 
 
@@ -947,9 +1075,10 @@ void Position::do_null_move(StateInfo& newSt) {
   assert(!checkers());
   assert(&newSt != st);
 
-  std::memcpy(&newSt, st, sizeof(StateInfo));
+  std::memcpy(&newSt, st, offsetof(StateInfo, accumulatorVersion));
   newSt.previous = st;
   st = &newSt;
+  ++st->accumulatorPly;
 
   if (st->epSquare != SQ_NONE)
   {
@@ -963,6 +1092,11 @@ void Position::do_null_move(StateInfo& newSt) {
   ++st->rule50;
   st->pliesFromNull = 0;
 
+  st->accumulatorVersion = 0;
+  st->featureChanges = 0;
+  if (katyushaFeatures)
+      set_feature(Analyze::SIDE_TO_MOVE, ~sideToMove);
+
   sideToMove = ~sideToMove;
 
   assert(pos_is_ok());
@@ -972,6 +1106,8 @@ void Position::undo_null_move() {
 
   assert(!checkers());
 
+  if (st->featureChanges)
+      boardFeatures[Analyze::SIDE_TO_MOVE] = st->changedFeatures[0].from;
   st = st->previous;
   sideToMove = ~sideToMove;
 }
@@ -1146,9 +1282,9 @@ bool Position::pos_is_ok(int* failedStep) const {
 
   const bool Fast = true; // Quick (default) or full check?
 
-  enum { Default, King, Bitboards, State, Lists, Castling };
+  enum { Default, King, Bitboards, State, Lists, Castling, Features };
 
-  for (int step = Default; step <= (Fast ? Default : Castling); step++)
+  for (int step = Default; step <= (Fast ? Default : Features); step++)
   {
       if (failedStep)
           *failedStep = step;
@@ -1212,6 +1348,14 @@ bool Position::pos_is_ok(int* failedStep) const {
                       ||(castlingRightsMask[square<KING>(c)] & (c | s)) != (c | s))
                       return false;
               }
+
+      if (step == Features && katyushaFeatures)
+      {
+          int8_t features[Analyze::NB_FEATURES];
+          compute_features(features);
+          if (std::memcmp(features, boardFeatures, sizeof(features)))
+              return false;
+      }
   }
 
   return true;
@@ -27,6 +27,7 @@
 
 #include "bitboard.h"
 #include "types.h"
+#include "KatyushaFeatures.h"
 
 class Position;
 class Thread;
@@ -67,12 +68,28 @@ struct StateInfo {
   int    pliesFromNull;
   Score  psq;
   Square epSquare;
+  int    accumulatorPly;  // Plies since the position was set up, do_move() increments it
 
   // Not copied when making a move
   Key        key;
   Bitboard   checkersBB;
   PieceType  capturedType;
   StateInfo* previous;
+
+  // Piece list slots emptied by the move, so that undo_move() can restore the
+  // piece lists in their original order: the captured piece, and our pawn
+  // (promotion) or rook (castling).
+  int        capturedIndex;
+  int        ownIndex;
+
+  // Katyusha board features changed by the move, in the order they were made
+  int        featureChanges;
+  Analyze::FeatureChange changedFeatures[Analyze::MAX_FEATURE_CHANGES];
+
+  // Version of the weights KatyushaEngine computed the network first layer
+  // pre-activations due to the board features with, 0 if none. They are kept
+  // in the thread's KatyushaScratch, in the slot of accumulatorPly.
+  unsigned   accumulatorVersion;
 };
 
 
@@ -172,6 +189,10 @@ public:
   int rule50_count() const;
   Score psq_score() const;
   Value non_pawn_material(Color c) const;
+  const int8_t* board_features() const;
+  bool tracks_features() const;
+  StateInfo* state() const;
+  bool is_start_state(const StateInfo* si) const;
 
   // Position consistency check, for debugging
   bool pos_is_ok(int* failedStep = nullptr) const;
@@ -187,7 +208,12 @@ private:
   Bitboard check_blockers(Color c, Color kingColor) const;
   void put_piece(Color c, PieceType pt, Square s);
   void remove_piece(Color c, PieceType pt, Square s);
+  void put_piece(Color c, PieceType pt, Square s, int idx);
   void move_piece(Color c, PieceType pt, Square from, Square to);
+  template<typename Set> void write_features(Color c, PieceType pt, Set set) const;
+  void compute_features(int8_t* features) const;
+  void update_features(Color c, PieceType pt);
+  void set_feature(int f, int v);
   template<bool Do>
   void do_castling(Color us, Square from, Square& to, Square& rfrom, Square& rto);
 
@@ -208,6 +234,8 @@ private:
   Thread* thisThread;
   StateInfo* st;
   bool chess960;
+  int8_t boardFeatures[Analyze::NB_FEATURES];
+  bool katyushaFeatures;
 };
 
 extern std::ostream& operator<<(std::ostream& os, const Position& pos);
@@ -350,6 +378,24 @@ inline Value Position::non_pawn_material(Color c) const {
   return st->nonPawnMaterial[c];
 }
 
+inline const int8_t* Position::board_features() const {
+  return boardFeatures;
+}
+
+/// The board features are only kept up to date by do_move() if Katyusha was
+/// active when the position was set up, the classical search does not pay for them.
+inline bool Position::tracks_features() const {
+  return katyushaFeatures;
+}
+
+inline StateInfo* Position::state() const {
+  return st;
+}
+
+inline bool Position::is_start_state(const StateInfo* si) const {
+  return si == &startState;
+}
+
 inline int Position::game_ply() const {
   return gamePly;
 }
@@ -410,10 +456,11 @@ inline void Position::put_piece(Color c, PieceType pt, Square s) {
 
 inline void Position::remove_piece(Color c, PieceType pt, Square s) {
 
-  // WARNING: This is not a reversible operation. If we remove a piece in
-  // do_move() and then replace it in undo_move() we will put it at the end of
-  // the list and not in its original place, it means index[] and pieceList[]
-  // are not guaranteed to be invariant to a do_move() + undo_move() sequence.
+  // WARNING: This is not a reversible operation by itself. The last piece of
+  // the list takes the slot of the removed one, so a piece removed in do_move()
+  // must be replaced in undo_move() with put_piece(c, pt, s, idx) to keep index[]
+  // and pieceList[] invariant to a do_move() + undo_move() sequence. Katyusha's
+  // features refer to pieces by their slot and rely on this.
   byTypeBB[ALL_PIECES] ^= s;
   byTypeBB[pt] ^= s;
   byColorBB[c] ^= s;
@@ -425,6 +472,18 @@ inline void Position::remove_piece(Color c, PieceType pt, Square s) {
   pieceCount[c][ALL_PIECES]--;
 }
 
+inline void Position::put_piece(Color c, PieceType pt, Square s, int idx) {
+
+  // Put the piece at the end of its list, then swap it into slot idx. This is
+  // the exact inverse of a remove_piece() that emptied slot idx.
+  put_piece(c, pt, s);
+  Square displaced = pieceList[c][pt][idx];
+  pieceList[c][pt][index[s]] = displaced;
+  index[displaced] = index[s];
+  pieceList[c][pt][idx] = s;
+  index[s] = idx;
+}
+
 inline void Position::move_piece(Color c, PieceType pt, Square from, Square to) {
 
   // index[from] is not updated and becomes stale. This works as long as index[]
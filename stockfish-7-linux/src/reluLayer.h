@@ -7,17 +7,17 @@ public:
   ~reluLayer();
   reluLayer()
   {
-
+    activation = ACT_RELU;
   }
 
   reluLayer(int ninputs, int noutputs, float ** weights, float * biases) : Layer(ninputs, noutputs, weights, biases)
   {
-
+    activation = ACT_RELU;
   }
 
   reluLayer(int ninputs, int noutputs, float * weights, float * biases) : Layer(ninputs, noutputs, weights, biases)
   {
-
+    activation = ACT_RELU;
   }
 
   float activation_func(float out);
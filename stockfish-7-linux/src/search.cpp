@@ -61,6 +61,8 @@ using std::string;
 using Eval::evaluate;
 using namespace Search;
 
+CounterMovesHistoryStats CounterMovesHistory; // Global object
+
 namespace {
 
   // Different node types, used as template parameter
@@ -131,7 +133,8 @@ namespace {
 
   EasyMoveManager EasyMove;
   Value DrawValue[COLOR_NB];
-  CounterMovesHistoryStats CounterMovesHistory;
+  std::unique_ptr<TranspositionTable[]> LabelSlices;
+  std::unique_ptr<CounterMovesHistoryStats[]> LabelHistories;
 
   template <NodeType NT>
   Value search(Position& pos, Stack* ss, Value alpha, Value beta, Depth depth, bool cutNode);
@@ -597,6 +600,113 @@ void Thread::search() {
 }
 
 
+/// Search::start_labeling() prepares the first n threads of the pool to label
+/// positions with Search::label(). Each of them gets a slice of TT and a
+/// counter move history of its own, so that its labels do not depend on the
+/// other threads. Draws are scored without contempt and the searches are only
+/// stopped by their own limits. No other search may run until stop_labeling()
+/// gives the threads the whole of TT and the shared history back.
+
+void Search::start_labeling(size_t n) {
+
+  Threads.main()->wait_for_search_finished();
+
+  LimitsType limits;
+  limits.infinite = 1; // So that check_time() never stops a label search
+  limits.startTime = now();
+  Limits = limits;
+  Signals.stopOnPonderhit = Signals.stop = false;
+  DrawValue[WHITE] = DrawValue[BLACK] = VALUE_DRAW;
+
+  LabelSlices.reset(new TranspositionTable[n]);
+  LabelHistories.reset(new CounterMovesHistoryStats[n]);
+  for (size_t k = 0; k < n; ++k)
+  {
+      LabelSlices[k].slice(TT, k, n);
+      LabelHistories[k].clear();
+      Threads[k]->tt = &LabelSlices[k];
+      Threads[k]->counterMovesHistory = &LabelHistories[k];
+  }
+}
+
+
+/// Search::stop_labeling() ends what start_labeling() started
+
+void Search::stop_labeling() {
+
+  for (Thread* th : Threads)
+  {
+      th->tt = &TT;
+      th->counterMovesHistory = &CounterMovesHistory;
+  }
+
+  LabelSlices.reset();
+  LabelHistories.reset();
+}
+
+
+/// Search::label() searches pos on the thread it belongs to, which must have
+/// been prepared by start_labeling(), and returns its score for the side to
+/// move. Iterative deepening goes on up to depth, or until nodes nodes have been
+/// searched, whichever limit is not zero comes first. The iteration the node
+/// budget runs out in is completed, so the label does not depend on timing.
+/// If bestMove is given, the first move of the principal variation goes there.
+/// Nothing is printed.
+
+Value Search::label(Position& pos, Depth depth, int64_t nodes, Move* bestMove) {
+
+  assert(depth > DEPTH_ZERO || nodes > 0);
+
+  Stack stack[MAX_PLY+4], *ss = stack+2; // To allow referencing (ss-2) and (ss+2)
+  Move pv[MAX_PLY+1];
+  Value bestValue = VALUE_ZERO, alpha, beta, delta, value;
+  uint64_t startNodes = pos.nodes_searched();
+
+  std::memset(ss-2, 0, 5 * sizeof(Stack));
+  ss->pv = pv;
+  pv[0] = MOVE_NONE;
+  pos.this_thread()->tt->new_search();
+
+  for (Depth d = ONE_PLY; d < DEPTH_MAX && (!depth || d <= depth); d += ONE_PLY)
+  {
+      // Same aspiration windows as the iterative deepening of Thread::search()
+      delta = Value(18);
+      alpha = d >= 5 * ONE_PLY ? std::max(bestValue - delta, -VALUE_INFINITE) : -VALUE_INFINITE;
+      beta  = d >= 5 * ONE_PLY ? std::min(bestValue + delta,  VALUE_INFINITE) :  VALUE_INFINITE;
+
+      while (true)
+      {
+          value = ::search<PV>(pos, ss, alpha, beta, d, false);
+
+          if (value <= alpha)
+          {
+              beta = (alpha + beta) / 2;
+              alpha = std::max(value - delta, -VALUE_INFINITE);
+          }
+          else if (value >= beta)
+          {
+              alpha = (alpha + beta) / 2;
+              beta = std::min(value + delta, VALUE_INFINITE);
+          }
+          else
+              break;
+
+          delta += delta / 4 + 5;
+      }
+
+      bestValue = value;
+
+      if (nodes && pos.nodes_searched() - startNodes >= uint64_t(nodes))
+          break;
+  }
+
+  if (bestMove)
+      *bestMove = pv[0];
+
+  return bestValue;
+}
+
+
 namespace {
 
   // search<>() is the main search function for both PV and non-PV nodes
@@ -624,6 +734,7 @@ namespace {
 
     // Step 1. Initialize node
     Thread* thisThread = pos.this_thread();
+    TranspositionTable& tt = *thisThread->tt;
     inCheck = pos.checkers();
     moveCount = quietCount =  ss->moveCount = 0;
     bestValue = -VALUE_INFINITE;
@@ -677,7 +788,7 @@ namespace {
     // position key in case of an excluded move.
     excludedMove = ss->excludedMove;
     posKey = excludedMove ? pos.exclusion_key() : pos.key();
-    tte = TT.probe(posKey, ttHit);
+    tte = tt.probe(posKey, ttHit);
     ttValue = ttHit ? value_from_tt(tte->value(), ss->ply) : VALUE_NONE;
     ttMove =  RootNode ? thisThread->rootMoves[thisThread->PVIdx].pv[0]
             : ttHit    ? tte->move() : MOVE_NONE;
@@ -722,7 +833,7 @@ namespace {
 
                 tte->save(posKey, value_to_tt(value, ss->ply), BOUND_EXACT,
                           std::min(DEPTH_MAX - ONE_PLY, depth + 6 * ONE_PLY),
-                          MOVE_NONE, VALUE_NONE, TT.generation());
+                          MOVE_NONE, VALUE_NONE, tt.generation());
 
                 return value;
             }
@@ -754,7 +865,7 @@ namespace {
                                          : -(ss-1)->staticEval + 2 * Eval::Tempo;
 
         tte->save(posKey, VALUE_NONE, BOUND_NONE, DEPTH_NONE, MOVE_NONE,
-                  ss->staticEval, TT.generation());
+                  ss->staticEval, tt.generation());
     }
 
     if (ss->skipEarlyPruning)
@@ -864,7 +975,7 @@ namespace {
         search<PvNode ? PV : NonPV>(pos, ss, alpha, beta, d, true);
         ss->skipEarlyPruning = false;
 
-        tte = TT.probe(posKey, ttHit);
+        tte = tt.probe(posKey, ttHit);
         ttMove = ttHit ? tte->move() : MOVE_NONE;
     }
 
@@ -872,7 +983,7 @@ moves_loop: // When in check search starts from here
 
     Square prevSq = to_sq((ss-1)->currentMove);
     Move cm = thisThread->counterMoves[pos.piece_on(prevSq)][prevSq];
-    const CounterMovesStats& cmh = CounterMovesHistory[pos.piece_on(prevSq)][prevSq];
+    const CounterMovesStats& cmh = (*thisThread->counterMovesHistory)[pos.piece_on(prevSq)][prevSq];
 
     MovePicker mp(pos, ttMove, depth, thisThread->history, cmh, cm, ss);
     CheckInfo ci(pos);
@@ -991,7 +1102,7 @@ moves_loop: // When in check search starts from here
       }
 
       // Speculative prefetch as early as possible
-      prefetch(TT.first_entry(pos.key_after(move)));
+      prefetch(tt.first_entry(pos.key_after(move)));
 
       // Check for legality just before making the move
       if (!RootNode && !pos.legal(move, ci.pinned))
@@ -1164,14 +1275,14 @@ moves_loop: // When in check search starts from here
     {
         Value bonus = Value((depth / ONE_PLY) * (depth / ONE_PLY) + depth / ONE_PLY - 1);
         Square prevPrevSq = to_sq((ss - 2)->currentMove);
-        CounterMovesStats& prevCmh = CounterMovesHistory[pos.piece_on(prevPrevSq)][prevPrevSq];
+        CounterMovesStats& prevCmh = (*thisThread->counterMovesHistory)[pos.piece_on(prevPrevSq)][prevPrevSq];
         prevCmh.update(pos.piece_on(prevSq), prevSq, bonus);
     }
 
     tte->save(posKey, value_to_tt(bestValue, ss->ply),
               bestValue >= beta ? BOUND_LOWER :
               PvNode && bestMove ? BOUND_EXACT : BOUND_UPPER,
-              depth, bestMove, ss->staticEval, TT.generation());
+              depth, bestMove, ss->staticEval, tt.generation());
 
     assert(bestValue > -VALUE_INFINITE && bestValue < VALUE_INFINITE);
 
@@ -1202,6 +1313,7 @@ moves_loop: // When in check search starts from here
     Value bestValue, value, ttValue, futilityValue, futilityBase, oldAlpha;
     bool ttHit, givesCheck, evasionPrunable;
     Depth ttDepth;
+    TranspositionTable& tt = *pos.this_thread()->tt;
 
     if (PvNode)
     {
@@ -1228,7 +1340,7 @@ moves_loop: // When in check search starts from here
 
     // Transposition table lookup
     posKey = pos.key();
-    tte = TT.probe(posKey, ttHit);
+    tte = tt.probe(posKey, ttHit);
     ttMove = ttHit ? tte->move() : MOVE_NONE;
     ttValue = ttHit ? value_from_tt(tte->value(), ss->ply) : VALUE_NONE;
 
@@ -1272,7 +1384,7 @@ moves_loop: // When in check search starts from here
         {
             if (!ttHit)
                 tte->save(pos.key(), value_to_tt(bestValue, ss->ply), BOUND_LOWER,
-                          DEPTH_NONE, MOVE_NONE, ss->staticEval, TT.generation());
+                          DEPTH_NONE, MOVE_NONE, ss->staticEval, tt.generation());
 
             return bestValue;
         }
@@ -1334,7 +1446,7 @@ moves_loop: // When in check search starts from here
           continue;
 
       // Speculative prefetch as early as possible
-      prefetch(TT.first_entry(pos.key_after(move)));
+      prefetch(tt.first_entry(pos.key_after(move)));
 
       // Check for legality just before making the move
       if (!pos.legal(move, ci.pinned))
@@ -1368,7 +1480,7 @@ moves_loop: // When in check search starts from here
               else // Fail high
               {
                   tte->save(posKey, value_to_tt(value, ss->ply), BOUND_LOWER,
-                            ttDepth, move, ss->staticEval, TT.generation());
+                            ttDepth, move, ss->staticEval, tt.generation());
 
                   return value;
               }
@@ -1383,7 +1495,7 @@ moves_loop: // When in check search starts from here
 
     tte->save(posKey, value_to_tt(bestValue, ss->ply),
               PvNode && bestValue > oldAlpha ? BOUND_EXACT : BOUND_UPPER,
-              ttDepth, bestMove, ss->staticEval, TT.generation());
+              ttDepth, bestMove, ss->staticEval, tt.generation());
 
     assert(bestValue > -VALUE_INFINITE && bestValue < VALUE_INFINITE);
 
@@ -1441,8 +1553,8 @@ moves_loop: // When in check search starts from here
     Value bonus = Value((depth / ONE_PLY) * (depth / ONE_PLY) + depth / ONE_PLY - 1);
 
     Square prevSq = to_sq((ss-1)->currentMove);
-    CounterMovesStats& cmh = CounterMovesHistory[pos.piece_on(prevSq)][prevSq];
     Thread* thisThread = pos.this_thread();
+    CounterMovesStats& cmh = (*thisThread->counterMovesHistory)[pos.piece_on(prevSq)][prevSq];
 
     thisThread->history.update(pos.moved_piece(move), to_sq(move), bonus);
 
@@ -1467,7 +1579,7 @@ moves_loop: // When in check search starts from here
         && is_ok((ss-2)->currentMove))
     {
         Square prevPrevSq = to_sq((ss-2)->currentMove);
-        CounterMovesStats& prevCmh = CounterMovesHistory[pos.piece_on(prevPrevSq)][prevPrevSq];
+        CounterMovesStats& prevCmh = (*thisThread->counterMovesHistory)[pos.piece_on(prevPrevSq)][prevPrevSq];
         prevCmh.update(pos.piece_on(prevSq), prevSq, -bonus - 2 * (depth + 1) / ONE_PLY);
     }
   }
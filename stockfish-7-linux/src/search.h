@@ -104,6 +104,9 @@ extern StateStackPtr SetupStates;
 void init();
 void clear();
 template<bool Root = true> uint64_t perft(Position& pos, Depth depth);
+void start_labeling(size_t n);
+void stop_labeling();
+Value label(Position& pos, Depth depth, int64_t nodes, Move* bestMove = nullptr);
 
 } // namespace Search
 
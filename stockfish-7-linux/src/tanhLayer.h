@@ -8,17 +8,17 @@ public:
   ~tanhLayer();
   tanhLayer()
   {
-
+    activation = ACT_TANH;
   }
 
   tanhLayer(int ninputs, int noutputs, float ** weights, float * biases) : Layer(ninputs, noutputs, weights, biases)
   {
-
+    activation = ACT_TANH;
   }
 
   tanhLayer(int ninputs, int noutputs, float * weights, float * biases) : Layer(ninputs, noutputs, weights, biases)
   {
-
+    activation = ACT_TANH;
   }
 
   float activation_func(float out);
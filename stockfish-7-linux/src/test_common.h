@@ -0,0 +1,90 @@
+#ifndef test_common_h
+#define test_common_h
+
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "bitboard.h"
+#include "evaluate.h"
+#include "KatyushaEngine.h"
+#include "misc.h"
+#include "movegen.h"
+#include "pawns.h"
+#include "position.h"
+#include "search.h"
+#include "thread.h"
+#include "uci.h"
+
+//What the test harnesses share. A harness is a main() linked with the engine objects but main.o, that prints what
+//it checked and returns nonzero if a check failed. make test builds and runs them all.
+
+//the initialization of main()
+inline void init_engine()
+{
+  UCI::init(Options);
+  PSQT::init();
+  Bitboards::init();
+  Position::init();
+  Bitbases::init();
+  Search::init();
+  Eval::init();
+  Pawns::init();
+  Threads.init();
+}
+
+//the weights a harness checks: its argument, the weightsfile by default
+inline std::string weights_file(int argc, char* argv[])
+{
+  return argc > 1 ? argv[1] : KatyushaEngine::getWeightsfile();
+}
+
+//Play games random games of up to plies moves from the start position on the main thread, calling visit(pos)
+//after every move. With nullMoves, one in nullMoves of the moves of a side not in check is a null move. With
+//undo, the moves of each game are taken back at its end, calling visit(pos) after each. Returns the number of
+//calls of visit.
+template<typename Visit>
+int random_games(uint64_t seed, int games, int plies, Visit visit, int nullMoves = 0, bool undo = false)
+{
+  PRNG rng(seed);
+  int visits = 0;
+  for (int g = 0; g < games; g++)
+  {
+    Position pos("rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1", false, Threads.main());
+    std::deque<StateInfo> states;
+    std::vector<Move> moves;
+    for (int ply = 0; ply < plies; ply++)
+    {
+      MoveList<LEGAL> legal(pos);
+      if (!legal.size())
+        break;
+      states.emplace_back();
+      if (nullMoves && !pos.checkers() && rng.rand<unsigned>() % nullMoves == 0)
+      {
+        pos.do_null_move(states.back());
+        moves.push_back(MOVE_NULL);
+      }
+      else
+      {
+        Move m = *(legal.begin() + rng.rand<unsigned>() % legal.size());
+        pos.do_move(m, states.back(), pos.gives_check(m, CheckInfo(pos)));
+        moves.push_back(m);
+      }
+      visit(pos);
+      visits++;
+    }
+    while (undo && !moves.empty())
+    {
+      if (moves.back() == MOVE_NULL)
+        pos.undo_null_move();
+      else
+        pos.undo_move(moves.back());
+      moves.pop_back();
+      visit(pos);
+      visits++;
+    }
+  }
+  return visits;
+}
+
+#endif
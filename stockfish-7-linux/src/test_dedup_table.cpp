@@ -0,0 +1,82 @@
+#include <atomic>
+#include <cstdio>
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+
+#include "DedupTable.h"
+#include "misc.h"
+
+using namespace std;
+
+//Checks that DedupTable takes every position as many times as asked and no more, also from several threads at once,
+//and that the counts survive save() and load(). Usage: test_dedup_table
+
+//the most times key may be taken, 1 to 3
+int max_count(Key key) { return 1 + int(key % 3); }
+
+int main()
+{
+  const size_t N = 100000;
+  PRNG rng(20160719);
+
+  //distinct upper bits, so no two keys share an entry
+  vector<Key> keys(N);
+  for (size_t i = 0; i < N; i++)
+    keys[i] = (Key(i + 1) << 36) | (rng.rand<Key>() & ((Key(1) << 36) - 1));
+
+  DedupTable table;
+  table.resize(N);
+  int failures = 0;
+  for (Key k : keys)
+  {
+    for (int c = 0; c < max_count(k); c++)
+      failures += !table.take(k, max_count(k));
+    failures += table.take(k, max_count(k));
+  }
+  cout << "take: " << failures << " failures" << endl;
+
+  //the counts go to disk and into a table of the same size, a table of another size does not load them
+  string path = "/tmp/test_dedup_table." + to_string(getpid());
+  DedupTable loaded, other;
+  loaded.resize(N);
+  other.resize(4 * N);
+  if (!table.save(path) || !loaded.load(path) || other.load(path))
+  {
+    cout << path << " could not be written or read, or loaded into a table of another size" << endl;
+    failures++;
+  }
+  else
+  {
+    int lost = 0;
+    for (Key k : keys)
+      lost += loaded.take(k, max_count(k)) || !loaded.take(k, max_count(k) + 1);
+    cout << "load: " << lost << " counts lost" << endl;
+    failures += lost;
+  }
+  remove(path.c_str());
+
+  //threads taking the same keys together take each exactly as often as one thread would
+  DedupTable shared;
+  shared.resize(N);
+  std::atomic<size_t> taken(0);
+  vector<std::thread> threads;
+  for (int t = 0; t < 4; t++)
+    threads.emplace_back([&]() {
+      size_t n = 0;
+      for (Key k : keys)
+        for (int c = 0; c < 3; c++)
+          n += shared.take(k, max_count(k));
+      taken += n;
+    });
+  for (std::thread& th : threads)
+    th.join();
+  size_t expected = 0;
+  for (Key k : keys)
+    expected += max_count(k);
+  cout << "threads: " << taken << " takes, " << expected << " expected" << endl;
+  failures += taken != expected;
+
+  return failures > 0;
+}
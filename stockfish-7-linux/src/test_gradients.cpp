@@ -0,0 +1,169 @@
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <memory>
+
+#include "KatyushaOptimizer.h"
+#include "test_common.h"
+
+//Checks the gradients backward() sums against central differences of forward(), changing the weights with
+//adjust(), then checks the changes KatyushaOptimizer::step() makes against their formulas, and that a step of
+//gradient descent lowers the evaluations it was taken for. Usage: test_gradients [weights]
+
+int failures = 0;
+
+//the sum of the evaluations of the samples by net
+double total(const KatyushaNet& net, const vector<vector<int> >& samples, KatyushaScratch& scratch)
+{
+  double sum = 0;
+  for (const vector<int>& s : samples)
+    sum += net.forward(s.data(), scratch);
+  return sum;
+}
+
+//change entry k of the weights (or biases) of layer i of net by h
+void nudge(KatyushaNet& net, KatyushaGradient& delta, size_t i, bool bias, size_t k, float h)
+{
+  delta.clear();
+  (bias ? delta.layers[i].biases : delta.layers[i].weights)[k] = -h; //adjust() subtracts
+  net.adjust(delta);
+}
+
+void check_gradients(KatyushaNet& net, const vector<vector<int> >& samples, KatyushaScratch& scratch)
+{
+  KatyushaGradient g, delta;
+  net.init_gradient(g);
+  net.init_gradient(delta);
+  for (const vector<int>& s : samples)
+  {
+    net.forward(s.data(), scratch);
+    net.backward(1, scratch, g);
+  }
+
+  //the entries with the largest gradients of each layer, and some random ones that may be 0
+  const float H = 1e-3f;
+  PRNG rng(20161017);
+  int checked = 0;
+  double worst = 0;
+  for (size_t i = 0; i < g.layers.size(); i++)
+    for (int bias = 0; bias < 2; bias++)
+    {
+      const vector<float>& grad = bias ? g.layers[i].biases : g.layers[i].weights;
+      vector<size_t> entries(grad.size());
+      for (size_t k = 0; k < entries.size(); k++)
+        entries[k] = k;
+      std::partial_sort(entries.begin(), entries.begin() + std::min(size_t(4), entries.size()), entries.end(),
+                        [&](size_t a, size_t b) { return std::abs(grad[a]) > std::abs(grad[b]); });
+      entries.resize(std::min(size_t(4), entries.size()));
+      for (int r = 0; r < 4; r++)
+        entries.push_back(rng.rand<size_t>() % grad.size());
+
+      for (size_t k : entries)
+      {
+        nudge(net, delta, i, bias, k, H);
+        double up = total(net, samples, scratch);
+        nudge(net, delta, i, bias, k, -2 * H);
+        double down = total(net, samples, scratch);
+        nudge(net, delta, i, bias, k, H);
+
+        double numeric = (up - down) / (2 * H);
+        double err = std::abs(numeric - grad[k]);
+        worst = std::max(worst, err);
+        checked++;
+        if (err > 2e-3 + 1e-2 * std::abs(numeric))
+        {
+          cout << "layer " << i << (bias ? " bias " : " weight ") << k << ": gradient " << grad[k]
+               << ", central difference " << numeric << endl;
+          failures++;
+        }
+      }
+    }
+  cout << "backward: " << checked << " gradients checked, largest difference " << worst << endl;
+}
+
+void check_optimizer()
+{
+  //two layers of three weights and one bias, for two samples
+  KatyushaGradient g;
+  g.layers.resize(2);
+  g.layers[0].weights = { 0.5f, -1.0f, 0.0f };
+  g.layers[0].biases = { 2.0f };
+  g.layers[1].weights = { -0.25f, 4.0f, 1.0f };
+  g.layers[1].biases = { -3.0f };
+  g.samples = 2;
+
+  const float Rate = 0.1f;
+  int wrong = 0;
+  auto expect = [&](const KatyushaGradient& d, std::function<float(float)> change) {
+    for (size_t i = 0; i < g.layers.size(); i++)
+      for (int b = 0; b < 2; b++)
+      {
+        const vector<float>& grad = b ? g.layers[i].biases : g.layers[i].weights;
+        const vector<float>& got = b ? d.layers[i].biases : d.layers[i].weights;
+        for (size_t k = 0; k < grad.size(); k++)
+          wrong += std::abs(got[k] - change(grad[k] / g.samples)) > 1e-5f;
+      }
+  };
+
+  KatyushaGradient d;
+  KatyushaOptimizer sgd(KatyushaOptimizer::SGD, Rate);
+  sgd.step(g, d);
+  expect(d, [&](float gk) { return Rate * gk; });
+
+  //Adagrad divides by the root of the sum of the squared gradients of all steps
+  KatyushaOptimizer adagrad(KatyushaOptimizer::ADAGRAD, Rate);
+  adagrad.step(g, d);
+  expect(d, [&](float gk) { return gk ? Rate * gk / std::abs(gk) : 0; });
+  adagrad.step(g, d);
+  expect(d, [&](float gk) { return gk ? Rate * gk / std::sqrt(2 * gk * gk) : 0; });
+
+  //the bias corrected first step of Adam is the learning rate in the direction of the gradient
+  KatyushaOptimizer adam(KatyushaOptimizer::ADAM, Rate);
+  adam.step(g, d);
+  expect(d, [&](float gk) { return gk ? Rate * gk / std::abs(gk) : 0; });
+
+  cout << "step: " << wrong << " changes differ from their formulas" << endl;
+  failures += wrong;
+}
+
+//a small step of gradient descent on the sum of the evaluations lowers it
+void check_descent(KatyushaNet& net, const vector<vector<int> >& samples, KatyushaScratch& scratch)
+{
+  KatyushaGradient g, delta;
+  net.init_gradient(g);
+  double before = total(net, samples, scratch);
+  for (const vector<int>& s : samples)
+  {
+    net.forward(s.data(), scratch);
+    net.backward(1, scratch, g);
+  }
+  KatyushaOptimizer sgd(KatyushaOptimizer::SGD, 0.01f);
+  sgd.step(g, delta);
+  net.adjust(delta);
+  double after = total(net, samples, scratch);
+
+  cout << "descent: the evaluations sum to " << after << " after a step, " << before << " before" << endl;
+  failures += !(after < before);
+}
+
+int main(int argc, char* argv[])
+{
+  init_engine();
+
+  KatyushaNet net;
+  string weights = weights_file(argc, argv);
+  if (!net.load(weights))
+  {
+    cout << weights << " does not hold a network" << endl;
+    return 1;
+  }
+
+  std::unique_ptr<KatyushaScratch> scratch(new KatyushaScratch());
+  vector<vector<int> > samples = KatyushaEngine::sample_features(20161017, 1, 8);
+  check_gradients(net, samples, *scratch);
+  check_optimizer();
+  check_descent(net, samples, *scratch);
+
+  Threads.exit();
+  return failures > 0;
+}
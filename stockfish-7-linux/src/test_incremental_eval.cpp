@@ -0,0 +1,40 @@
+#include <cstdlib>
+#include <memory>
+
+#include "test_common.h"
+
+//Plays random games and checks, after every move and null move and again while taking them back, that the board
+//features do_move updates match the ones Katyusha_pos_rep computes from scratch, and that the evaluation from the
+//accumulators matches the one of the network on those features. Usage: test_incremental_eval [weights]
+
+int mismatches = 0, worst = 0;
+
+void check(const Position& pos, KatyushaScratch& scratch)
+{
+  int full[Analyze::NB_FEATURES];
+  Analyze::Katyusha_pos_rep(pos, full);
+  for (int f = 0; f < Analyze::NB_FEATURES; f++)
+    if (Analyze::is_board_feature(f) && pos.board_features()[f] != full[f])
+    {
+      cout << "feature " << f << " is " << int(pos.board_features()[f]) << " instead of " << full[f] << " in " << pos.fen() << endl;
+      mismatches++;
+    }
+  Value v = KatyushaEngine::to_stockfish_value(KatyushaEngine::get_network()->evaluate(full, scratch));
+  worst = std::max(worst, std::abs(int(KatyushaEngine::evaluate(pos)) - int(v)));
+}
+
+int main(int argc, char* argv[])
+{
+  init_engine();
+  Options["Katyusha_EvalCache"] = string("0");
+  KatyushaEngine::setWeightsfile(weights_file(argc, argv));
+  if (!KatyushaEngine::get_network())
+    return 1;
+
+  std::unique_ptr<KatyushaScratch> scratch(new KatyushaScratch());
+  int positions = random_games(20161017, 200, 120, [&](const Position& pos) { check(pos, *scratch); }, 8, true);
+
+  cout << positions << " positions, " << mismatches << " features differ, largest evaluation difference " << worst << endl;
+  Threads.exit();
+  return mismatches || worst > 1;
+}
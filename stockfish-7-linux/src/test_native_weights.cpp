@@ -0,0 +1,70 @@
+#include <cstdio>
+#include <memory>
+#include <unistd.h>
+
+#include "test_common.h"
+
+//Writes a network to a native weight file and back to an npz archive, loads both and checks that they evaluate the
+//positions of random games exactly like the original. Usage: test_native_weights [weights]
+
+//the number of positions net evaluates differently from reference
+int differences(const KatyushaNet& net, const KatyushaNet& reference, const vector<vector<int> >& samples)
+{
+  std::unique_ptr<KatyushaScratch> scratch(new KatyushaScratch());
+  int n = 0;
+  for (size_t i = 0; i < samples.size(); i++)
+    n += net.evaluate(samples[i].data(), *scratch) != reference.evaluate(samples[i].data(), *scratch);
+  return n;
+}
+
+int main(int argc, char* argv[])
+{
+  init_engine();
+
+  KatyushaNet net;
+  string weights = weights_file(argc, argv);
+  if (!net.load(weights))
+  {
+    cout << weights << " does not hold a network" << endl;
+    return 1;
+  }
+  string base = "/tmp/test_native_weights." + std::to_string(getpid());
+  vector<vector<int> > samples = KatyushaEngine::sample_features(20161017, 64, 80);
+  int failures = 0;
+
+  KatyushaNet native, archive;
+  if (!net.save_native(base + ".knet") || !native.load(base + ".knet"))
+  {
+    cout << "the native weight file could not be written or loaded" << endl;
+    failures++;
+  }
+  else
+  {
+    int n = differences(native, net, samples);
+    cout << "native weight file: " << n << " of " << samples.size() << " evaluations differ" << endl;
+    if (native.native_checksum() != net.native_checksum())
+    {
+      cout << "native weight file: the checksum differs" << endl;
+      failures++;
+    }
+    failures += n;
+
+    //the arrays of the mapped network go back to an archive
+    if (!native.save(base + ".npz") || !archive.load(base + ".npz"))
+    {
+      cout << "the npz archive could not be written or loaded" << endl;
+      failures++;
+    }
+    else
+    {
+      n = differences(archive, net, samples);
+      cout << "npz archive: " << n << " of " << samples.size() << " evaluations differ" << endl;
+      failures += n;
+    }
+  }
+
+  std::remove((base + ".knet").c_str());
+  std::remove((base + ".npz").c_str());
+  Threads.exit();
+  return failures > 0;
+}
@@ -0,0 +1,64 @@
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+
+#include "NpyWriter.h"
+#include "PackedPosition.h"
+#include "test_common.h"
+
+//Packs the positions of random games with random evaluations and results, checks that they unpack to the same FEN,
+//evaluation and result, then writes them to a training set and checks that PackedPositionFile reads the same
+//records back. Usage: test_packed_positions
+
+int main()
+{
+  init_engine();
+
+  PRNG rng(20161018);
+  vector<PackedPosition> packed;
+  int mismatches = 0;
+  random_games(20161017, 200, 200, [&](const Position& pos) {
+    Value v = rng.rand<unsigned>() % 8 ? Value(int(rng.rand<unsigned>() % 4001) - 2000) : VALUE_NONE;
+    int r = int(rng.rand<unsigned>() % 4) - 1;
+    if (r == 2)
+      r = PackedPosition::ResultUnknown;
+    PackedPosition p;
+    p.pack(pos, v, r);
+    if (p.fen() != pos.fen() || p.eval != v || p.result != r)
+    {
+      cout << pos.fen() << " unpacks to " << p.fen() << " with evaluation " << p.eval << " and result " << int(p.result) << endl;
+      mismatches++;
+    }
+    packed.push_back(p);
+  });
+
+  string path = "/tmp/test_packed_positions." + std::to_string(getpid()) + ".npy";
+  NpyWriter writer;
+  PackedPositionFile file;
+  if (   !writer.open(path, PackedPosition::Descr, sizeof(PackedPosition), 0)
+      || !writer.append(packed.data(), packed.size())
+      || !writer.close()
+      || !file.open(path))
+  {
+    cout << path << " could not be written or read" << endl;
+    mismatches++;
+  }
+  else if (file.size() != packed.size())
+  {
+    cout << file.size() << " records read instead of " << packed.size() << endl;
+    mismatches++;
+  }
+  else
+    for (size_t i = 0; i < packed.size(); i++)
+      if (memcmp(&file[i], &packed[i], sizeof(PackedPosition)))
+      {
+        cout << "record " << i << " differs" << endl;
+        mismatches++;
+      }
+  file.close();
+  std::remove(path.c_str());
+
+  cout << packed.size() << " positions, " << mismatches << " mismatches" << endl;
+  Threads.exit();
+  return mismatches > 0;
+}
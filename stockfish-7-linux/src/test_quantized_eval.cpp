@@ -0,0 +1,31 @@
+#include <memory>
+
+#include "test_common.h"
+
+//Quantizes a network like Katyusha_Quantized does, then checks that its quantized evaluations of the positions of
+//other random games stay within a tolerance of the float ones. Usage: test_quantized_eval [weights]
+
+int main(int argc, char* argv[])
+{
+  init_engine();
+
+  KatyushaNet net;
+  string weights = weights_file(argc, argv);
+  if (!net.load(weights))
+  {
+    cout << weights << " does not hold a network" << endl;
+    return 1;
+  }
+  KatyushaEngine::quantize(net);
+
+  //one unit of raw evaluation is 50 pawns, the tolerances are 5 and 50 centipawns
+  const double MaxMean = 0.001, MaxWorst = 0.01;
+  std::unique_ptr<KatyushaScratch> scratch(new KatyushaScratch());
+  vector<vector<int> > samples = KatyushaEngine::sample_features(20161017, 64, 80);
+  double mean, worst;
+  KatyushaEngine::quantization_error(net, samples, *scratch, mean, worst);
+
+  cout << samples.size() << " positions, mean error " << mean * 5000 << " cp, max error " << worst * 5000 << " cp" << endl;
+  Threads.exit();
+  return mean > MaxMean || worst > MaxWorst;
+}
@@ -37,8 +37,12 @@ Thread::Thread() {
 
   resetCalls = exit = false;
   maxPly = callsCnt = 0;
+  networkPublication = 0;
+  tt = &TT;
+  counterMovesHistory = &CounterMovesHistory;
   history.clear();
   counterMoves.clear();
+  evalCache.resize(Options["Katyusha_EvalCache"]);
   idx = Threads.size(); // Start from 0
 
   std::unique_lock<Mutex> lk(mutex);
@@ -24,22 +24,30 @@
 #include <atomic>
 #include <bitset>
 #include <condition_variable>
+#include <memory>
 #include <mutex>
 #include <thread>
 #include <vector>
 
+#include "KatyushaEvalCache.h"
+#include "KatyushaScratch.h"
 #include "material.h"
 #include "movepick.h"
 #include "pawns.h"
 #include "position.h"
 #include "search.h"
 #include "thread_win32.h"
+#include "tt.h"
 
 
+class KatyushaNet;
+
 /// Thread struct keeps together all the thread related stuff. We also use
 /// per-thread pawn and material hash tables so that once we get a pointer to an
 /// entry its life time is unlimited and we don't have to care about someone
-/// changing the entry under our feet.
+/// changing the entry under our feet. The neural network evaluator writes its
+/// features and activations to a per-thread scratch space and caches its
+/// evaluations in a per-thread table for the same reason.
 
 class Thread {
 
@@ -60,6 +68,11 @@ public:
   Pawns::Table pawnsTable;
   Material::Table materialTable;
   Endgames endgames;
+  KatyushaScratch netScratch;
+  KatyushaEvalCache evalCache;
+  KatyushaSubnetTable subnetTable;
+  std::shared_ptr<const KatyushaNet> network; // The weights this thread evaluates with
+  unsigned networkPublication;                // and the KatyushaEngine publication they came from
   size_t idx, PVIdx;
   int maxPly, callsCnt;
 
@@ -70,6 +83,8 @@ public:
   MovesStats counterMoves;
   Depth completedDepth;
   std::atomic_bool resetCalls;
+  TranspositionTable* tt; // The whole of TT, or a slice of it while labeling
+  CounterMovesHistoryStats* counterMovesHistory; // The shared one, or one of its own while labeling
 };
 
 
@@ -18,6 +18,7 @@
   along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <cassert>
 #include <cstring>   // For std::memset
 #include <iostream>
 
@@ -54,6 +55,22 @@ void TranspositionTable::resize(size_t mbSize) {
 }
 
 
+/// TranspositionTable::slice() turns the table into slice k of n of the clusters
+/// of tt, which keeps owning them. Each slice is a power of 2 number of clusters,
+/// so that searches in different slices never share an entry.
+
+void TranspositionTable::slice(const TranspositionTable& tt, size_t k, size_t n) {
+
+  assert(k < n && n <= tt.clusterCount);
+
+  free(mem);
+  mem = nullptr;
+  clusterCount = size_t(1) << msb(tt.clusterCount / n);
+  table = tt.table + k * clusterCount;
+  generation8 = tt.generation8;
+}
+
+
 /// TranspositionTable::clear() overwrites the entire transposition table
 /// with zeros. It is called whenever the table is resized, or when the
 /// user asks the program to clear the table (from the UCI interface).
@@ -94,12 +94,14 @@ class TranspositionTable {
   static_assert(CacheLineSize % sizeof(Cluster) == 0, "Cluster size incorrect");
 
 public:
+  TranspositionTable() : clusterCount(0), table(nullptr), mem(nullptr), generation8(0) {}
  ~TranspositionTable() { free(mem); }
   void new_search() { generation8 += 4; } // Lower 2 bits are used by Bound
   uint8_t generation() const { return generation8; }
   TTEntry* probe(const Key key, bool& found) const;
   int hashfull() const;
   void resize(size_t mbSize);
+  void slice(const TranspositionTable& tt, size_t k, size_t n);
   void clear();
 
   // The lowest order bits of the key are used to get the index of the cluster
@@ -31,6 +31,7 @@
 #include "uci.h"
 #include "analyze.h"
 #include "KatyushaEngine.h"
+#include "KatyushaTrainer.h"
 
 using namespace std;
 
@@ -139,6 +140,19 @@ namespace {
     Threads.start_thinking(pos, limits, SetupStates);
   }
 
+
+  // setup_states() returns the stack the debug commands that play moves on the
+  // root position push their states on. A search takes the stack over, so it is
+  // created again if needed.
+
+  std::stack<StateInfo>& setup_states() {
+
+    if (!SetupStates)
+        SetupStates = Search::StateStackPtr(new std::stack<StateInfo>);
+
+    return *SetupStates;
+  }
+
 } // namespace
 
 
@@ -156,6 +170,7 @@ void UCI::loop(int argc, char* argv[]) {
   Position pos(StartFEN, false, Threads.main()); // The root position
   //Initialize the weights of the neural network evaluator
   KatyushaEngine::init();
+  PRNG rng(now()); // For the random_moves and random_capture commands
   string token, cmd;
 
   for (int i = 1; i < argc; ++i)
@@ -216,11 +231,33 @@ void UCI::loop(int argc, char* argv[]) {
           sync_cout << "Mising infile or outfile" << sync_endl;
           continue;
         }
+        uint64_t seed;
         if (!(is >> max_positions)) max_positions = MAX_TRAINING_POSITIONS;
-        sync_cout << "Max Positions " << max_positions << endl;
-        Analyze::gen_training_set(infile, ofile, max_positions);
+        if (!(is >> seed) || !seed) seed = now();
+        sync_cout << "Max Positions " << max_positions << sync_endl;
+        Analyze::gen_training_set(infile, ofile, max_positions, seed);
+        sync_cout << "Finished." << sync_endl;
+      }
+      else if (token == "resume_training_set") {
+        string infile, prefix;
+        if (!(is >> infile) || !(is >> prefix)) {
+          sync_cout << "Mising infile or output prefix" << sync_endl;
+          continue;
+        }
+        Analyze::gen_training_set(infile, prefix, 0, 0, true);
+        sync_cout << "Finished." << sync_endl;
+      }
+      else if (token == "unpack_training_set") {
+        string infile, prefix;
+        if (!(is >> infile) || !(is >> prefix)) {
+          sync_cout << "Mising infile or output prefix" << sync_endl;
+          continue;
+        }
+        Analyze::unpack_training_set(infile, prefix);
         sync_cout << "Finished." << sync_endl;
       }
+      else if (token == "train_network") {KatyushaTrainer::train(is); sync_cout << "Finished." << sync_endl;}
+      else if (token == "td_train") {Analyze::td_train(is); sync_cout << "Finished." << sync_endl;}
       else if (token == "gen_training_positions")
       {
         string infile, ofile;
@@ -233,13 +270,17 @@ void UCI::loop(int argc, char* argv[]) {
         Analyze::gen_training_positions(infile, ofile, max_positions);
       }
       else if (token == "print_pos_rep") {Analyze::print_pos_rep(pos);}
+      else if (token == "bench_features") Analyze::bench_features(is);
+      else if (token == "quantization_error") KatyushaEngine::quantization_error(is);
+      else if (token == "convert_weights") KatyushaEngine::convert_weights(is);
+      else if (token == "evalcache") KatyushaEngine::eval_cache_stats();
       else if (token == "random_moves") {
         int nmoves;
         if (!(is >> nmoves)) nmoves = 1;
-        Analyze::random_moves(pos, nmoves);
+        Analyze::random_moves(pos, rng, setup_states(), nmoves);
         sync_cout << pos << sync_endl;
       }
-      else if (token == "random_capture") {Analyze::random_capture(pos); sync_cout << pos << sync_endl;}
+      else if (token == "random_capture") {Analyze::random_capture(pos, rng, setup_states()); sync_cout << pos << sync_endl;}
       else if (token == "perft")
       {
           int depth;
@@ -43,6 +43,11 @@ void on_logger(const Option& o) { start_logger(o); }
 void on_threads(const Option&) { Threads.read_uci_options(); }
 void on_tb_path(const Option& o) { Tablebases::init(o); }
 void on_weights_changed(const Option& o) {KatyushaEngine::setWeightsfile(Options["weightsfile"]);}
+void on_endgames(const Option& o) { KatyushaEngine::set_use_endgames(o); }
+void on_quantized(const Option& o) { KatyushaEngine::set_use_quantized(o); }
+void on_shared_weights(const Option& o) { KatyushaEngine::setSharedWeights(o); }
+void on_huge_pages(const Option& o) { KatyushaEngine::set_use_huge_pages(o); }
+void on_eval_cache(const Option& o) { for (Thread* th : Threads) th->evalCache.resize(o); }
 
 /// Our case insensitive less() function as required by UCI protocol
 bool CaseInsensitiveLess::operator() (const string& s1, const string& s2) const {
@@ -81,6 +86,28 @@ void init(OptionsMap& o) {
   //if katyusha learning is set, update weight file before every call to go
   //when weightsfile is changed, I should reload the weights
   o["weightsfile"] << Option("/home/benjamin/Katyusha/stockfish-7-linux/src/katyusha_weights.npz", on_weights_changed);
+  //score positions that have a specialized endgame evaluator (KBNK, KRKP, ...) with it instead of the network
+  o["Katyusha_Endgames"] << Option(true, on_endgames);
+  //evaluate with int16 weights, see quantization_error for how much that costs in accuracy
+  o["Katyusha_Quantized"] << Option(false, on_quantized);
+  //a native weight file, e.g. in /dev/shm or on hugetlbfs, that the engine processes of a box map to share one copy
+  //of the weights. The first process to set it creates it from its weights, the others use the one it created.
+  o["Katyusha_SharedWeights"] << Option("<empty>", on_shared_weights);
+  //back the native weight files loaded after this is set with huge pages
+  o["Katyusha_HugePages"] << Option(false, on_huge_pages);
+  //size in MB of each thread's cache of network evaluations, 0 to disable it
+  o["Katyusha_EvalCache"] << Option(4, 0, 1024, on_eval_cache);
+  //games the game list commands read: both players rated at least this (0 reads unrated games too) and one of these results
+  o["Katyusha_MinElo"] << Option(0, 0, 4000);
+  o["Katyusha_Results"] << Option("1-0 0-1 1/2-1/2 *");
+  //label training positions with a search to this depth, or of this many nodes, on all threads instead of the static evaluation
+  o["Katyusha_LabelDepth"] << Option(0, 0, 100);
+  o["Katyusha_LabelNodes"] << Option(0, 0, 100000000);
+  //gen_training_set: keep each position at most this many times (0 for no limit), sample the games in a random order
+  //instead of from the start of the file, and give this many game phase buckets an equal share of the positions
+  o["Katyusha_MaxRepeats"] << Option(0, 0, 15);
+  o["Katyusha_ShuffleGames"] << Option(false);
+  o["Katyusha_PhaseBuckets"] << Option(1, 1, 16);
 }
 
 